@@ -0,0 +1,30 @@
+// affinity.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+
+int affinityPin(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "No such cpu: %d\n", cpu);
+        return -1;
+    }
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+int affinitySteerListener(int socket, int cpu) {
+    if (setsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        perror("setsockopt SO_INCOMING_CPU");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+// affinity.h
+// Where the server runs.  The event loop can be pinned to one core, and its
+// listening socket told to take the connections whose packets the kernel
+// handles on that core.  Several servers sharing a port, one per core, then
+// keep each connection's packets, socket and state in a single core's cache
+// and never wake a loop on another core.
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#define AFFINITY_NONE -1
+
+// Pin the calling thread to cpu.  0, or -1 if the core can't be used.
+int affinityPin(int cpu);
+
+// SO_INCOMING_CPU on a listening socket: among the sockets sharing a port
+// (SO_REUSEPORT), new connections that arrive on cpu come to this one
+int affinitySteerListener(int socket, int cpu);
+
+#endif
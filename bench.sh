@@ -0,0 +1,34 @@
+#!/bin/bash
+# Replays a capture (server -C) at full speed against a fresh server, once
+# left to the scheduler and once with the event loop pinned (-A), and prints
+# the replay report of each run for comparison.  The replay client is pinned
+# to its own core in both runs, so only the server's placement differs.
+#
+# usage: ./bench.sh capture-file [port] [server cpu] [replay cpu]
+
+capture="$1"
+port="${2:-36700}"
+serverCpu="${3:-0}"
+replayCpu="${4:-$(( $(nproc) > 1 ? 1 : 0 ))}"
+
+if [ -z "$capture" ] || [ ! -f "$capture" ]; then
+    echo "usage: $0 capture-file [port] [server cpu] [replay cpu]" >&2
+    exit 1
+fi
+
+run() {
+    local label="$1"
+    shift
+    ./server "$@" "$port" > /dev/null &
+    local server=$!
+    sleep 0.5
+
+    echo "== $label =="
+    taskset -c "$replayCpu" ./replay -s 0 "$capture" localhost "$port"
+
+    kill "$server"
+    wait "$server" 2> /dev/null || true
+}
+
+run unpinned
+run pinned -A "$serverCpu"
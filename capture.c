@@ -0,0 +1,159 @@
+// capture.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "timerWheel.h"
+
+#define SESSION_TABLE_GROW 64
+
+static FILE *captureFile = NULL;
+static uint64_t startUs = 0;
+static uint32_t nextSession = 1;
+static uint32_t *sessions = NULL;       // session number by socket, 0 for none
+static int sessionTableSize = 0;
+static Timer flushTimer;
+
+static void writeRecord(uint32_t session, uint8_t event, uint8_t *pdu, int pduLen);
+static void flushCapture(Timer *timer, void *arg);
+static uint64_t nowUs(void);
+static void putUint64(uint8_t *out, uint64_t value);
+static uint64_t getUint64(uint8_t *in);
+
+int captureStart(const char *path) {
+    captureFile = fopen(path, "wb");
+    if (captureFile == NULL) {
+        perror("capture file");
+        return -1;
+    }
+    setvbuf(captureFile, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    uint32_t version = htonl(CAPTURE_VERSION);
+    fwrite(CAPTURE_MAGIC, 1, 4, captureFile);
+    fwrite(&version, sizeof(version), 1, captureFile);
+    startUs = nowUs();
+
+    // the buffer goes to disk at least this often, a killed server loses
+    // no more than that
+    timerInit(&flushTimer, flushCapture, NULL);
+    timerSchedule(&flushTimer, timerNowMs() + CAPTURE_FLUSH_MS);
+    printf("Capturing client traffic to %s\n", path);
+    return 0;
+}
+
+void captureOpen(int socket) {
+    if (captureFile == NULL) return;
+
+    if (socket >= sessionTableSize) {
+        int newSize = socket + SESSION_TABLE_GROW;
+        uint32_t *table = realloc(sessions, newSize * sizeof(uint32_t));
+        if (table == NULL) return;
+        memset(table + sessionTableSize, 0, (newSize - sessionTableSize) * sizeof(uint32_t));
+        sessions = table;
+        sessionTableSize = newSize;
+    }
+    sessions[socket] = nextSession++;
+    writeRecord(sessions[socket], CAPTURE_OPEN, NULL, 0);
+}
+
+void capturePDU(int socket, uint8_t *pdu, int pduLen) {
+    if (captureFile == NULL || socket >= sessionTableSize || sessions[socket] == 0) return;
+    writeRecord(sessions[socket], CAPTURE_PDU, pdu, pduLen);
+}
+
+void captureClose(int socket) {
+    if (captureFile == NULL || socket >= sessionTableSize || sessions[socket] == 0) return;
+    writeRecord(sessions[socket], CAPTURE_CLOSE, NULL, 0);
+    sessions[socket] = 0;
+}
+
+void captureStop(void) {
+    if (captureFile == NULL) return;
+    timerCancel(&flushTimer);
+    fclose(captureFile);
+    captureFile = NULL;
+}
+
+FILE *captureOpenFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("capture file");
+        return NULL;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, CAPTURE_MAGIC, 4) != 0
+            || fread(&version, sizeof(version), 1, file) != 1 || ntohl(version) != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+int captureRead(FILE *file, CaptureRecord *record, uint8_t *pdu) {
+    uint8_t header[CAPTURE_RECORD_HEADER];
+    size_t got = fread(header, 1, CAPTURE_RECORD_HEADER, file);
+    if (got == 0) return 0;
+    if (got != CAPTURE_RECORD_HEADER) return -1;
+
+    uint32_t session;
+    uint16_t length;
+    record->timeUs = getUint64(header);
+    memcpy(&session, header + 8, sizeof(session));
+    record->session = ntohl(session);
+    record->event = header[12];
+    memcpy(&length, header + 13, sizeof(length));
+    record->length = ntohs(length);
+
+    if (record->length > 0 && fread(pdu, 1, record->length, file) != record->length) {
+        return -1;
+    }
+    return 1;
+}
+
+static void writeRecord(uint32_t session, uint8_t event, uint8_t *pdu, int pduLen) {
+    uint8_t header[CAPTURE_RECORD_HEADER];
+    uint32_t sessionField = htonl(session);
+    uint16_t lengthField = htons(pduLen);
+
+    putUint64(header, nowUs() - startUs);
+    memcpy(header + 8, &sessionField, sizeof(sessionField));
+    header[12] = event;
+    memcpy(header + 13, &lengthField, sizeof(lengthField));
+
+    fwrite(header, 1, CAPTURE_RECORD_HEADER, captureFile);
+    if (pduLen > 0) {
+        fwrite(pdu, 1, pduLen, captureFile);
+    }
+}
+
+static void flushCapture(Timer *timer, void *arg) {
+    fflush(captureFile);
+    timerSchedule(timer, timerNowMs() + CAPTURE_FLUSH_MS);
+}
+
+static uint64_t nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void putUint64(uint8_t *out, uint64_t value) {
+    uint32_t high = htonl(value >> 32);
+    uint32_t low = htonl(value & 0xffffffff);
+    memcpy(out, &high, sizeof(high));
+    memcpy(out + 4, &low, sizeof(low));
+}
+
+static uint64_t getUint64(uint8_t *in) {
+    uint32_t high;
+    uint32_t low;
+    memcpy(&high, in, sizeof(high));
+    memcpy(&low, in + 4, sizeof(low));
+    return ((uint64_t)ntohl(high) << 32) | ntohl(low);
+}
@@ -0,0 +1,47 @@
+// capture.h
+// Traffic capture for benchmarking.  The server records every PDU clients
+// send, with a timestamp and a session number, and the replay tool plays
+// the sessions back against another server.
+//
+// File: "CCAP", version (4 bytes), then records of
+//     time (8 bytes, us since the capture started), session (4 bytes),
+//     event (1 byte), length (2 bytes), PDU (length bytes, flag onward)
+// all in network byte order.  OPEN and CLOSE records have length 0.
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "CCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_RECORD_HEADER 15
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)      // stdio buffer, writes leave in big blocks
+#define CAPTURE_FLUSH_MS 1000
+
+typedef enum {
+    CAPTURE_OPEN = 1,
+    CAPTURE_PDU = 2,
+    CAPTURE_CLOSE = 3,
+} CaptureEvent;
+
+typedef struct CaptureRecord {
+    uint64_t timeUs;
+    uint32_t session;
+    uint8_t event;
+    uint16_t length;
+} CaptureRecord;
+
+// Server side (no-ops until captureStart())
+int captureStart(const char *path);
+void captureOpen(int socket);
+void capturePDU(int socket, uint8_t *pdu, int pduLen);
+void captureClose(int socket);
+void captureStop(void);
+
+// Reading a capture back.  captureRead() returns 1 with the record and
+// its PDU in pdu (room for UINT16_MAX bytes), 0 at the end, -1 if corrupt.
+FILE *captureOpenFile(const char *path);
+int captureRead(FILE *file, CaptureRecord *record, uint8_t *pdu);
+
+#endif
@@ -6,6 +6,7 @@
 * 
 *****************************************************************************/
 
+#define _GNU_SOURCE     // sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -21,19 +22,39 @@
 #include <netdb.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
 
 #include "networks.h"
 #include "safeUtil.h"
 #include "pdu.h"
 #include "pollLib.h"
+#include "connection.h"
+#include "timerWheel.h"
+#include "pduSchema.h"
+#include "resolver.h"
 
 #define SEND_MAXBUF 200
+#define PDU_MAXBUF 1024                 // the server's limit for one PDU
 #define RECV_MAXBUF 1500
 #define MAX_INPUT_SIZE 1400
 #define DEBUG_FLAG 1
 #define MAX_HANDLES 9
 #define MAX_HANDLE_LENGTH 100
 #define MAX_MESSAGE_SIZE 199
+#define BATCH_READ_SIZE 65536
+#define BATCH_HIGH_WATER (1024 * 1024)   // stop reading commands above this much queued output
+#define BATCH_LOW_WATER (256 * 1024)     // and start again below this
+#define UDP_ID_LEN 4
+#define UDP_BATCH 64                     // datagrams per sendmmsg() in batch mode
+#define UDP_RECV_BUFFER (1024 * 1024)    // room for a burst of broadcasts while we print
+#define RESUME_FIRST_BACKOFF_MS 100
+#define RESUME_MAX_BACKOFF_MS 1000
+#define REDIRECT_MAX_HOPS 4             // redirects in a row before giving up
+#define REDIRECT_FIRST_BACKOFF_MS 100   // wait before the second, doubling
 
 // ----- Lab Functions -----
 void clientControl(char *handle, int socketNum); 
@@ -41,10 +62,55 @@ void processStdin(char *handle, int socketNum);
 void processMsgFromServer(int socketNum); 
 int readFromStdin(uint8_t *buffer);
 void sendToServer(int socketNum);
-void checkArgs(int argc, char *argv[]);
+int checkArgs(int argc, char *argv[]);
 
 char handleNames[MAX_HANDLES][MAX_HANDLE_LENGTH];
 bool shouldDisplayPrompt = true; 
+
+// ----- Batch Mode -----
+// Commands come from stdin (-B) or a file (-f) in large chunks, every line
+// in a chunk is queued and the whole chunk goes out with one flush.
+bool batchMode = false;
+char *commandFile = NULL;
+int inputFd = STDIN_FILENO;
+char batchInput[BATCH_READ_SIZE + 1];
+int batchInputLen = 0;
+bool inputPaused = false;
+bool inputDone = false;
+
+// Recent broadcasts to ask the server for when registering (-H)
+int historyRequest = 0;
+
+// Our handle, to register again when a cluster node redirects us
+char *clientHandle = NULL;
+int redirectHops = 0;           // since the last CONFIRM
+
+// -L: a server on this host, reached through its UNIX domain socket
+char *localPath = NULL;
+
+// The server we are on now, to dial again after a dropped connection
+char serverHost[UINT8_MAX + 1];
+char serverPort[UINT8_MAX + 1];
+
+// ----- Resumption -----
+// A server with -G hands us a token.  If the connection drops we dial back
+// within its grace window and show the token: the handle is still ours and
+// what was sent to us meanwhile is waiting.
+uint8_t resumeToken[UINT8_MAX];
+int resumeTokenLen = 0;
+uint32_t resumeGraceMs = 0;
+
+// ----- UDP -----
+// With -U broadcasts go both ways as datagrams once the server confirms our
+// port.  A server without -U never does, and everything stays on TCP.
+bool udpMode = false;
+int udpSocket = -1;
+bool udpReady = false;
+uint32_t udpId = 0;                     // network order, starts every datagram we send
+uint8_t udpPending[UDP_BATCH][UDP_ID_LEN + PDU_MAXBUF];
+struct iovec udpIov[UDP_BATCH];
+struct mmsghdr udpMessages[UDP_BATCH];
+int udpPendingCount = 0;
 // static bool waitForServerResponse = false;
 // static bool displayPrompt = true;
 
@@ -55,79 +121,168 @@ void sendMessage(char *handle, int socketNum, char* destination, char *message);
 void broadcast(char* handle, int socketNum, char *message); 
 void sendMulticast(char *handle, int socketNum, int numHandles, char * message); 
 void ccList(char *handle, int socketNum); 
+void sendRoomCommand(int socketNum, uint8_t flag, char *room);
+void sendRoomMessage(char *handle, int socketNum, char *room, char *message);
+
+// ----- Batch Functions -----
+void processBatchInput(char *handle, int socketNum);
+int clientSendPDU(int socketNum, uint8_t *pdu, int pduLen);
+void sendEncoded(int socketNum, uint8_t *pdu, int pduLen);
+void flushToServer(int socketNum);
+void processServerPDU(int socketNum, uint8_t *pdu, int pduLen);
+
+// ----- UDP Functions -----
+void udpRegister(int socketNum);
+int udpSendPDU(uint8_t *pdu, int pduLen);
+void udpFlush(void);
+void processDatagrams(int socketNum);
+
+// ----- Resumption Functions -----
+bool resumeSession(int socketNum);
+int dialServer(void);
 
 // ----- helper Functions -----
+void processLine(char *handle, int socketNum, char *line, int lineLen);
 bool parseM(char *data, char *destinationHandle, char *message); 
 int parseC(char *data, char *message);  
 
 void processCommand(char *handle, int socketNum, char cmdChar, char *text);
-void processRecvMessage(uint8_t *pdu, int pduLen, int offset); 
-void processHandleError(uint8_t *pdu, int pduLen, int offset) ;
-void processCount(uint8_t *pdu, int pduLen, int offset);
-void processHandle(uint8_t *pdu, int pduLen, int offset); 
-void processHandleReject(uint8_t *pdu, int pduLen, int offset, int socketNum);
-void processMultiCast(uint8_t *pdu, int pduLen, int offset);
-void processBroadcast(uint8_t *pdu, int pduLen, int offset); 
+void processRecvMessage(int socketNum, const PduMessage *message, uint8_t *pdu, int pduLen); 
+void processHandleError(int socketNum, const PduHandleError *error, uint8_t *pdu, int pduLen);
+void processCount(int socketNum, const PduListCount *count, uint8_t *pdu, int pduLen);
+void processHandle(int socketNum, const PduListHandle *handle, uint8_t *pdu, int pduLen); 
+void processHandleReject(int socketNum, const PduReject *reject, uint8_t *pdu, int pduLen);
+void processMultiCast(int socketNum, const PduMulticast *multicast, uint8_t *pdu, int pduLen);
+void processBroadcast(int socketNum, const PduBroadcast *broadcast, uint8_t *pdu, int pduLen); 
+void processRoomMessage(int socketNum, const PduRoomMessage *message, uint8_t *pdu, int pduLen);
+void processRoomError(int socketNum, const PduRoomError *error, uint8_t *pdu, int pduLen);
+void processRedirect(int socketNum, const PduRedirect *redirect, uint8_t *pdu, int pduLen);
+void processConfirm(int socketNum, const PduConfirm *confirm, uint8_t *pdu, int pduLen);
+void processListEnd(int socketNum, const PduListEnd *end, uint8_t *pdu, int pduLen);
+void processThrottled(int socketNum, const PduThrottled *throttled, uint8_t *pdu, int pduLen);
+void processUdpConfirm(int socketNum, const PduUdpConfirm *confirm, uint8_t *pdu, int pduLen);
+void processResumeToken(int socketNum, const PduResumeToken *token, uint8_t *pdu, int pduLen);
+
+// What the server can send, and its handler
+#define CLIENT_PDUS(X) \
+    X(Confirm,      processConfirm) \
+    X(Reject,       processHandleReject) \
+    X(Broadcast,    processBroadcast) \
+    X(Message,      processRecvMessage) \
+    X(Multicast,    processMultiCast) \
+    X(HandleError,  processHandleError) \
+    X(ListCount,    processCount) \
+    X(ListHandle,   processHandle) \
+    X(ListEnd,      processListEnd) \
+    X(RoomMessage,  processRoomMessage) \
+    X(RoomError,    processRoomError) \
+    X(Redirect,     processRedirect) \
+    X(Throttled,    processThrottled) \
+    X(UdpConfirm,   processUdpConfirm) \
+    X(ResumeToken,  processResumeToken)
+
+CLIENT_PDUS(PDU_DISPATCHER)
+
+// ...by flag
+const PduHandler serverHandlers[PDU_FLAG_COUNT] = {
+    CLIENT_PDUS(PDU_ROUTE)
+};
 
 
 int main(int argc, char * argv[])
 {
 	int socketNum = 0;
-	checkArgs(argc, argv);
-	socketNum = tcpClientSetup(argv[2], argv[3], DEBUG_FLAG);
-	clientControl(argv[1], socketNum);	
+	int argIndex = checkArgs(argc, argv);
+	if (localPath != NULL) {
+		socketNum = unixClientSetup(localPath, DEBUG_FLAG);
+	} else {
+		socketNum = tcpClientSetup(argv[argIndex + 1], argv[argIndex + 2], DEBUG_FLAG);
+		snprintf(serverHost, sizeof(serverHost), "%s", argv[argIndex + 1]);
+		snprintf(serverPort, sizeof(serverPort), "%s", argv[argIndex + 2]);
+	}
+	clientControl(argv[argIndex], socketNum);	
 	close(socketNum);
 	return 0;
 }
 
 
 void clientControl(char * handle, int socketNum){
+	clientHandle = handle;
 	initialPacket(socketNum, handle);
 
+	// From here on the socket never blocks: PDUs from the server are framed
+	// out of a receive buffer and sends queue until POLLOUT
+	fcntl(socketNum, F_SETFL, fcntl(socketNum, F_GETFL) | O_NONBLOCK);
+	timerWheelInit();
+	connSetLimits(0, 0, SLOW_DROP_NEWEST);
+	connOpen(socketNum);
+
+	if (commandFile != NULL) {
+		inputFd = open(commandFile, O_RDONLY);
+		if (inputFd < 0) {
+			perror("open command file");
+			exit(-1);
+		}
+	}
+
 	setupPollSet();
-	addToPollSet(STDIN_FILENO);	// Monitor user input
+	addToPollSet(inputFd);		// Monitor user input
 	addToPollSet(socketNum); 	// Monsitor server messages
+	if (udpMode) {
+		udpRegister(socketNum);
+	}
 
 	while(1){
-        printf("clientControl\n"); 
-        if (shouldDisplayPrompt) {
+        if (shouldDisplayPrompt && !batchMode) {
             printf("$: "); // Display the prompt only if not awaiting response
             fflush(stdout); // Flush the output buffer
             shouldDisplayPrompt = false; 
         }		
 		
-		int socketNumber = pollCall(-1); 
-		printf("pollCall returned socketNumber: %d\n", socketNumber);
-
-		if(socketNumber < 0){
-			printf("pollCall failed\n"); 
-			exit(-1); 
-		}
-// ----- Read STDIN -----
-        if (socketNumber == STDIN_FILENO) {
-            printf("Processing stdin...\n");
-            processStdin(handle, socketNum); // Pass the server socket to send user input
-        }
+		pollCallAll(-1); 
+
+		// Walk every ready fd - input that is always readable (a file) must
+		// not starve the server socket
+		int socketNumber = 0;
+		int revents = 0;
+		while ((socketNumber = pollNextReady(&revents)) >= 0) {
+// ----- Read Input -----
+			if (socketNumber == inputFd) {
+				if (batchMode) {
+					processBatchInput(handle, socketNum);
+				} else {
+					processStdin(handle, socketNum); // Pass the server socket to send user input
+				}
+			}
 // ----- Message From Server -----
-        else if (socketNumber == socketNum) {
-            printf("Processing server message...\n");
-            processMsgFromServer(socketNum);
-        }
+			else if (socketNumber == socketNum) {
+				if (revents & POLLOUT) {
+					flushToServer(socketNum);
+				}
+				if (revents & (POLLIN | POLLHUP | POLLERR)) {
+					processMsgFromServer(socketNum);
+				}
+			}
+// ----- Datagrams From Server -----
+			else if (socketNumber == udpSocket) {
+				processDatagrams(socketNum);
+			}
+		}
 	}
 }
 
 
 void initialPacket(int socketNum, char * handle){
-    uint8_t handleLength = strlen(handle);
-    uint8_t pdu[SEND_MAXBUF];
+    uint8_t pdu[PDU_MAXBUF];
     int pduLen = 0;
-    pdu[pduLen++] = FLAG_CLIENT_TO_SEVER_INITIAL; // Use the correct flag for initial connection
-// ------ Insert: Handle Length,  Handle -----
-    pdu[pduLen++] = handleLength;
-    memcpy(pdu + pduLen, handle, handleLength);
-    pduLen += handleLength; 
+// ----- Handle, then the history count if one was asked for -----
+    if (historyRequest > 0) {
+        pduLen = pduEncodeInitialHistory(pdu, sizeof(pdu), pduViewOf(handle), historyRequest);
+    } else {
+        pduLen = pduEncodeInitial(pdu, sizeof(pdu), pduViewOf(handle));
+    }
 // ----- Send the PDU -----
-    if (sendPDU(socketNum, pdu, pduLen) < 0) {
+    if (pduLen < 0 || sendPDU(socketNum, pdu, pduLen) < 0) {
         perror("Failed to send initial connection packet");
         exit(-1);
     }
@@ -138,16 +293,20 @@ void processStdin(char * handle, int socketNum){
     uint8_t sendBuf[RECV_MAXBUF];   // Adjust this if needed to MAX_INPUT_SIZE
     int sendLen = 0;
     sendLen = readFromStdin(sendBuf);
+    processLine(handle, socketNum, (char *)sendBuf, sendLen);
+}
 
-    if ((sendBuf[1] == 'l' || sendBuf[1] == 'L') && sendBuf[0] == '%') {
+void processLine(char *handle, int socketNum, char *line, int lineLen){
+    // One "%X ..." command line, without its newline
+    if (lineLen >= 2 && line[0] == '%' && (line[1] == 'l' || line[1] == 'L')) {
     ccList(handle, socketNum);
     }
-    else if (sendLen > 1) { // Check for more than just a newline
-        sendBuf[sendLen - 1] = '\0'; // Remove the trailing newline added by readFromStdin
+    else if (lineLen > 1) { // Check for more than just a newline
+        line[lineLen] = '\0';
 
-        if (sendBuf[0] == '%' && sendBuf[2] == ' ') {
-            char cmdChar = sendBuf[1];
-            char *message = (char *)sendBuf + 3; // Skipping "%X " to start text after space
+        if (lineLen >= 3 && line[0] == '%' && line[2] == ' ') {
+            char cmdChar = line[1];
+            char *message = line + 3; // Skipping "%X " to start text after space
             processCommand(handle, socketNum, cmdChar, message);
         } else {
             printf("No command detected.\n");
@@ -157,6 +316,241 @@ void processStdin(char * handle, int socketNum){
     }
 }
 
+// ----- Batch Functions -----
+
+void processBatchInput(char *handle, int socketNum){
+    // Read a large chunk, queue the PDUs for every complete line in it, then
+    // flush them together.  A partial last line waits for the next chunk.
+    int bytesRead = read(inputFd, batchInput + batchInputLen, BATCH_READ_SIZE - batchInputLen);
+    if (bytesRead < 0) {
+        if (errno == EINTR || errno == EAGAIN) return;
+        perror("read command input");
+        bytesRead = 0;
+    }
+
+    inputDone = (bytesRead == 0);
+    batchInputLen += bytesRead;
+
+    int lineStart = 0;
+    for (int i = 0; i < batchInputLen; i++) {
+        if (batchInput[i] == '\n') {
+            processLine(handle, socketNum, batchInput + lineStart, i - lineStart);
+            lineStart = i + 1;
+        }
+    }
+
+    // a line longer than the whole buffer, or no newline before EOF
+    if (lineStart == 0 && (batchInputLen == BATCH_READ_SIZE || inputDone) && batchInputLen > 0) {
+        processLine(handle, socketNum, batchInput, batchInputLen);
+        lineStart = batchInputLen;
+    }
+
+    memmove(batchInput, batchInput + lineStart, batchInputLen - lineStart);
+    batchInputLen -= lineStart;
+
+    if (inputDone) {
+        removeFromPollSet(inputFd);
+    }
+    flushToServer(socketNum);
+}
+
+int clientSendPDU(int socketNum, uint8_t *pdu, int pduLen){
+    // Interactive commands go out right away (or queue if the socket is
+    // full), batch commands queue until the chunk is done
+    int result = batchMode ? connQueuePDU(socketNum, pdu, pduLen) : connSendPDU(socketNum, pdu, pduLen);
+    if (result < 0 && resumeSession(socketNum)) {
+        result = connQueuePDU(socketNum, pdu, pduLen);
+    }
+    if (result < 0) {
+        printf("\n---Lost connection to server---\n");
+        exit(-1);
+    }
+    return result;
+}
+
+void flushToServer(int socketNum){
+    udpFlush();
+    int queued = connFlush(socketNum);
+    if (queued < 0 && resumeSession(socketNum)) {
+        return;
+    }
+    if (queued < 0) {
+        printf("\n---Lost connection to server---\n");
+        exit(-1);
+    }
+
+    // Flow control for batch input: don't read commands faster than the
+    // server takes them
+    if (batchMode && !inputDone) {
+        if (!inputPaused && queued > BATCH_HIGH_WATER) {
+            removeFromPollSet(inputFd);
+            inputPaused = true;
+        } else if (inputPaused && queued < BATCH_LOW_WATER) {
+            addToPollSet(inputFd);
+            inputPaused = false;
+        }
+    }
+
+    // Done sending - half close and keep printing what the server sends
+    // until it closes its side
+    if (inputDone && queued == 0) {
+        shutdown(socketNum, SHUT_WR);
+        inputDone = false;
+        batchMode = false;
+    }
+}
+
+// ----- UDP Functions -----
+
+void udpRegister(int socketNum){
+    // Datagrams go to and come from the server's address at the same port
+    // as its listener; connect() makes the kernel drop anyone else's
+    struct sockaddr_in6 server;
+    struct sockaddr_in6 local;
+    socklen_t addressLen = sizeof(server);
+    udpFlush();
+    udpReady = false;
+    if (udpSocket < 0) {
+        if ((udpSocket = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+            perror("UDP socket");
+            return;
+        }
+        int bufferSize = UDP_RECV_BUFFER;
+        setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+        addToPollSet(udpSocket);
+    }
+    if (getpeername(socketNum, (struct sockaddr *)&server, &addressLen) < 0
+            || connect(udpSocket, (struct sockaddr *)&server, addressLen) < 0) {
+        perror("UDP connect");
+        return;
+    }
+    addressLen = sizeof(local);
+    getsockname(udpSocket, (struct sockaddr *)&local, &addressLen);
+
+    uint8_t pdu[PDU_MAXBUF];
+    sendEncoded(socketNum, pdu, pduEncodeUdpRegister(pdu, sizeof(pdu), ntohs(local.sin6_port)));
+}
+
+int udpSendPDU(uint8_t *pdu, int pduLen){
+    // -1 if it has to go over TCP instead.  Batch mode gathers datagrams for
+    // one sendmmsg(), interactive ones go right away.
+    if (!udpReady || pduLen < 0) {
+        return -1;
+    }
+    if (batchMode) {
+        if (udpPendingCount == UDP_BATCH) {
+            udpFlush();
+        }
+        uint8_t *datagram = udpPending[udpPendingCount];
+        memcpy(datagram, &udpId, UDP_ID_LEN);
+        memcpy(datagram + UDP_ID_LEN, pdu, pduLen);
+        udpIov[udpPendingCount].iov_base = datagram;
+        udpIov[udpPendingCount].iov_len = UDP_ID_LEN + pduLen;
+        udpPendingCount++;
+        return 0;
+    }
+    struct iovec iov[2] = { { &udpId, UDP_ID_LEN }, { pdu, pduLen } };
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = 2 };
+    return sendmsg(udpSocket, &message, 0) < 0 ? -1 : 0;
+}
+
+void udpFlush(void){
+    // The socket blocks, so a long batch is paced by the kernel instead of
+    // dropped here
+    memset(udpMessages, 0, udpPendingCount * sizeof(struct mmsghdr));
+    for (int i = 0; i < udpPendingCount; i++) {
+        udpMessages[i].msg_hdr.msg_iov = &udpIov[i];
+        udpMessages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int done = 0;
+    while (done < udpPendingCount) {
+        int sent = sendmmsg(udpSocket, udpMessages + done, udpPendingCount - done, 0);
+        if (sent < 0 && errno != EINTR) {
+            perror("sendmmsg");
+            break;
+        }
+        done += sent > 0 ? sent : 0;
+    }
+    udpPendingCount = 0;
+}
+
+void processDatagrams(int socketNum){
+    // Each datagram is one bare PDU; a batch of them at most, then the
+    // other fds get their turn
+    uint8_t pdu[RECV_MAXBUF];
+    for (int i = 0; i < UDP_BATCH; i++) {
+        int pduLen = recv(udpSocket, pdu, sizeof(pdu), MSG_DONTWAIT);
+        if (pduLen <= 0) {
+            break;
+        }
+        processServerPDU(socketNum, pdu, pduLen);
+    }
+}
+
+// ----- Resumption Functions -----
+
+bool resumeSession(int socketNum){
+    // false if there is nothing to resume or the window ran out, and the
+    // caller gives up as before
+    if (resumeTokenLen == 0) {
+        return false;
+    }
+    PduView token = { resumeToken, resumeTokenLen };
+    resumeTokenLen = 0;             // the resumed session comes with a new one
+    printf("\n---Connection lost, resuming---\n");
+
+    uint64_t deadline = timerNowMs() + resumeGraceMs;
+    int backoffMs = RESUME_FIRST_BACKOFF_MS;
+    while (timerNowMs() < deadline) {
+        usleep(backoffMs * 1000);
+        backoffMs = backoffMs * 2 < RESUME_MAX_BACKOFF_MS ? backoffMs * 2 : RESUME_MAX_BACKOFF_MS;
+
+        int newSocket = dialServer();
+        if (newSocket < 0) {
+            continue;
+        }
+        // same descriptor number, like a redirect
+        connClose(socketNum);
+        dup2(newSocket, socketNum);
+        close(newSocket);
+
+        uint8_t pdu[PDU_MAXBUF];
+        int pduLen = pduEncodeResume(pdu, sizeof(pdu), pduViewOf(clientHandle), token);
+        if (pduLen < 0 || sendPDU(socketNum, pdu, pduLen) < 0) {
+            continue;
+        }
+        fcntl(socketNum, F_SETFL, fcntl(socketNum, F_GETFL) | O_NONBLOCK);
+        connOpen(socketNum);
+        if (udpMode) {
+            udpRegister(socketNum);
+        }
+        return true;
+    }
+    printf("---Could not resume---\n");
+    return false;
+}
+
+int dialServer(void){
+    // Like the first connect, except that failing is only one failed try
+    if (localPath != NULL) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", localPath);
+        int local = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (local >= 0 && connect(local, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            close(local);
+            local = -1;
+        }
+        return local;
+    }
+    Resolved resolved;
+    if (resolverLookup(serverHost, serverPort, &resolved) < 0) {
+        return -1;
+    }
+    return resolverConnect(&resolved);
+}
+
 // ----- Parse Functions -----
 
 int readFromStdin(uint8_t * buffer)
@@ -177,20 +571,59 @@ int readFromStdin(uint8_t * buffer)
     return inputLen;
 }
 
-void checkArgs(int argc, char * argv[])
+int checkArgs(int argc, char * argv[])
 {
-	/* check command line arguments  */
-	if (argc != 4)
+	/* check command line arguments, returns the index of the handle */
+	int option = 0;
+
+	while ((option = getopt(argc, argv, "Bf:H:UL:")) != -1)
+	{
+		switch (option)
+		{
+			case 'B':
+				batchMode = true;
+				break;
+			case 'f':
+				batchMode = true;
+				commandFile = optarg;
+				break;
+			case 'H':
+				historyRequest = atoi(optarg);
+				if (historyRequest < 0 || historyRequest > UINT16_MAX) {
+					printf("History count must be 0 to %d\n", UINT16_MAX);
+					exit(1);
+				}
+				break;
+			case 'U':
+				udpMode = true;
+				break;
+			case 'L':
+				localPath = optarg;
+				break;
+			default:
+				printf("usage: %s [-B | -f command-file] [-H history count] [-U]\n\t[-L socket-path] handle [server-host-name server-port-number]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	// a local server needs no host and port
+	if (argc - optind != (localPath != NULL ? 1 : 3))
 	{
-		printf("usage: %s handle server-host-name server-port-number \n", argv[0]);
+		printf("usage: %s [-B | -f command-file] [-H history count] [-U]\n\t[-L socket-path] handle [server-host-name server-port-number]\n", argv[0]);
 		exit(1);
 	}
 
-	if(strlen(argv[1]) > 100){
-		printf("Invalid handle, handle longer than 100 characters: <%s>\n", argv[1]);
+	if (udpMode && localPath != NULL) {
+		printf("A local server has no UDP port, -U is off\n");
+		udpMode = false;
+	}
+
+	if(strlen(argv[optind]) > 100){
+		printf("Invalid handle, handle longer than 100 characters: <%s>\n", argv[optind]);
 		exit(1);
 	}
 
+	return optind;
 }
 
 int parseC(char *data, char *message){
@@ -292,6 +725,20 @@ void processCommand(char * handle, int socketNum, char cmdChar, char *data) {
                 shouldDisplayPrompt = true; 
             }
             break;
+        case 'J':
+        case 'j':
+            sendRoomCommand(socketNum, FLAG_ROOM_JOIN, data);
+            break;
+        case 'E':
+        case 'e':
+            sendRoomCommand(socketNum, FLAG_ROOM_LEAVE, data);
+            break;
+        case 'R':
+        case 'r':
+            if (parseM(data, destinationHandle, message)) {
+                sendRoomMessage(handle, socketNum, destinationHandle, message);
+            }
+            break;
         default:
             printf("Invalid command: %c\n", cmdChar);
             break;
@@ -299,89 +746,72 @@ void processCommand(char * handle, int socketNum, char cmdChar, char *data) {
 }
 
 // ----- Send Functions -----
+// Long messages go out in MAX_MESSAGE_SIZE pieces, one PDU each
 
 void broadcast(char* handle, int socketNum, char *message){
-    uint8_t messageLength = strlen(message); 
-    uint8_t handleLength = strlen(handle);
+    int messageLength = strlen(message); 
     int offset = 0; 
     while(offset < messageLength){
-        uint8_t pdu[SEND_MAXBUF];
-        int pduLen = 0;
-        pdu[pduLen++] = FLAG_BROADCAST;  
-
-// ----- Sender: Handle Length, Handle Name -----
-        pdu[pduLen++] = handleLength;
-        memcpy(pdu + pduLen, handle, handleLength);
-        pduLen += handleLength; 
-// ----- Insert Message -----
+        uint8_t pdu[PDU_MAXBUF];
         int currentLength = (messageLength - offset > MAX_MESSAGE_SIZE ) ? MAX_MESSAGE_SIZE : messageLength - offset; 
-        memcpy(pdu + pduLen, message + offset, currentLength); 
-        pduLen += currentLength; 
-// ----- sendPDU -----
-        if (sendPDU(socketNum, pdu, pduLen) < 0) {
-            perror("Failed to send PDU");
-            exit(-1);
+        PduView text = { (uint8_t *)message + offset, currentLength };
+        int pduLen = pduEncodeBroadcast(pdu, sizeof(pdu), pduViewOf(handle), text);
+        if (udpSendPDU(pdu, pduLen) < 0) {
+            sendEncoded(socketNum, pdu, pduLen);
         }
         offset += currentLength;
-
     }
 }
 
 
 void ccList(char *handle, int socketNum){
-    uint8_t handleLength = strlen(handle);
-    uint8_t pdu[SEND_MAXBUF];
-    int pduLen = 0;
-// ----- Insert Flag -----
-    pdu[pduLen++] = FLAG_LIST; 
-// ----- Sender: Handle Length, Handle Name -----
-    pdu[pduLen++] = handleLength;
-    memcpy(pdu + pduLen, handle, handleLength);
-    pduLen += handleLength; 
-// ----- sendPDU -----
-    if (sendPDU(socketNum, pdu, pduLen) < 0) {
-        perror("Failed to send PDU");
-        exit(-1);
+    uint8_t pdu[PDU_MAXBUF];
+    sendEncoded(socketNum, pdu, pduEncodeList(pdu, sizeof(pdu), pduViewOf(handle)));
+}
+
+// %J room, %E room: join or leave (exit) a room
+void sendRoomCommand(int socketNum, uint8_t flag, char *room){
+    int roomLength = strlen(room);
+    if (roomLength == 0 || roomLength > MAX_HANDLE_LENGTH) {
+        printf("Error: Room name must be 1 to %d characters.\n", MAX_HANDLE_LENGTH);
+        return;
+    }
+    uint8_t pdu[PDU_MAXBUF];
+    if (flag == FLAG_ROOM_JOIN) {
+        sendEncoded(socketNum, pdu, pduEncodeRoomJoin(pdu, sizeof(pdu), pduViewOf(room)));
+    } else {
+        sendEncoded(socketNum, pdu, pduEncodeRoomLeave(pdu, sizeof(pdu), pduViewOf(room)));
     }
 }
 
-void sendMulticast(char *handle, int socketNum, int numHandles, char * message){
-    uint8_t handleLength = strlen(handle);
-    uint8_t messageLength = strlen(message);
-    uint8_t offset = 0; 
-// ----- Fragmentation -----
+// %R room message: to everyone else in the room
+void sendRoomMessage(char *handle, int socketNum, char *room, char *message){
+    int messageLength = strlen(message);
+    int offset = 0;
     while(offset < messageLength){
-        uint8_t pdu[SEND_MAXBUF]; 
-        int pduLen = 0; 
-// ----- Insert Flag ----- Sender: Handle Length, Handle Name -----
-        pdu[pduLen++] = FLAG_MULTICAST;    
-        pdu[pduLen++] = handleLength;
-        memcpy(pdu + pduLen, handle, handleLength);
-        pduLen += handleLength;   
-// ----- Number of Handles -----
-        pdu[pduLen++] = numHandles;      
-        for(int i = 0; i < numHandles; i++){
-            if(strlen(handleNames[i]) > MAX_HANDLE_LENGTH){
-                printf("Error: Handle %s exceeds maximum length of %d characters.\n", handleNames[i], MAX_HANDLE_LENGTH);
-                return; 
-
-            }
-            int destinationHandleLength = strlen(handleNames[i]);
-            pdu[pduLen++] = destinationHandleLength; 
-            memcpy(pdu + pduLen, handleNames[i], destinationHandleLength); 
-            pduLen += destinationHandleLength; 
-            printf("Handle %d: %s (Length: %d)\n", i + 1, handleNames[i], destinationHandleLength);
-        }
-// ----- Message -----
+        uint8_t pdu[PDU_MAXBUF];
         int currentLength = (messageLength - offset > MAX_MESSAGE_SIZE ) ? MAX_MESSAGE_SIZE : messageLength - offset; 
-        memcpy(pdu + pduLen, message + offset, currentLength); 
-        pduLen += currentLength; 
+        PduView text = { (uint8_t *)message + offset, currentLength };
+        sendEncoded(socketNum, pdu, pduEncodeRoomMessage(pdu, sizeof(pdu), pduViewOf(handle), pduViewOf(room), text));
+        offset += currentLength; 
+    }
+}
 
-// ----- sendPDU -----
-        if (sendPDU(socketNum, pdu, pduLen) < 0) {
-            perror("Failed to send PDU");
-            exit(-1);
-        }
+void sendMulticast(char *handle, int socketNum, int numHandles, char * message){
+    PduView destinations[MAX_HANDLES];
+    for(int i = 0; i < numHandles; i++){
+        destinations[i] = pduViewOf(handleNames[i]);
+        printf("Handle %d: %s (Length: %d)\n", i + 1, handleNames[i], destinations[i].length);
+    }
+    PduViewList destinationList = { numHandles, destinations };
+
+    int messageLength = strlen(message);
+    int offset = 0; 
+    while(offset < messageLength){
+        uint8_t pdu[PDU_MAXBUF]; 
+        int currentLength = (messageLength - offset > MAX_MESSAGE_SIZE ) ? MAX_MESSAGE_SIZE : messageLength - offset; 
+        PduView text = { (uint8_t *)message + offset, currentLength };
+        sendEncoded(socketNum, pdu, pduEncodeMulticast(pdu, sizeof(pdu), pduViewOf(handle), destinationList, text));
         offset += currentLength; 
     }
 }
@@ -389,199 +819,218 @@ void sendMulticast(char *handle, int socketNum, int numHandles, char * message){
 
 void sendMessage(char *handle, int socketNum, char *destinationHandle, char *message) {
     printf("sendMessage\n");
-    uint8_t handleLength = strlen(handle);
-    uint8_t destinationHandleLength = strlen(destinationHandle); 
-    uint8_t messageLength = strlen(message); 
-    uint8_t offset = 0; 
+    PduView destination = pduViewOf(destinationHandle);
+    PduViewList destinationList = { 1, &destination };
 
-// ----- Fragmentation -----
+    int messageLength = strlen(message); 
+    int offset = 0; 
     while(offset < messageLength){
-        uint8_t pdu[SEND_MAXBUF];
-        int pduLen = 0;
-
-// ----- Insert Flag -----
-        pdu[pduLen++] = FLAG_MESSAGE;  
-
-// ----- Sender: Handle Length, Handle Name -----
-        pdu[pduLen++] = handleLength;
-        memcpy(pdu + pduLen, handle, handleLength);
-        pduLen += handleLength; 
-        pdu[pduLen++] = 1;  // num bit
-
-// ----- Destination:  Handle Length, Handle Name -----
-        pdu[pduLen++] = destinationHandleLength; 
-        memcpy(pdu + pduLen, destinationHandle, destinationHandleLength); 
-        pduLen  += destinationHandleLength; 
-
-// ----- Message -----
+        uint8_t pdu[PDU_MAXBUF];
         int currentLength = (messageLength - offset > MAX_MESSAGE_SIZE ) ? MAX_MESSAGE_SIZE : messageLength - offset; 
-        memcpy(pdu + pduLen, message + offset, currentLength); 
-        pduLen += currentLength; 
-        pdu[pduLen] = '\0';
-
-// ----- sendPDU -----
-        if (sendPDU(socketNum, pdu, pduLen) < 0) {
-            perror("Failed to send PDU");
-            exit(-1);
-        }
+        PduView text = { (uint8_t *)message + offset, currentLength };
+        sendEncoded(socketNum, pdu, pduEncodeMessage(pdu, sizeof(pdu), pduViewOf(handle), destinationList, text));
         offset += currentLength; 
     }
 }
 
+// pduLen straight from a pduEncode call: -1 means it didn't fit
+void sendEncoded(int socketNum, uint8_t *pdu, int pduLen){
+    if (pduLen < 0) {
+        printf("Error: Command is too long to send.\n");
+        return;
+    }
+    if (clientSendPDU(socketNum, pdu, pduLen) < 0) {
+        perror("Failed to send PDU");
+        exit(-1);
+    }
+}
 
 void processMsgFromServer(int socketNum){
-	uint8_t pdu[SEND_MAXBUF];
-    uint8_t offset = 0; 
-	int pduLen = 0;
-	pduLen = recvPDU(socketNum, pdu, SEND_MAXBUF);
-    uint8_t flag = pdu[offset++];
-    if (pduLen == 0) {  // Server closed the connection
+	int bytesRead = connRead(socketNum);
+    if (bytesRead == CONN_AGAIN) {
+        return;
+    } else if (bytesRead <= 0 && resumeSession(socketNum)) {
+        return;
+    } else if (bytesRead == 0) {  // Server closed the connection
         printf("\n---Server Terminated---\n");
         close(socketNum);
         exit(0);
-    } else if (pduLen < 0) {
-        perror("recvPDU failed");
+    } else if (bytesRead < 0) {
+        // the server connection is broken, nothing left to poll
+        printf("\n---Lost connection to server---\n");
         close(socketNum);
-        return; 
-    }
-    switch(flag){
-        case FLAG_HANDLE_CONFIRM:
-            printf("---Valid Username---\n"); 
-            break; 
-        case FLAG_HANDLE_REJECT:
-            processHandleReject(pdu, pduLen, offset, socketNum);
-            break; 
-        case FLAG_MULTICAST:
-            processMultiCast(pdu, pduLen, offset); 
-            break; 
-        case FLAG_MESSAGE:
-            processRecvMessage(pdu, pduLen, offset); 
-            break; 
-        case FLAG_BROADCAST:
-            processBroadcast(pdu, pduLen, offset); 
-            break; 
-        case FLAG_HANDLE_ERROR:
-            processHandleError(pdu, pduLen, offset); 
-            break; 
-        case FLAG_LIST_COUNT:
-            processCount(pdu, pduLen, offset); 
-            shouldDisplayPrompt = false;
-            break; 
-        case FLAG_LIST_HANDLE:
-            processHandle(pdu, pduLen, offset); 
-            shouldDisplayPrompt = false;
-            break; 
-        case FLAG_LIST_END:
-            break; 
-        default:
-            printf("I don't know you!\n"); 
-            break; 
+        exit(-1); 
+    }
+
+    // every complete PDU that arrived with this read
+    uint8_t *pdu = NULL;
+    int pduLen = 0;
+    while ((pduLen = connNextPDU(socketNum, &pdu, RECV_MAXBUF)) > 0) {
+        processServerPDU(socketNum, pdu, pduLen);
+    }
+    if (pduLen < 0) {
+        printf("\n---Lost connection to server---\n");
+        close(socketNum);
+        exit(-1); 
     }
 }
 
-void processBroadcast(uint8_t *pdu, int pduLen, int offset){
-        // ----- Sender: Handle Length, Handle name -----
-    uint8_t senderHandleLength = pdu[offset++];
-    uint8_t senderHandle[100];
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-    senderHandle[senderHandleLength] = '\0';
-    offset += senderHandleLength; 
-    printf("Broadcast from [%s] (Length: %u)\n", senderHandle, senderHandleLength);
+void processServerPDU(int socketNum, uint8_t *pdu, int pduLen){
+    PduHandler handler = serverHandlers[pdu[0]];
+    if (handler == NULL) {
+        printf("I don't know you!\n"); 
+        return;
+    }
+    handler(socketNum, pdu, pduLen);
+}
 
-    // ----- Message -----
-    uint8_t message[100];    
-    int messageLength = pduLen - offset;
-    memcpy(message, pdu + offset, messageLength); 
-    message[messageLength] = '\0'; 
-    printf("Message received: %s\n", message);
+void processConfirm(int socketNum, const PduConfirm *confirm, uint8_t *pdu, int pduLen){
+    // status 1: a resumed session, held messages follow
+    if (confirm->status == 1) {
+        printf("---Session resumed---\n");
+        return;
+    }
+    redirectHops = 0;
+    printf("---Valid Username---\n"); 
+}
+
+void processListEnd(int socketNum, const PduListEnd *end, uint8_t *pdu, int pduLen){
+}
+
+// The server dropped a %M, %C, %B, %R or %L: this client is sending too fast
+void processThrottled(int socketNum, const PduThrottled *throttled, uint8_t *pdu, int pduLen){
+    char command = 'B';
+    switch (throttled->refusedFlag) {
+        case FLAG_MESSAGE: command = 'M'; break;
+        case FLAG_MULTICAST: command = 'C'; break;
+        case FLAG_ROOM_MESSAGE: command = 'R'; break;
+        case FLAG_LIST: command = 'L'; break;
+    }
+    printf("Server is throttling %%%c, message dropped (retry in %u ms)\n", command, throttled->retryMs);
+}
 
-    printf("%s: %s\n", senderHandle, message); // Print sender and message
+// The server takes our broadcasts over UDP from now on and sends us its own
+void processUdpConfirm(int socketNum, const PduUdpConfirm *confirm, uint8_t *pdu, int pduLen){
+    udpId = htonl(confirm->id);
+    udpReady = true;
+    printf("---Broadcasts over UDP---\n");
+}
 
+// Kept for resumeSession()
+void processResumeToken(int socketNum, const PduResumeToken *token, uint8_t *pdu, int pduLen){
+    resumeGraceMs = token->graceMs;
+    resumeTokenLen = token->token.length;
+    memcpy(resumeToken, token->token.data, resumeTokenLen);
 }
 
+void processBroadcast(int socketNum, const PduBroadcast *broadcast, uint8_t *pdu, int pduLen){
+    PduView sender = broadcast->sender;
+    PduView message = broadcast->text;
+    printf("Broadcast from [%.*s] (Length: %u)\n", sender.length, sender.data, sender.length);
+    printf("Message received: %.*s\n", message.length, message.data);
+
+    printf("%.*s: %.*s\n", sender.length, sender.data, message.length, message.data); // Print sender and message
 
-void processHandleReject(uint8_t *pdu, int pduLen, int offset, int socketNum){
-    uint8_t handleLen = pdu[offset++]; 
-    uint8_t handle[100];
-    memcpy(handle, pdu + offset, handleLen); 
-    handle[handleLen] = '\0'; 
-    printf("Handle already in use: %s\n", handle); 
-    close(socketNum);
-    exit(0);
 }
 
-void processCount(uint8_t *pdu, int pduLen, int offset){
-    uint32_t len = 0; 
-    len  = ntohl(*(uint32_t *)(pdu + offset));  // Convert from network byte order
-    printf("Number of Clients: %d\n", len); 
+
+void processRoomMessage(int socketNum, const PduRoomMessage *message, uint8_t *pdu, int pduLen){
+    printf("[%.*s] %.*s: %.*s\n", message->room.length, message->room.data, message->sender.length, message->sender.data,
+        message->text.length, message->text.data);
 }
 
-void processHandle(uint8_t *pdu, int pduLen, int offset){
-    uint8_t handleLen = pdu[offset++]; 
-    uint8_t handle[100];
-    memcpy(handle, pdu + offset, handleLen); 
-    handle[handleLen] = '\0'; 
-    printf("\t%s\n", handle); 
+void processRoomError(int socketNum, const PduRoomError *error, uint8_t *pdu, int pduLen){
+    printf("Not in room: %.*s\n", error->room.length, error->room.data);
 }
 
-void processMultiCast(uint8_t *pdu, int pduLen, int offset){
-    if (offset >= pduLen) {
-        printf("Error: PDU length is too short to even read sender handle length.\n");
+void processRedirect(int socketNum, const PduRedirect *redirect, uint8_t *pdu, int pduLen){
+// ----- Address: "host:port" -----
+    char address[UINT8_MAX + 1];
+    pduViewString(redirect->address, address, sizeof(address));
+    char *colon = strrchr(address, ':');
+    if (colon == NULL) {
+        printf("Bad redirect: %s\n", address);
         return;
     }
+    *colon = '\0';
 
-// ----- Sender: Handle Length, Handle name -----
-    uint8_t senderHandleLength = pdu[offset++];
-    uint8_t senderHandle[100]; 
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-    printf("Offset: %d, pdu: %c\n", offset, pdu[offset]); 
+    // nodes that disagree on the owner would bounce us forever
+    if (++redirectHops > REDIRECT_MAX_HOPS) {
+        printf("Redirected %d times without registering, giving up\n", REDIRECT_MAX_HOPS);
+        exit(-1);
+    }
+    if (redirectHops > 1) {
+        usleep((REDIRECT_FIRST_BACKOFF_MS << (redirectHops - 2)) * 1000);
+    }
+    printf("Handle lives on %s:%s, moving there\n", address, colon + 1);
+
+    char oldHost[sizeof(serverHost)];
+    char oldPort[sizeof(serverPort)];
+    char *oldLocalPath = localPath;
+    snprintf(oldHost, sizeof(oldHost), "%s", serverHost);
+    snprintf(oldPort, sizeof(oldPort), "%s", serverPort);
+    snprintf(serverHost, sizeof(serverHost), "%s", address);
+    snprintf(serverPort, sizeof(serverPort), "%s", colon + 1);
+    localPath = NULL;
+    int newSocket = dialServer();
+    if (newSocket < 0) {
+        // ask this server again, it may know better by now
+        printf("Can't reach %s:%s, staying here\n", address, colon + 1);
+        snprintf(serverHost, sizeof(serverHost), "%s", oldHost);
+        snprintf(serverPort, sizeof(serverPort), "%s", oldPort);
+        localPath = oldLocalPath;
+        uint8_t initial[PDU_MAXBUF];
+        int initialLen = historyRequest > 0
+            ? pduEncodeInitialHistory(initial, sizeof(initial), pduViewOf(clientHandle), historyRequest)
+            : pduEncodeInitial(initial, sizeof(initial), pduViewOf(clientHandle));
+        connSendPDU(socketNum, initial, initialLen);
+        return;
+    }
 
-    senderHandle[senderHandleLength] = '\0';
-    offset += senderHandleLength;
+    // Same descriptor number, new server: the poll set and everything that
+    // holds socketNum stay as they are, and what we queued for the old
+    // server goes to the new one after the INITIAL
+    resumeTokenLen = 0;             // that server forgot us, the new one sends its own
+    dup2(newSocket, socketNum);
+    close(newSocket);
+
+    initialPacket(socketNum, clientHandle);
+    fcntl(socketNum, F_SETFL, fcntl(socketNum, F_GETFL) | O_NONBLOCK);
+    connRetarget(socketNum);
+    if (udpMode) {
+        udpRegister(socketNum);
+    }
+}
 
-// ----- Number of handles -----
-    int numHandles = pdu[offset++];
-    for (int i = 0; i < numHandles; i++) {
-        uint8_t destinationHandleLength = pdu[offset++];
-        offset += destinationHandleLength; // Move past the destination handle
+void processHandleReject(int socketNum, const PduReject *reject, uint8_t *pdu, int pduLen){
+    printf("Handle already in use: %.*s\n", reject->handle.length, reject->handle.data); 
+    close(socketNum);
+    exit(0);
+}
 
-    }
-    
-// ----- Message -----
-    char message[1024]; // Adjust message buffer size as needed
-    int messageLength = pduLen - offset;
-    printf("NumHandles: %d, Offset: %d, pduLen: %d\n", numHandles, offset, pduLen); 
-    memcpy(message, pdu + offset, messageLength);
-    message[messageLength] = '\0'; // Ensure null termination
-    printf("%s: %s\n", senderHandle, message); // Print sender and message
+void processCount(int socketNum, const PduListCount *count, uint8_t *pdu, int pduLen){
+    shouldDisplayPrompt = false;
+    printf("Number of Clients: %d\n", count->count); 
+}
+
+void processHandle(int socketNum, const PduListHandle *handle, uint8_t *pdu, int pduLen){
+    shouldDisplayPrompt = false;
+    printf("\t%.*s\n", handle->handle.length, handle->handle.data); 
 }
 
-void processRecvMessage(uint8_t *pdu, int pduLen, int offset){
+void processMultiCast(int socketNum, const PduMulticast *multicast, uint8_t *pdu, int pduLen){
+    PduView sender = multicast->sender;
+    PduView message = multicast->text;
+    printf("%.*s: %.*s\n", sender.length, sender.data, message.length, message.data); // Print sender and message
+}
+
+void processRecvMessage(int socketNum, const PduMessage *message, uint8_t *pdu, int pduLen){
     printf("Message Recieved\n"); 
-// ----- Sender: Handle Length, Handle name -----
-    uint8_t senderHandleLength = pdu[offset++]; 
-    uint8_t senderHandle[100];
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-    senderHandle[senderHandleLength] = '\0'; 
-    offset += senderHandleLength; 
-// ----- M and C bit -----
-    offset++; 
-// ----- Destination:  Handle Length, Handle Name -----
-    uint8_t destinationHandleLength = pdu[offset++];
-    offset += destinationHandleLength; 
-// ----- Message -----
-    printf("Offset: %d\tpduLen: %d", offset, pduLen); 
-    uint8_t message[RECV_MAXBUF]; 
-    memcpy(message, pdu + offset, pduLen - offset); 
-    message[pduLen - offset] = '\0'; // Always NUll
-    printf("\n%s: %s\n", senderHandle, message); 
-}
-
-
-void processHandleError(uint8_t *pdu, int pduLen, int offset){
-    int handleLength = pdu[offset++];
-    uint8_t handle[100];
-    memcpy(handle, pdu + offset, handleLength); 
-    handle[handleLength] = '\0'; 
-    printf("Client with handle <%s> does not exist\n", handle); 
+    PduView sender = message->sender;
+    printf("\n%.*s: %.*s\n", sender.length, sender.data, message->text.length, message->text.data); 
+}
+
+
+void processHandleError(int socketNum, const PduHandleError *error, uint8_t *pdu, int pduLen){
+    printf("Client with handle <%.*s> does not exist\n", error->handle.length, error->handle.data); 
 }
@@ -0,0 +1,512 @@
+// cluster.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "cluster.h"
+#include "connection.h"
+#include "networks.h"
+#include "pollLib.h"
+#include "timerWheel.h"
+#include "pdu.h"
+#include "pduSchema.h"
+#include "hashRing.h"
+#include "resolver.h"
+
+typedef struct Peer {
+    int inUse;
+    int socket;                     // -1 while the link is down
+    int connecting;                 // our connect() is in progress
+    int resolving;                  // waiting for the resolver to answer
+    int nextAddress;                // of the host's addresses, the one to dial
+    int established;                // HELLO exchanged
+    int retired;                    // duplicate link, shut down and draining
+    int dialed;                     // from the command line, we (re)connect
+    char host[CLUSTER_NAME_MAX + 1];
+    char port[16];
+    char name[CLUSTER_NAME_MAX + 1];    // the node's name once it said HELLO
+    char address[CLUSTER_NAME_MAX + 1]; // where its clients connect
+    struct sockaddr_in6 addresses[RESOLVER_MAX_ADDRESSES];  // dialed: what host resolved to
+    int addressCount;
+    Timer retryTimer;
+} Peer;
+
+typedef struct RemoteHandle {
+    struct RemoteHandle *next;
+    char *handle;
+    int peerSocket;
+} RemoteHandle;
+
+static char nodeName[CLUSTER_NAME_MAX + 1];
+static char nodeAddress[CLUSTER_NAME_MAX + 1];
+static char clusterKey[CLUSTER_NAME_MAX + 1];
+static int enabled = 0;
+static int partitioned = 0;
+static int ringChanged = 0;
+static Peer peers[CLUSTER_MAX_PEERS];
+static RemoteHandle *directory[CLUSTER_BUCKETS];
+static int remoteHandles = 0;
+
+static Peer *findPeer(int socket);
+static Peer *findEstablished(const char *name, Peer *except);
+static void dialPeer(Timer *timer, void *arg);
+static void peerResolved(const Resolved *resolved, void *arg);
+static void closeDial(Peer *peer);
+static void sendHello(int socket);
+static int trustedHello(int socket, const char *key, int keyLen);
+static int keyMatches(const char *key, int keyLen);
+static void rebuildRing(void);
+static int sendHandlePDU(int socket, int added, const char *handle);
+static RemoteHandle **findRemote(PduView handle);
+static uint32_t hashName(PduView name);
+
+// "host:port" (the last colon splits, so bare IPv6 addresses work)
+int clusterAddPeer(const char *hostPort) {
+    const char *colon = strrchr(hostPort, ':');
+    if (colon == NULL || colon == hostPort || strlen(colon + 1) >= sizeof(peers[0].port)
+            || colon - hostPort > CLUSTER_NAME_MAX) {
+        fprintf(stderr, "Peer must be host:port: %s\n", hostPort);
+        return -1;
+    }
+
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        Peer *peer = &peers[i];
+        if (peer->inUse) continue;
+
+        memset(peer, 0, sizeof(Peer));
+        peer->inUse = 1;
+        peer->dialed = 1;
+        peer->socket = -1;
+        memcpy(peer->host, hostPort, colon - hostPort);
+        strcpy(peer->port, colon + 1);
+        return 0;
+    }
+    fprintf(stderr, "Too many peers (%d at most)\n", CLUSTER_MAX_PEERS);
+    return -1;
+}
+
+int clusterInit(const char *name, const char *address, const char *key, int partition) {
+    if (strlen(name) == 0 || strlen(name) > CLUSTER_NAME_MAX || strlen(address) > CLUSTER_NAME_MAX) {
+        fprintf(stderr, "Node name and address must be 1 to %d characters\n", CLUSTER_NAME_MAX);
+        return -1;
+    }
+    if (key != NULL && strlen(key) > CLUSTER_NAME_MAX) {
+        fprintf(stderr, "Cluster key must be at most %d characters\n", CLUSTER_NAME_MAX);
+        return -1;
+    }
+    strcpy(nodeName, name);
+    strcpy(nodeAddress, address);
+    strcpy(clusterKey, key != NULL ? key : "");
+    enabled = 1;
+    partitioned = partition;
+    rebuildRing();
+
+    // first dial on the first pass of the event loop
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        if (peers[i].inUse && peers[i].dialed) {
+            timerInit(&peers[i].retryTimer, dialPeer, &peers[i]);
+            timerSchedule(&peers[i].retryTimer, timerNowMs());
+        }
+    }
+    printf("Cluster node %s (clients at %s)%s\n", nodeName, nodeAddress, partitioned ? ", partitioned" : "");
+    return 0;
+}
+
+int clusterEnabled(void) {
+    return enabled;
+}
+
+int clusterPartitioned(void) {
+    return partitioned;
+}
+
+int clusterIsPeer(int socket) {
+    Peer *peer = findPeer(socket);
+    return peer != NULL && peer->established;
+}
+
+int clusterIsConnecting(int socket) {
+    Peer *peer = findPeer(socket);
+    return peer != NULL && peer->connecting;
+}
+
+// POLLOUT on a socket we are dialing: the connect finished one way or the other
+void clusterFinishConnect(int socket) {
+    Peer *peer = findPeer(socket);
+    int error = 0;
+    socklen_t errorLen = sizeof(error);
+
+    if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &errorLen) < 0) {
+        error = errno;
+    }
+    if (error != 0) {
+        printf("Peer %s:%s unreachable: %s\n", peer->host, peer->port, strerror(error));
+        closeDial(peer);
+        return;
+    }
+
+    peer->connecting = 0;
+    setPollWrite(socket, 0);
+    sendHello(socket);
+}
+
+// A node's HELLO: either the answer to ours on a link we dialed, or a node
+// dialing us (which gets our HELLO back).
+// Returns 1 if the link is now established, 0 if it should be closed.
+int clusterHello(int socket, const PduPeerHello *hello) {
+    char name[CLUSTER_NAME_MAX + 1];
+    char address[CLUSTER_NAME_MAX + 1];
+    if (hello->name.length == 0 || pduViewString(hello->name, name, sizeof(name)) < 0
+            || pduViewString(hello->address, address, sizeof(address)) < 0) {
+        return 0;
+    }
+
+    if (!trustedHello(socket, (const char *)hello->key.data, hello->key.length)) {
+        printf("Peer HELLO from %s on socket %d refused: %s\n", name, socket,
+            clusterKey[0] != '\0' ? "wrong cluster key" : "not a configured peer");
+        return 0;
+    }
+
+    if (strcmp(name, nodeName) == 0) {
+        printf("Peer on socket %d has our own name %s, dropping it\n", socket, name);
+        return 0;
+    }
+
+    Peer *peer = findPeer(socket);
+    if (peer == NULL) {
+        for (int i = 0; i < CLUSTER_MAX_PEERS && peer == NULL; i++) {
+            if (!peers[i].inUse) peer = &peers[i];
+        }
+        if (peer == NULL) {
+            printf("No room for peer %s\n", name);
+            return 0;
+        }
+        memset(peer, 0, sizeof(Peer));
+        peer->inUse = 1;
+        peer->socket = socket;
+        sendHello(socket);
+    }
+    strcpy(peer->name, name);
+    strcpy(peer->address, address);
+
+    // Both sides dialed each other.  Keep the link dialed by the node whose
+    // name sorts first - both ends come to the same answer.
+    Peer *existing = findEstablished(name, peer);
+    if (existing != NULL) {
+        int keepOurDial = strcmp(nodeName, name) < 0;
+        if (peer->dialed != keepOurDial) {
+            printf("Already linked to %s, dropping the extra link\n", name);
+            peer->established = 1;
+            peer->retired = 1;
+            return 0;
+        }
+        existing->retired = 1;
+        shutdown(existing->socket, SHUT_RDWR);
+    }
+
+    peer->established = 1;
+    printf("Linked to node %s on socket %d\n", name, socket);
+    rebuildRing();
+    return 1;
+}
+
+// A peer socket is gone: forget what it owned and redial if it is ours
+void clusterPeerClosed(int socket) {
+    Peer *peer = findPeer(socket);
+    if (peer == NULL) return;
+
+    for (int i = 0; i < CLUSTER_BUCKETS; i++) {
+        RemoteHandle **link = &directory[i];
+        while (*link != NULL) {
+            RemoteHandle *remote = *link;
+            if (remote->peerSocket == socket) {
+                *link = remote->next;
+                free(remote->handle);
+                free(remote);
+                remoteHandles--;
+            } else {
+                link = &remote->next;
+            }
+        }
+    }
+
+    printf("Lost peer %s on socket %d\n", peer->name[0] ? peer->name : peer->host, socket);
+    int wasMember = peer->established && !peer->retired;
+    peer->socket = -1;
+    peer->established = 0;
+    peer->retired = 0;
+    peer->connecting = 0;
+    if (peer->dialed) {
+        timerSchedule(&peer->retryTimer, timerNowMs() + CLUSTER_RETRY_MS);
+    } else {
+        peer->inUse = 0;
+    }
+    if (wasMember) {
+        rebuildRing();
+    }
+}
+
+// Once per node, not once per remote handle
+void clusterBroadcast(uint8_t *pdu, int pduLen) {
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        if (peers[i].inUse && peers[i].established && !peers[i].retired) {
+            connDeferPDU(peers[i].socket, pdu, pduLen);
+        }
+    }
+}
+
+// A local handle registered (added) or went away
+void clusterAnnounce(const char *handle, int added) {
+    if (!enabled || partitioned) return;
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        if (peers[i].inUse && peers[i].established && !peers[i].retired) {
+            sendHandlePDU(peers[i].socket, added, handle);
+        }
+    }
+}
+
+void clusterAnnounceTo(int peerSocket, const char *handle) {
+    if (partitioned) return;
+    sendHandlePDU(peerSocket, 1, handle);
+}
+
+// HANDLE_ADD / HANDLE_REMOVE from a peer
+void clusterPeerHandle(int peerSocket, PduView handle, int added) {
+    Peer *peer = findPeer(peerSocket);
+    if (peer == NULL || peer->retired) {
+        return;     // a retired link's directory is about to be dropped anyway
+    }
+    RemoteHandle **link = findRemote(handle);
+    RemoteHandle *remote = *link;
+    if (added) {
+        if (remote != NULL) {
+            // re-sent on a new link to the same node, or the old owner's
+            // link is on its way out.  Another live node keeps it.
+            Peer *owner = findPeer(remote->peerSocket);
+            if (owner != NULL && owner != peer && !owner->retired && strcmp(owner->name, peer->name) != 0) {
+                printf("Node %s claims %s, held by %s, ignoring it\n", peer->name, remote->handle, owner->name);
+                return;
+            }
+            remote->peerSocket = peerSocket;
+            return;
+        }
+        remote = malloc(sizeof(RemoteHandle));
+        if (remote == NULL || (remote->handle = strndup((char *)handle.data, handle.length)) == NULL) {
+            free(remote);
+            return;
+        }
+        remote->peerSocket = peerSocket;
+        remote->next = NULL;
+        *link = remote;
+        remoteHandles++;
+    } else if (remote != NULL && remote->peerSocket == peerSocket) {
+        *link = remote->next;
+        free(remote->handle);
+        free(remote);
+        remoteHandles--;
+    }
+}
+
+int clusterFindHandle(PduView handle) {
+    if (partitioned) {
+        // the ring says where it lives, no directory involved
+        const char *owner = hashRingOwner((const char *)handle.data, handle.length);
+        Peer *peer = owner != NULL ? findEstablished(owner, NULL) : NULL;
+        return peer != NULL ? peer->socket : -1;
+    }
+    RemoteHandle *remote = *findRemote(handle);
+    return remote != NULL ? remote->peerSocket : -1;
+}
+
+const char *clusterOwnerAddress(const char *handle) {
+    if (!partitioned) return NULL;
+    const char *owner = hashRingOwner(handle, strlen(handle));
+    Peer *peer = owner != NULL ? findEstablished(owner, NULL) : NULL;
+    return peer != NULL && peer->address[0] != '\0' ? peer->address : NULL;
+}
+
+int clusterRingChanged(void) {
+    int changed = ringChanged;
+    ringChanged = 0;
+    return changed;
+}
+
+int clusterHandleCount(void) {
+    return remoteHandles;
+}
+
+void clusterForEachHandle(void (*callback)(const char *handle, void *arg), void *arg) {
+    for (int i = 0; i < CLUSTER_BUCKETS; i++) {
+        for (RemoteHandle *remote = directory[i]; remote != NULL; remote = remote->next) {
+            callback(remote->handle, arg);
+        }
+    }
+}
+
+static Peer *findPeer(int socket) {
+    if (socket < 0) return NULL;
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        if (peers[i].inUse && peers[i].socket == socket) {
+            return &peers[i];
+        }
+    }
+    return NULL;
+}
+
+static Peer *findEstablished(const char *name, Peer *except) {
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        Peer *peer = &peers[i];
+        if (peer != except && peer->inUse && peer->established && !peer->retired && strcmp(peer->name, name) == 0) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+static void dialPeer(Timer *timer, void *arg) {
+    Peer *peer = arg;
+    if (peer->socket >= 0 || peer->resolving) return;
+
+    // the node dialed us instead, no need for a second link
+    if (peer->name[0] != '\0' && findEstablished(peer->name, peer) != NULL) {
+        timerSchedule(timer, timerNowMs() + CLUSTER_RETRY_MS);
+        return;
+    }
+
+    // the lookup runs off the loop, the connect starts once it's answered
+    peer->resolving = 1;
+    if (resolverStart(peer->host, peer->port, peerResolved, peer) < 0) {
+        peer->resolving = 0;
+        timerSchedule(timer, timerNowMs() + CLUSTER_RETRY_MS);
+    }
+}
+
+static void peerResolved(const Resolved *resolved, void *arg) {
+    Peer *peer = arg;
+    peer->resolving = 0;
+    if (peer->socket >= 0) return;
+    if (resolved->count == 0) {
+        printf("Peer %s:%s: %s\n", peer->host, peer->port, gai_strerror(resolved->error));
+        timerSchedule(&peer->retryTimer, timerNowMs() + CLUSTER_RETRY_MS);
+        return;
+    }
+
+    // kept to recognise the node when it is the one dialing
+    peer->addressCount = resolved->count;
+    memcpy(peer->addresses, resolved->addresses, resolved->count * sizeof(struct sockaddr_in6));
+
+    // a failed dial moves on to the next address (the other family first)
+    int socket = tcpConnectAddressNonBlocking(&resolved->addresses[peer->nextAddress % resolved->count]);
+    if (socket < 0) {
+        peer->nextAddress++;
+        timerSchedule(&peer->retryTimer, timerNowMs() + CLUSTER_RETRY_MS);
+        return;
+    }
+
+    // peers never register a handle, so no registration deadline either
+    Connection *conn = connOpen(socket);
+    conn->registered = 1;
+    addToPollSet(socket);
+    setPollWrite(socket, 1);
+    peer->socket = socket;
+    peer->connecting = 1;
+}
+
+// A dial that failed before the link came up
+static void closeDial(Peer *peer) {
+    removeFromPollSet(peer->socket);
+    connClose(peer->socket);
+    close(peer->socket);
+    peer->socket = -1;
+    peer->connecting = 0;
+    peer->nextAddress++;
+    timerSchedule(&peer->retryTimer, timerNowMs() + CLUSTER_RETRY_MS);
+}
+
+static void sendHello(int socket) {
+    uint8_t pdu[3 * CLUSTER_NAME_MAX + 4];
+    connSendPDU(socket, pdu, pduEncodePeerHello(pdu, sizeof(pdu), pduViewOf(nodeName), pduViewOf(nodeAddress),
+        pduViewOf(clusterKey)));
+}
+
+// With a cluster key every HELLO has to carry it.  Without one, a link we
+// dialed is trusted, and a node dialing us has to come from an address one
+// of our -p peers resolved to (its host, so any source port).
+static int trustedHello(int socket, const char *key, int keyLen) {
+    if (clusterKey[0] != '\0') {
+        return keyMatches(key, keyLen);
+    }
+    Peer *dialed = findPeer(socket);
+    if (dialed != NULL && dialed->dialed) {
+        return 1;
+    }
+
+    struct sockaddr_in6 from;
+    socklen_t fromLen = sizeof(from);
+    if (getpeername(socket, (struct sockaddr *)&from, &fromLen) < 0 || from.sin6_family != AF_INET6) {
+        return 0;
+    }
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        Peer *peer = &peers[i];
+        for (int j = 0; peer->inUse && peer->dialed && j < peer->addressCount; j++) {
+            if (memcmp(&peer->addresses[j].sin6_addr, &from.sin6_addr, sizeof(from.sin6_addr)) == 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Compares every byte, so the time taken doesn't give the key away
+static int keyMatches(const char *key, int keyLen) {
+    int keyLength = strlen(clusterKey);
+    int difference = keyLen != keyLength;
+    for (int i = 0; i < keyLength; i++) {
+        difference |= clusterKey[i] ^ (i < keyLen ? key[i] : 0);
+    }
+    return difference == 0;
+}
+
+// The ring is this node plus every live link, the same set on every node
+static void rebuildRing(void) {
+    if (!partitioned) return;
+
+    hashRingReset();
+    hashRingAdd(nodeName);
+    for (int i = 0; i < CLUSTER_MAX_PEERS; i++) {
+        if (peers[i].inUse && peers[i].established && !peers[i].retired) {
+            hashRingAdd(peers[i].name);
+        }
+    }
+    ringChanged = 1;
+}
+
+static int sendHandlePDU(int socket, int added, const char *handle) {
+    uint8_t pdu[UINT8_MAX + 2];
+    if (added) {
+        return connSendPDU(socket, pdu, pduEncodePeerHandleAdd(pdu, sizeof(pdu), pduViewOf(handle)));
+    }
+    return connSendPDU(socket, pdu, pduEncodePeerHandleRemove(pdu, sizeof(pdu), pduViewOf(handle)));
+}
+
+static RemoteHandle **findRemote(PduView handle) {
+    RemoteHandle **link = &directory[hashName(handle) % CLUSTER_BUCKETS];
+    while (*link != NULL && !pduViewEquals(handle, (*link)->handle)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// FNV-1a
+static uint32_t hashName(PduView name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name.length; i++) {
+        hash = (hash ^ name.data[i]) * 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,52 @@
+// cluster.h
+// Several server processes serving one chat.  Nodes link to each other
+// over TCP on their normal listening port (a PEER_HELLO instead of an
+// INITIAL), tell each other which handles they hold, and forward %M, %C
+// and %B to the node that owns the destination.  The links form a full
+// mesh, so a forwarded PDU is only ever delivered locally on the far side,
+// never passed on again, and a broadcast crosses each link exactly once.
+//
+// A link is only accepted from a node that knows the cluster key (-k), or
+// without a key, from an address one of our -p peers resolves to.
+//
+// Partitioned mode drops the replicated directory: a consistent-hash ring
+// over the linked nodes says which node owns each handle, clients are
+// redirected there when they register, and a lookup needs no table at all.
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <stdint.h>
+
+#include "pduSchema.h"
+
+#define CLUSTER_MAX_PEERS 32
+#define CLUSTER_RETRY_MS 1000           // redial interval for a lost peer
+#define CLUSTER_NAME_MAX 255
+#define CLUSTER_BUCKETS 1024
+
+// Setup: peers given on the command line are dialed once clusterInit()
+// runs (after timerWheelInit()) and redialed whenever their link drops
+int clusterAddPeer(const char *hostPort);
+int clusterInit(const char *nodeName, const char *address, const char *key, int partitioned);
+int clusterEnabled(void);
+int clusterPartitioned(void);
+
+// Peer links
+int clusterIsPeer(int socket);                  // HELLO exchanged
+int clusterIsConnecting(int socket);
+void clusterFinishConnect(int socket);
+int clusterHello(int socket, const PduPeerHello *hello);
+void clusterPeerClosed(int socket);
+void clusterBroadcast(uint8_t *pdu, int pduLen);
+
+// Directory of handles held by other nodes
+void clusterAnnounce(const char *handle, int added);
+void clusterAnnounceTo(int peerSocket, const char *handle);
+void clusterPeerHandle(int peerSocket, PduView handle, int added);
+int clusterFindHandle(PduView handle);          // owner's peer socket or -1
+const char *clusterOwnerAddress(const char *handle);    // NULL if it's ours
+int clusterRingChanged(void);                   // since the last call
+int clusterHandleCount(void);
+void clusterForEachHandle(void (*callback)(const char *handle, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,1072 @@
+// connection.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+#include "connection.h"
+#include "pollLib.h"
+#include "safeUtil.h"
+
+#define CONN_TABLE_GROW 64
+
+static Connection **connTable = NULL;
+static int connTableSize = 0;
+
+static int maxOutBytes = CONN_DEFAULT_MAX_OUT_BYTES;
+static int maxOutMs = CONN_DEFAULT_MAX_OUT_MS;
+static SlowPolicy slowPolicy = SLOW_DISCONNECT;
+static ConnStats stats;
+static int zeroCopyMinBytes = 0;
+
+static int *deferredSockets = NULL;     // marked by connDeferPDU() this tick
+static int deferredCount = 0;
+static int deferredSize = 0;
+
+// A closed connection whose zerocopy sends aren't complete.  The kernel
+// reads the buffers until then, so they can't go back to malloc; the
+// duplicate socket keeps the completions coming after the caller's close().
+typedef struct ParkedSocket {
+    struct ParkedSocket *next;
+    int socket;
+    OutMsg *zeroCopyHead;
+    uint64_t giveUpAt;
+} ParkedSocket;
+
+static ParkedSocket *parkedSockets = NULL;
+static Timer parkTimer;
+static int parkTimerReady = 0;
+
+static void growConnTable(int newSize);
+static int queuePDU(int socket, uint8_t *dataBuffer, int lengthOfData, int bulk);
+static int queueBytes(Connection *conn, uint8_t *header, uint8_t *data, int dataLen, int sent, int bulk);
+static void appendOutMsg(Connection *conn, OutMsg *msg);
+static uint64_t oldestQueuedAt(Connection *conn);
+static int admitPDU(Connection *conn, int newBytes);
+static void dropOldest(Connection *conn, int newBytes, uint64_t now);
+static void cutOff(Connection *conn);
+static void markDeferred(Connection *conn);
+static void retireOutMsg(Connection *conn, OutMsg *msg);
+static void freeOutQueue(Connection *conn);
+static void freeOutMsg(OutMsg *msg, int written);
+static int takeCompletions(int socket, OutMsg **zeroCopyHead);
+static void parkZeroCopy(Connection *conn);
+static void checkParked(Timer *timer, void *arg);
+static void releaseShared(void *arg, int written);
+static int isLoopbackPeer(int socket);
+static void armWriteDeadline(Connection *conn);
+static void writeDeadline(Timer *timer, void *arg);
+static void refillQueue(Connection *conn);
+
+// Create the state for a newly accepted socket
+Connection *connOpen(int socket) {
+    if (socket >= connTableSize) {
+        growConnTable(socket + CONN_TABLE_GROW);
+    }
+
+    Connection *conn = sCalloc(1, sizeof(Connection));
+    conn->socket = socket;
+    conn->lastActivity = timerNowMs();
+    timerInit(&conn->writeTimer, writeDeadline, conn);
+    timerInit(&conn->idleTimer, NULL, conn);
+
+    int on = 1;
+    if (zeroCopyMinBytes > 0 && !isLoopbackPeer(socket)
+            && setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+        conn->zeroCopy = 1;
+    }
+    connTable[socket] = conn;
+    return conn;
+}
+
+Connection *connGet(int socket) {
+    if (socket < 0 || socket >= connTableSize) {
+        return NULL;
+    }
+    return connTable[socket];
+}
+
+// Drop any unsent output and free the state (the caller closes the socket)
+void connClose(int socket) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL) return;
+
+    freeOutQueue(conn);
+    if (conn->zeroCopyHead != NULL) {
+        parkZeroCopy(conn);
+    }
+    timerCancel(&conn->writeTimer);
+    timerCancel(&conn->idleTimer);
+    free(conn);
+    connTable[socket] = NULL;
+}
+
+void connRetarget(int socket) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL) return;
+
+    conn->inStart = 0;
+    conn->inLen = 0;
+    conn->closing = 0;
+    while (conn->zeroCopyHead != NULL) {
+        OutMsg *msg = conn->zeroCopyHead;
+        conn->zeroCopyHead = msg->next;
+        freeOutMsg(msg, 1);
+    }
+    conn->zeroCopyTail = NULL;
+    // the old server got part of the head, the new one needs all of it
+    if (conn->outHead != NULL) {
+        conn->outBytes += conn->outHead->sent;
+        conn->outHead->sent = 0;
+        setPollWrite(socket, 1);
+    }
+}
+
+int connNext(int fromSocket) {
+    for (int socket = fromSocket < 0 ? 0 : fromSocket; socket < connTableSize; socket++) {
+        if (connTable[socket] != NULL) {
+            return socket;
+        }
+    }
+    return -1;
+}
+
+void connSave(int socket, Snapshot *snapshot) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL) {
+        snapshot->failed = 1;
+        return;
+    }
+    snapshotPutBytes(snapshot, conn->inBuf + conn->inStart, conn->inLen - conn->inStart);
+
+    // the rest of a partly written PDU first, so the stream carries on
+    // mid-PDU in the other process
+    int outLen = 0;
+    for (OutMsg *msg = conn->outHead; msg != NULL; msg = msg->next) {
+        outLen += msg->len - msg->sent;
+    }
+    uint8_t *out = malloc(outLen > 0 ? outLen : 1);
+    outLen = 0;
+    for (OutMsg *msg = conn->outHead; out != NULL && msg != NULL; msg = msg->next) {
+        memcpy(out + outLen, msg->bytes + msg->sent, msg->len - msg->sent);
+        outLen += msg->len - msg->sent;
+    }
+    if (out == NULL) {
+        snapshot->failed = 1;
+    }
+    snapshotPutBytes(snapshot, out, outLen);
+    snapshotPutU32(snapshot, conn->zeroCopyNext);
+    free(out);
+}
+
+int connRestore(int socket, Snapshot *snapshot) {
+    Connection *conn = connGet(socket);
+    const uint8_t *in = NULL;
+    const uint8_t *out = NULL;
+    int inLen = snapshotGetBytes(snapshot, &in);
+    int outLen = snapshotGetBytes(snapshot, &out);
+    uint32_t zeroCopyNext = snapshotGetU32(snapshot);
+    if (conn == NULL || snapshot->failed || inLen > CONN_INBUF_SIZE) {
+        return -1;
+    }
+    memcpy(conn->inBuf, in, inLen);
+    conn->inLen = inLen;
+    // the kernel numbers zerocopy sends per socket, and it kept counting
+    conn->zeroCopyNext = zeroCopyNext;
+
+    // one priority message at the head: nothing can go in front of it
+    if (outLen > 0) {
+        OutMsg *msg = malloc(sizeof(OutMsg) + outLen);
+        if (msg == NULL) {
+            perror("Failed to allocate memory for queued PDU");
+            return -1;
+        }
+        memcpy(msg->data, out, outLen);
+        msg->bytes = msg->data;
+        msg->release = NULL;
+        msg->len = outLen;
+        msg->sent = 0;
+        msg->bulk = 0;
+        msg->zeroCopyOk = 0;
+        msg->next = NULL;
+        msg->queuedAt = timerNowMs();
+        appendOutMsg(conn, msg);
+    }
+    return 0;
+}
+
+// Read whatever is waiting on the socket into the inbound buffer.
+// Returns bytes read, 0 if the peer closed, CONN_AGAIN if nothing was
+// ready, -1 on error.
+int connRead(int socket) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL) return -1;
+    if (conn->closing) return 0;
+
+    // slide the partial PDU left over from the last read to the front
+    if (conn->inStart > 0) {
+        memmove(conn->inBuf, conn->inBuf + conn->inStart, conn->inLen - conn->inStart);
+        conn->inLen -= conn->inStart;
+        conn->inStart = 0;
+    }
+
+    int space = CONN_INBUF_SIZE - conn->inLen;
+    if (space == 0) return CONN_AGAIN;
+
+    int bytesReceived = recv(socket, conn->inBuf + conn->inLen, space, 0);
+    if (bytesReceived < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return CONN_AGAIN;
+        }
+        if (errno == ECONNRESET) {
+            return 0;
+        }
+        perror("recv call");
+        return -1;
+    }
+
+    conn->inLen += bytesReceived;
+    conn->lastActivity = timerNowMs();
+    return bytesReceived;
+}
+
+// Points *pdu at the next complete PDU (flag onward) in the inbound buffer.
+// Returns its length, 0 if only a partial PDU is buffered, -1 if the length
+// field is invalid.  The pointer stays valid until the next connRead().
+int connNextPDU(int socket, uint8_t **pdu, int maxPduLen) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL) return -1;
+
+    int available = conn->inLen - conn->inStart;
+    if (available < PDU_HEADER_LEN) return 0;
+
+    uint16_t lengthField;
+    memcpy(&lengthField, conn->inBuf + conn->inStart, sizeof(lengthField));
+    int pduLen = ntohs(lengthField);
+    int dataLen = pduLen - PDU_HEADER_LEN;
+
+    if (dataLen <= 0 || dataLen > maxPduLen) {
+        fprintf(stderr, "Error: Invalid or oversized PDU length: %d\n", dataLen);
+        return -1;
+    }
+    if (available < pduLen) return 0;
+
+    *pdu = conn->inBuf + conn->inStart + PDU_HEADER_LEN;
+    conn->inStart += pduLen;
+    if (conn->inStart == conn->inLen) {
+        conn->inStart = 0;
+        conn->inLen = 0;
+    }
+    return dataLen;
+}
+
+// Frame a PDU and send it.  If earlier output is still queued, or the socket
+// only takes part of it, the rest is queued and POLLOUT is turned on.
+// Returns lengthOfData, or -1 if the socket is broken.  A negative length (a
+// pduEncode that didn't fit) sends nothing and returns -1.
+int connSendPDU(int socket, uint8_t *dataBuffer, int lengthOfData) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing || lengthOfData < 0) return -1;
+
+    uint16_t lengthField = htons(lengthOfData + PDU_HEADER_LEN);
+    uint8_t header[PDU_HEADER_LEN];
+    memcpy(header, &lengthField, sizeof(lengthField));
+
+    if (conn->outHead != NULL) {
+        if (!admitPDU(conn, lengthOfData + PDU_HEADER_LEN)) {
+            return -1;
+        }
+        return queueBytes(conn, header, dataBuffer, lengthOfData, 0, 0) < 0 ? -1 : lengthOfData;
+    }
+
+    // Nothing queued - try to hand it straight to the kernel
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = PDU_HEADER_LEN;
+    iov[1].iov_base = dataBuffer;
+    iov[1].iov_len = lengthOfData;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    int bytesSent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (bytesSent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("send call");
+            return -1;
+        }
+        bytesSent = 0;
+    }
+
+    if (bytesSent == lengthOfData + PDU_HEADER_LEN) {
+        return lengthOfData;
+    }
+
+    // Queue whatever didn't make it, marked as started so nothing cuts in
+    return queueBytes(conn, header, dataBuffer, lengthOfData, bytesSent, 0) < 0 ? -1 : lengthOfData;
+}
+
+// Queue a PDU without trying to write it.  Used to gather many PDUs and
+// put them on the wire together with the next connFlush().
+int connQueuePDU(int socket, uint8_t *dataBuffer, int lengthOfData) {
+    return queuePDU(socket, dataBuffer, lengthOfData, 0);
+}
+
+// Queue a PDU for the end of this loop iteration.  When several broadcasts
+// arrive in one poll wakeup each recipient then gets a single write carrying
+// all of them instead of one write per broadcast.
+int connDeferPDU(int socket, uint8_t *dataBuffer, int lengthOfData) {
+    int result = queuePDU(socket, dataBuffer, lengthOfData, 1);
+    if (result >= 0) {
+        markDeferred(connGet(socket));
+    }
+    return result;
+}
+
+SharedPDU *connSharePDU(uint8_t *dataBuffer, int lengthOfData) {
+    if (lengthOfData < 0) return NULL;
+
+    SharedPDU *shared = malloc(sizeof(SharedPDU) + PDU_HEADER_LEN + lengthOfData);
+    if (shared == NULL) {
+        perror("Failed to allocate memory for shared PDU");
+        return NULL;
+    }
+    uint16_t lengthField = htons(lengthOfData + PDU_HEADER_LEN);
+    memcpy(shared->bytes, &lengthField, sizeof(lengthField));
+    memcpy(shared->bytes + PDU_HEADER_LEN, dataBuffer, lengthOfData);
+    shared->len = PDU_HEADER_LEN + lengthOfData;
+    shared->refs = 1;
+    return shared;
+}
+
+// Same as connDeferPDU(), with the queue holding a reference instead of a copy
+int connDeferShared(int socket, SharedPDU *shared) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing || shared == NULL) return -1;
+    if (conn->outHead != NULL && !admitPDU(conn, shared->len)) {
+        return -1;
+    }
+
+    OutMsg *msg = malloc(sizeof(OutMsg));
+    if (msg == NULL) {
+        perror("Failed to allocate memory for queued PDU");
+        return -1;
+    }
+    shared->refs++;
+    msg->bytes = shared->bytes;
+    msg->release = releaseShared;
+    msg->releaseArg = shared;
+    msg->len = shared->len;
+    msg->sent = 0;
+    msg->bulk = 1;
+    msg->zeroCopyOk = zeroCopyMinBytes > 0 && shared->len >= zeroCopyMinBytes;
+    msg->next = NULL;
+    msg->queuedAt = timerNowMs();
+    appendOutMsg(conn, msg);
+    markDeferred(conn);
+    return shared->len - PDU_HEADER_LEN;
+}
+
+void connReleaseShared(SharedPDU *shared) {
+    if (shared != NULL && --shared->refs == 0) {
+        free(shared);
+    }
+}
+
+// Write everything connDeferPDU() gathered.  A socket that turns out to be
+// broken keeps its queue and POLLOUT, so the next poll reports it and the
+// normal write path tears it down.
+void connFlushDeferred(void) {
+    for (int i = 0; i < deferredCount; i++) {
+        Connection *conn = connGet(deferredSockets[i]);
+        if (conn != NULL && conn->deferred) {
+            conn->deferred = 0;
+            connFlush(conn->socket);
+        }
+    }
+    deferredCount = 0;
+}
+
+// Queue already framed PDUs that live in the caller's memory (a mapped
+// journal, a shared buffer) without copying them.  release(releaseArg) runs
+// once the bytes are written or thrown away.  This is explicit catch-up
+// traffic, so the slow consumer limits don't refuse it up front.
+int connQueueExternal(int socket, uint8_t *framedBytes, int length, OutRelease release, void *releaseArg) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing) {
+        if (release != NULL) release(releaseArg, 0);
+        return -1;
+    }
+
+    OutMsg *msg = malloc(sizeof(OutMsg));
+    if (msg == NULL) {
+        perror("Failed to allocate memory for queued PDU");
+        if (release != NULL) release(releaseArg, 0);
+        return -1;
+    }
+    msg->bytes = framedBytes;
+    msg->release = release;
+    msg->releaseArg = releaseArg;
+    msg->len = length;
+    msg->sent = 0;
+    msg->bulk = 0;
+    msg->zeroCopyOk = 0;
+    msg->next = NULL;
+    msg->queuedAt = timerNowMs();
+    appendOutMsg(conn, msg);
+    return length;
+}
+
+// Send framed PDUs gathered from several buffers (a ring that wraps) with a
+// single sendmsg().  What the socket doesn't take is copied into one queued
+// bulk message.  Catch-up traffic again, so no slow consumer check.
+// Returns the total length, or -1 if the socket is broken.
+int connSendFramed(int socket, struct iovec *iov, int iovCount) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing) return -1;
+
+    int total = 0;
+    for (int i = 0; i < iovCount; i++) {
+        total += iov[i].iov_len;
+    }
+
+    int bytesSent = 0;
+    if (conn->outHead == NULL) {
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = iov;
+        header.msg_iovlen = iovCount;
+
+        bytesSent = sendmsg(socket, &header, MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("send call");
+                return -1;
+            }
+            bytesSent = 0;
+        }
+        if (bytesSent == total) {
+            return total;
+        }
+    }
+
+    // the part already written is kept too, it marks the message as started
+    OutMsg *msg = malloc(sizeof(OutMsg) + total);
+    if (msg == NULL) {
+        perror("Failed to allocate memory for queued PDU");
+        return -1;
+    }
+    int len = 0;
+    for (int i = 0; i < iovCount; i++) {
+        memcpy(msg->data + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    msg->bytes = msg->data;
+    msg->release = NULL;
+    msg->len = len;
+    msg->sent = bytesSent;
+    msg->bulk = 1;
+    msg->zeroCopyOk = 0;
+    msg->next = NULL;
+    msg->queuedAt = timerNowMs();
+    appendOutMsg(conn, msg);
+    return total;
+}
+
+// Queue the tail of a framed PDU whose first alreadySent bytes were written
+// to the socket elsewhere (the splice relay).  It counts as started, so
+// nothing is put in front of it.
+int connQueueStarted(int socket, uint8_t *rest, int restLen, int alreadySent) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing) return -1;
+
+    OutMsg *msg = malloc(sizeof(OutMsg) + alreadySent + restLen);
+    if (msg == NULL) {
+        perror("Failed to allocate memory for queued PDU");
+        return -1;
+    }
+    memcpy(msg->data + alreadySent, rest, restLen);
+    msg->bytes = msg->data;
+    msg->release = NULL;
+    msg->len = alreadySent + restLen;
+    msg->sent = alreadySent;
+    msg->bulk = 0;
+    msg->zeroCopyOk = 0;
+    msg->next = NULL;
+    msg->queuedAt = timerNowMs();
+    appendOutMsg(conn, msg);
+    return restLen;
+}
+
+// Write queued output now that the socket is writable, up to CONN_IOV_MAX
+// queued PDUs per system call.
+// Returns the bytes still queued, or -1 if the socket is broken.
+int connFlush(int socket) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing) return -1;
+
+    while (conn->outHead != NULL) {
+        // a zerocopy write carries only big shared PDUs, small ones would
+        // each pin a page for a few hundred bytes
+        int zeroCopy = conn->zeroCopy && conn->outHead->zeroCopyOk;
+        struct iovec iov[CONN_IOV_MAX];
+        int count = 0;
+        int requested = 0;
+        for (OutMsg *msg = conn->outHead; msg != NULL && count < CONN_IOV_MAX; msg = msg->next) {
+            if (conn->zeroCopy && msg->zeroCopyOk != zeroCopy) {
+                break;
+            }
+            iov[count].iov_base = msg->bytes + msg->sent;
+            iov[count].iov_len = msg->len - msg->sent;
+            requested += msg->len - msg->sent;
+            count++;
+        }
+
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = iov;
+        header.msg_iovlen = count;
+
+        int flags = zeroCopy ? MSG_NOSIGNAL | MSG_ZEROCOPY : MSG_NOSIGNAL;
+        int bytesSent = sendmsg(socket, &header, flags);
+        if (bytesSent < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            flags &= ~MSG_ZEROCOPY;     // over the pinned memory limit, copy this one
+            bytesSent = sendmsg(socket, &header, flags);
+        }
+        if (bytesSent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            perror("send call");
+            return -1;
+        }
+
+        int64_t zeroCopySeq = -1;
+        if ((flags & MSG_ZEROCOPY) && bytesSent > 0) {
+            zeroCopySeq = conn->zeroCopyNext++;
+            stats.zeroCopySends++;
+        }
+
+        // retire every PDU that went out completely
+        conn->outBytes -= bytesSent;
+        int remaining = bytesSent;
+        while (remaining > 0) {
+            OutMsg *msg = conn->outHead;
+            if (zeroCopySeq >= 0) {
+                msg->zeroCopySeq = zeroCopySeq;
+            }
+            int left = msg->len - msg->sent;
+            if (remaining < left) {
+                msg->sent += remaining;
+                break;
+            }
+            remaining -= left;
+            conn->outHead = msg->next;
+            if (conn->outHead == NULL) {
+                conn->outTail = NULL;
+            }
+            if (conn->priorityTail == msg) {
+                conn->priorityTail = NULL;
+            }
+            retireOutMsg(conn, msg);
+        }
+
+        if (bytesSent < requested) {
+            break;  // socket buffer is full again
+        }
+    }
+
+    refillQueue(conn);
+    if (conn->outHead == NULL) {
+        setPollWrite(socket, 0);
+    }
+    armWriteDeadline(conn);
+    return conn->outBytes;
+}
+
+int connCatchUpLimit(void) {
+    return maxOutBytes > 0 ? maxOutBytes / 2 : 0;
+}
+
+int connCatchUpRoom(int socket) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing) return 0;
+    if (maxOutBytes <= 0) return INT_MAX;
+    int room = connCatchUpLimit() - conn->outBytes;
+    return room > 0 ? room : 0;
+}
+
+// Start feeding a catch-up in: refill queues the first part right away.  A
+// catch-up already running is stopped first, so its source can let go.
+void connSetRefill(int socket, OutRefill refill, OutRelease stop, void *arg) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing) {
+        stop(arg, 0);
+        return;
+    }
+    if (conn->refill != NULL) {
+        conn->refill = NULL;
+        conn->refillStop(conn->refillArg, 0);
+    }
+    conn->refill = refill;
+    conn->refillStop = stop;
+    conn->refillArg = arg;
+    refillQueue(conn);
+}
+
+void connZeroCopyDone(int socket) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL) return;
+
+    // the kernel had to copy after all (loopback, a device without
+    // scatter/gather): stop paying for the notifications
+    if (takeCompletions(socket, &conn->zeroCopyHead)) {
+        conn->zeroCopy = 0;
+    }
+    if (conn->zeroCopyHead == NULL) {
+        conn->zeroCopyTail = NULL;
+    }
+}
+
+// Read the kernel's MSG_ZEROCOPY completions and free what they cover.  TCP
+// completes sends in order, so each one covers everything up to its end.
+// Returns 1 if the kernel reported copying instead.
+static int takeCompletions(int socket, OutMsg **zeroCopyHead) {
+    int copied = 0;
+    uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr header;
+    while (1) {
+        memset(&header, 0, sizeof(header));
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &header, MSG_ERRQUEUE) < 0) {
+            break;      // EAGAIN: nothing left, anything else is for connRead()
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+            if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                stats.zeroCopyCopied++;
+                copied = 1;
+            }
+            while (*zeroCopyHead != NULL
+                    && (int32_t)((uint32_t)(*zeroCopyHead)->zeroCopySeq - error.ee_data) <= 0) {
+                OutMsg *msg = *zeroCopyHead;
+                *zeroCopyHead = msg->next;
+                freeOutMsg(msg, 1);
+            }
+        }
+    }
+    return copied;
+}
+
+// The caller is about to close a socket the kernel may still be sending
+// from: a duplicate keeps it, and its zerocopy buffers, until they are done
+static void parkZeroCopy(Connection *conn) {
+    ParkedSocket *parked = malloc(sizeof(ParkedSocket));
+    int socket = fcntl(conn->socket, F_DUPFD_CLOEXEC, 0);
+    if (parked == NULL || socket < 0) {
+        // leaked is better than handed out again while the kernel reads them
+        perror("Failed to park zerocopy buffers");
+        free(parked);
+        if (socket >= 0) close(socket);
+        conn->zeroCopyHead = NULL;
+        conn->zeroCopyTail = NULL;
+        return;
+    }
+    // the duplicate keeps the connection open past close(), so end it here
+    shutdown(socket, SHUT_RDWR);
+    parked->socket = socket;
+    parked->zeroCopyHead = conn->zeroCopyHead;
+    parked->giveUpAt = timerNowMs() + CONN_PARK_MAX_MS;
+    parked->next = parkedSockets;
+    parkedSockets = parked;
+    conn->zeroCopyHead = NULL;
+    conn->zeroCopyTail = NULL;
+
+    if (!parkTimerReady) {
+        timerInit(&parkTimer, checkParked, NULL);
+        parkTimerReady = 1;
+    }
+    if (!timerPending(&parkTimer)) {
+        timerSchedule(&parkTimer, timerNowMs() + CONN_PARK_POLL_MS);
+    }
+}
+
+// Free what completed, and close the parked sockets that are done.  A peer
+// that stops acknowledging for CONN_PARK_MAX_MS gets a reset, which drops
+// the send queue and with it the kernel's use of the buffers.
+static void checkParked(Timer *timer, void *arg) {
+    uint64_t now = timerNowMs();
+    ParkedSocket **link = &parkedSockets;
+    while (*link != NULL) {
+        ParkedSocket *parked = *link;
+        takeCompletions(parked->socket, &parked->zeroCopyHead);
+        if (parked->zeroCopyHead != NULL && now < parked->giveUpAt) {
+            link = &parked->next;
+            continue;
+        }
+        if (parked->zeroCopyHead != NULL) {
+            struct linger reset = { 1, 0 };
+            setsockopt(parked->socket, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        }
+        close(parked->socket);
+        while (parked->zeroCopyHead != NULL) {
+            OutMsg *msg = parked->zeroCopyHead;
+            parked->zeroCopyHead = msg->next;
+            freeOutMsg(msg, 0);
+        }
+        *link = parked->next;
+        free(parked);
+    }
+    if (parkedSockets != NULL) {
+        timerSchedule(timer, now + CONN_PARK_POLL_MS);
+    }
+}
+
+void connSetZeroCopy(int minBytes) {
+    zeroCopyMinBytes = minBytes > 0 ? minBytes : 0;
+}
+
+static int queuePDU(int socket, uint8_t *dataBuffer, int lengthOfData, int bulk) {
+    Connection *conn = connGet(socket);
+    if (conn == NULL || conn->closing || lengthOfData < 0) return -1;
+
+    uint16_t lengthField = htons(lengthOfData + PDU_HEADER_LEN);
+    uint8_t header[PDU_HEADER_LEN];
+    memcpy(header, &lengthField, sizeof(lengthField));
+
+    if (conn->outHead != NULL && !admitPDU(conn, lengthOfData + PDU_HEADER_LEN)) {
+        return -1;
+    }
+    return queueBytes(conn, header, dataBuffer, lengthOfData, 0, bulk) < 0 ? -1 : lengthOfData;
+}
+
+// Copy a framed PDU into a new queued message.  sent is how much of it the
+// socket already took.
+static int queueBytes(Connection *conn, uint8_t *header, uint8_t *data, int dataLen, int sent, int bulk) {
+    OutMsg *msg = malloc(sizeof(OutMsg) + PDU_HEADER_LEN + dataLen);
+    if (msg == NULL) {
+        perror("Failed to allocate memory for queued PDU");
+        return -1;
+    }
+
+    memcpy(msg->data, header, PDU_HEADER_LEN);
+    memcpy(msg->data + PDU_HEADER_LEN, data, dataLen);
+    msg->bytes = msg->data;
+    msg->release = NULL;
+    msg->len = PDU_HEADER_LEN + dataLen;
+    msg->sent = sent;
+    msg->bulk = bulk;
+    msg->zeroCopyOk = 0;
+    msg->next = NULL;
+    msg->queuedAt = timerNowMs();
+    appendOutMsg(conn, msg);
+    return dataLen;
+}
+
+static void markDeferred(Connection *conn) {
+    if (conn->deferred) return;
+
+    if (deferredCount == deferredSize) {
+        deferredSize = deferredSize == 0 ? CONN_TABLE_GROW : deferredSize * 2;
+        deferredSockets = srealloc(deferredSockets, deferredSize * sizeof(int));
+    }
+    deferredSockets[deferredCount++] = conn->socket;
+    conn->deferred = 1;
+}
+
+// Bulk PDUs go on the tail.  A priority PDU goes after the last priority
+// one, or to the front, behind only a PDU that is partly written.
+static void appendOutMsg(Connection *conn, OutMsg *msg) {
+    msg->zeroCopySeq = -1;
+    OutMsg *after = conn->outTail;
+    if (!msg->bulk) {
+        after = conn->priorityTail;
+        if (after == NULL && conn->outHead != NULL && conn->outHead->sent > 0) {
+            after = conn->outHead;
+        }
+        conn->priorityTail = msg;
+    }
+
+    if (conn->outHead == NULL) {
+        conn->outHead = msg;
+        conn->outTail = msg;
+        armWriteDeadline(conn);
+    } else if (after == NULL) {
+        msg->next = conn->outHead;
+        conn->outHead = msg;
+    } else {
+        msg->next = after->next;
+        after->next = msg;
+        if (conn->outTail == after) {
+            conn->outTail = msg;
+        }
+    }
+    conn->outBytes += msg->len - msg->sent;
+    if ((uint64_t)conn->outBytes > stats.peakOutBytes) {
+        stats.peakOutBytes = conn->outBytes;
+    }
+
+    setPollWrite(conn->socket, 1);
+}
+
+void connSetLimits(int maxBytes, int maxMs, SlowPolicy policy) {
+    maxOutBytes = maxBytes;
+    maxOutMs = maxMs;
+    slowPolicy = policy;
+}
+
+const ConnStats *connGetStats(void) {
+    return &stats;
+}
+
+void connPrintStats(FILE *out) {
+    fprintf(out, "Slow consumers: dropped oldest %llu, dropped newest %llu (%llu bytes), "
+        "disconnected %llu, peak queued %llu bytes\n",
+        (unsigned long long)stats.droppedOldest, (unsigned long long)stats.droppedNewest,
+        (unsigned long long)stats.droppedBytes, (unsigned long long)stats.disconnects,
+        (unsigned long long)stats.peakOutBytes);
+    if (zeroCopyMinBytes > 0) {
+        fprintf(out, "Zerocopy sends: %llu (%llu copied by the kernel anyway)\n",
+            (unsigned long long)stats.zeroCopySends, (unsigned long long)stats.zeroCopyCopied);
+    }
+}
+
+// Decide whether a PDU may join a non-empty queue.  Applies the slow
+// consumer policy when the queue is over its byte or age limit.
+static int admitPDU(Connection *conn, int newBytes) {
+    if (conn->unlimited) {
+        return 1;
+    }
+    uint64_t now = timerNowMs();
+    int overBytes = maxOutBytes > 0 && conn->outBytes + newBytes > maxOutBytes;
+    int overTime = maxOutMs > 0 && now - oldestQueuedAt(conn) > (uint64_t)maxOutMs;
+
+    if (!overBytes && !overTime) {
+        return 1;
+    }
+
+    switch (slowPolicy) {
+        case SLOW_DROP_OLDEST:
+            dropOldest(conn, newBytes, now);
+            if (maxOutBytes <= 0 || conn->outBytes + newBytes <= maxOutBytes) {
+                return 1;
+            }
+            // only the partly written head is left and it's still too big
+            break;
+
+        case SLOW_DROP_NEWEST:
+            break;
+
+        case SLOW_DISCONNECT:
+            cutOff(conn);
+            return 0;
+    }
+
+    stats.droppedNewest++;
+    stats.droppedBytes += newBytes;
+    conn->dropped++;
+    return 0;
+}
+
+// Drop stale bulk PDUs, then enough of the oldest ones to fit newBytes.
+// Priority PDUs are never dropped, and a PDU that has been partly written
+// has to stay or the stream loses its framing.
+static void dropOldest(Connection *conn, int newBytes, uint64_t now) {
+    OutMsg **link = &conn->outHead;
+    if ((*link)->sent > 0) {
+        link = &(*link)->next;
+    }
+
+    while (*link != NULL) {
+        OutMsg *msg = *link;
+        if (!msg->bulk) {
+            link = &msg->next;
+            continue;
+        }
+        int stale = maxOutMs > 0 && now - msg->queuedAt > (uint64_t)maxOutMs;
+        int full = maxOutBytes > 0 && conn->outBytes + newBytes > maxOutBytes;
+        if (!stale && !full) {
+            break;
+        }
+
+        *link = msg->next;
+        conn->outBytes -= msg->len;
+        stats.droppedOldest++;
+        stats.droppedBytes += msg->len;
+        conn->dropped++;
+        freeOutMsg(msg, 0);
+    }
+
+    // re-find the tail, the list may have been cut short
+    conn->outTail = NULL;
+    for (OutMsg *msg = conn->outHead; msg != NULL; msg = msg->next) {
+        conn->outTail = msg;
+    }
+    armWriteDeadline(conn);
+}
+
+// Each class is in arrival order, so the oldest PDU is the head or the
+// first bulk PDU behind the priority ones
+static uint64_t oldestQueuedAt(Connection *conn) {
+    uint64_t oldest = conn->outHead->queuedAt;
+    OutMsg *firstBulk = conn->priorityTail != NULL ? conn->priorityTail->next : NULL;
+    if (firstBulk != NULL && firstBulk->queuedAt < oldest) {
+        oldest = firstBulk->queuedAt;
+    }
+    return oldest;
+}
+
+// Keep the write timer on the age limit of the oldest queued PDU
+static void armWriteDeadline(Connection *conn) {
+    if (conn->outHead == NULL || maxOutMs <= 0 || conn->unlimited) {
+        timerCancel(&conn->writeTimer);
+        return;
+    }
+    timerSchedule(&conn->writeTimer, oldestQueuedAt(conn) + maxOutMs + 1);
+}
+
+// The head of the queue went stale without the client reading it.  Enforce
+// the age limit even if nothing new is being sent to this client.
+static void writeDeadline(Timer *timer, void *arg) {
+    Connection *conn = arg;
+    uint64_t now = timerNowMs();
+
+    switch (slowPolicy) {
+        case SLOW_DISCONNECT:
+            cutOff(conn);
+            break;
+
+        case SLOW_DROP_OLDEST:
+            dropOldest(conn, 0, now);
+            // a partly written head or a priority PDU can't be dropped,
+            // look again later
+            if (conn->outHead != NULL && now - oldestQueuedAt(conn) > (uint64_t)maxOutMs) {
+                timerSchedule(timer, now + maxOutMs);
+            }
+            break;
+
+        case SLOW_DROP_NEWEST:
+            break;      // the byte limit already caps this queue
+    }
+}
+
+// Let the catch-up source queue more once the queue is back within its
+// allowance (drained, with no byte limit)
+static void refillQueue(Connection *conn) {
+    int limit = connCatchUpLimit();
+    int roomy = limit > 0 ? conn->outBytes < limit : conn->outHead == NULL;
+    if (conn->refill != NULL && !conn->closing && roomy
+            && conn->refill(conn->socket, conn->refillArg) == 0) {
+        conn->refill = NULL;
+    }
+}
+
+// Give up on a client that isn't reading.  shutdown() makes poll report the
+// socket readable with EOF, so the normal disconnect path tears it down.
+static void cutOff(Connection *conn) {
+    printf("Slow consumer on socket %d (%d bytes queued), disconnecting\n", conn->socket, conn->outBytes);
+    stats.disconnects++;
+    conn->closing = 1;
+    freeOutQueue(conn);
+    timerCancel(&conn->writeTimer);
+    setPollWrite(conn->socket, 0);
+    shutdown(conn->socket, SHUT_RDWR);
+}
+
+// Done with a written PDU, unless the kernel may still be sending from it
+static void retireOutMsg(Connection *conn, OutMsg *msg) {
+    if (msg->zeroCopySeq < 0) {
+        freeOutMsg(msg, 1);
+        return;
+    }
+    msg->next = NULL;
+    if (conn->zeroCopyTail == NULL) {
+        conn->zeroCopyHead = msg;
+    } else {
+        conn->zeroCopyTail->next = msg;
+    }
+    conn->zeroCopyTail = msg;
+}
+
+// Zerocopy buffers stay: the kernel may still be sending from them after
+// shutdown() or close(), so they wait for their completions.  That includes
+// a head that went out in part.
+static void freeOutQueue(Connection *conn) {
+    if (conn->refill != NULL) {
+        conn->refill = NULL;
+        conn->refillStop(conn->refillArg, 0);
+    }
+    OutMsg *msg = conn->outHead;
+    while (msg != NULL) {
+        OutMsg *next = msg->next;
+        if (msg->zeroCopySeq >= 0) {
+            retireOutMsg(conn, msg);
+        } else {
+            freeOutMsg(msg, 0);
+        }
+        msg = next;
+    }
+    conn->outHead = NULL;
+    conn->outTail = NULL;
+    conn->priorityTail = NULL;
+    conn->outBytes = 0;
+}
+
+static void freeOutMsg(OutMsg *msg, int written) {
+    if (msg->release != NULL) {
+        msg->release(msg->releaseArg, written);
+    }
+    free(msg);
+}
+
+static void releaseShared(void *arg, int written) {
+    connReleaseShared(arg);
+}
+
+// Loopback always copies, and the page-per-fragment skbs of a zerocopy send
+// can overrun the receiver's buffer and leave its window stuck below an MSS
+static int isLoopbackPeer(int socket) {
+    struct sockaddr_in6 peer;
+    socklen_t peerLen = sizeof(peer);
+    if (getpeername(socket, (struct sockaddr *)&peer, &peerLen) < 0) {
+        return 0;
+    }
+    if (peer.sin6_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&peer)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (peer.sin6_family != AF_INET6) {
+        return 0;
+    }
+    return IN6_IS_ADDR_LOOPBACK(&peer.sin6_addr)
+        || (IN6_IS_ADDR_V4MAPPED(&peer.sin6_addr) && peer.sin6_addr.s6_addr[12] == 127);
+}
+
+static void growConnTable(int newSize) {
+    connTable = srealloc(connTable, newSize * sizeof(Connection *));
+    for (int i = connTableSize; i < newSize; i++) {
+        connTable[i] = NULL;
+    }
+    connTableSize = newSize;
+}
@@ -0,0 +1,181 @@
+// connection.h
+// Per-socket state for non-blocking sockets, used by the server for every
+// client and by cclient for its server connection.  Inbound bytes are framed
+// into PDUs here and outbound PDUs that the kernel can't take right away
+// wait in a queue until the socket is writable.
+#ifndef __CONNECTION_H__
+#define __CONNECTION_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "timerWheel.h"
+#include "snapshot.h"
+
+#define CONN_INBUF_SIZE 8192
+#define PDU_HEADER_LEN 2
+#define CONN_AGAIN -2                   // connRead(): nothing to read right now
+#define CONN_IOV_MAX 64                 // queued PDUs written per system call
+
+// Slow consumer defaults: how much output may back up behind a client that
+// stopped reading, and for how long, before the policy kicks in
+#define CONN_DEFAULT_MAX_OUT_BYTES (256 * 1024)
+#define CONN_DEFAULT_MAX_OUT_MS 10000
+
+// A closed socket with MSG_ZEROCOPY sends the kernel hasn't completed is
+// checked this often for the completions, and reset after the longer wait
+#define CONN_PARK_POLL_MS 50
+#define CONN_PARK_MAX_MS 30000
+
+typedef enum {
+    SLOW_DROP_OLDEST,       // discard queued PDUs from the front
+    SLOW_DROP_NEWEST,       // refuse the PDU being sent
+    SLOW_DISCONNECT,        // shut the connection down
+} SlowPolicy;
+
+// Counters for every slow consumer action, exposed with connPrintStats()
+typedef struct ConnStats {
+    uint64_t droppedOldest;
+    uint64_t droppedNewest;
+    uint64_t droppedBytes;
+    uint64_t disconnects;
+    uint64_t peakOutBytes;
+    uint64_t zeroCopySends;
+    uint64_t zeroCopyCopied;        // completions where the kernel copied anyway
+} ConnStats;
+
+// Called once a queued external buffer is written (written 1), or dropped
+// or discarded with the connection (written 0)
+typedef void (*OutRelease)(void *arg, int written);
+
+// Catch-up that is fed in as the queue drains (connSetRefill()): queue some
+// more on socket, return 0 once there is nothing left
+typedef int (*OutRefill)(int socket, void *arg);
+
+// Framed PDU bytes (length headers included) waiting to be written.  They
+// live in data[] or, for connQueueExternal(), in the caller's buffer.
+//
+// The queue holds two classes.  Control replies and direct messages are
+// priority and go in ahead of any bulk PDUs (broadcasts, room traffic,
+// history catch-up), so they never wait behind a fan-out backlog.  Only a
+// PDU that has started onto the wire can't be overtaken.
+typedef struct OutMsg {
+    struct OutMsg *next;
+    uint64_t queuedAt;              // ms timestamp, for the age limit
+    int len;
+    int sent;                       // > 0: started, stays at the head
+    int bulk;
+    int zeroCopyOk;                 // shared and big enough for MSG_ZEROCOPY
+    int64_t zeroCopySeq;            // last MSG_ZEROCOPY send it went out in, -1: none
+    uint8_t *bytes;
+    OutRelease release;
+    void *releaseArg;
+    uint8_t data[];
+} OutMsg;
+
+// A fan-out PDU framed once, queued by reference for every recipient.  The
+// last queue to let go of it frees it.
+typedef struct SharedPDU {
+    int refs;
+    int len;
+    uint8_t bytes[];
+} SharedPDU;
+
+typedef struct Connection {
+    int socket;
+    int inStart;                    // first unparsed byte in inBuf
+    int inLen;                      // bytes held in inBuf
+    uint8_t inBuf[CONN_INBUF_SIZE];
+    OutMsg *outHead;
+    OutMsg *outTail;
+    OutMsg *priorityTail;           // last priority PDU, bulk ones follow it
+    int outBytes;                   // queued bytes not yet written
+    int closing;                    // slow consumer cut off, waiting for teardown
+    uint64_t dropped;               // PDUs this connection never got
+    Timer writeTimer;               // oldest queued PDU hits the age limit
+    Timer idleTimer;                // registration deadline, then idle timeout
+    uint64_t lastActivity;          // ms of the last read, checked lazily
+    int registered;                 // handle accepted by the server
+    int unlimited;                  // a cluster link: no slow consumer limits
+    int deferred;                   // has PDUs waiting for connFlushDeferred()
+    int zeroCopy;                   // SO_ZEROCOPY on, large writes skip the copy
+    uint32_t zeroCopyNext;          // sequence number of the next zerocopy send
+    OutMsg *zeroCopyHead;           // written, but the kernel still holds the bytes
+    OutMsg *zeroCopyTail;
+    OutRefill refill;               // more catch-up to queue once there's room
+    OutRelease refillStop;
+    void *refillArg;
+} Connection;
+
+// Functions to manage connections (all keyed by socket number)
+Connection *connOpen(int socket);
+Connection *connGet(int socket);
+void connClose(int socket);
+// The socket number now leads to another server (dup2() over it): forget
+// what was read and send everything still queued, from the start, there
+void connRetarget(int socket);
+
+// Every open connection: for (s = connNext(0); s >= 0; s = connNext(s + 1))
+int connNext(int fromSocket);
+
+// Handoff (handoff.h): what a connection has read but not parsed and queued
+// but not written, so another process can carry on where this one stopped.
+// connRestore() puts it back on a socket opened there with connOpen().
+void connSave(int socket, Snapshot *snapshot);
+int connRestore(int socket, Snapshot *snapshot);
+
+// Inbound: connRead() pulls what the kernel has, connNextPDU() hands back
+// each complete PDU (header stripped) that is now in the buffer
+int connRead(int socket);
+int connNextPDU(int socket, uint8_t **pdu, int maxPduLen);
+
+// Outbound: frame and write, queueing whatever the socket won't take.
+// connSendFramed() is history catch-up and queues as bulk, the rest as
+// priority.
+int connSendPDU(int socket, uint8_t *dataBuffer, int lengthOfData);
+int connQueuePDU(int socket, uint8_t *dataBuffer, int lengthOfData);
+int connQueueExternal(int socket, uint8_t *framedBytes, int length, OutRelease release, void *releaseArg);
+int connSendFramed(int socket, struct iovec *iov, int iovCount);
+int connQueueStarted(int socket, uint8_t *rest, int restLen, int alreadySent);
+int connFlush(int socket);
+
+// Catch-up (history, stored and held messages) skips the slow consumer
+// check, so it may only fill half the byte limit and leaves the other half
+// for live traffic.  connCatchUpLimit() is that allowance (0: no limit),
+// connCatchUpRoom() what of it is left on socket.  connSetRefill() paces a
+// long catch-up: refill runs from connFlush() whenever the queue is back
+// under the allowance, and stop(arg, 0) runs instead if the connection goes
+// away, or another catch-up is set, before refill says it is done.
+int connCatchUpLimit(void);
+int connCatchUpRoom(int socket);
+void connSetRefill(int socket, OutRefill refill, OutRelease stop, void *arg);
+
+// Coalescing: connDeferPDU() only queues (as bulk), and connFlushDeferred()
+// at the end of the loop iteration writes what each socket gathered in one
+// sendmsg()
+int connDeferPDU(int socket, uint8_t *dataBuffer, int lengthOfData);
+void connFlushDeferred(void);
+
+// Fan-out without a copy per recipient: connSharePDU() frames the PDU once
+// and holds the caller's reference, connDeferShared() queues it like
+// connDeferPDU(), and connReleaseShared() drops a reference
+SharedPDU *connSharePDU(uint8_t *dataBuffer, int lengthOfData);
+int connDeferShared(int socket, SharedPDU *shared);
+void connReleaseShared(SharedPDU *shared);
+
+// Opt-in MSG_ZEROCOPY for shared PDUs of at least minBytes (0: off), on
+// sockets opened afterwards.  Queued bytes the kernel sent from in place
+// are only freed once connZeroCopyDone() reads the completion off the
+// socket's error queue, which poll reports as POLLERR.  connClose() keeps
+// them past the caller's close(), on a duplicate of the socket that is
+// checked on a timer (CONN_PARK_POLL_MS).
+void connSetZeroCopy(int minBytes);
+void connZeroCopyDone(int socket);
+
+// Slow consumer limits (0 turns a limit off) and the actions taken
+void connSetLimits(int maxOutBytes, int maxOutMs, SlowPolicy policy);
+const ConnStats *connGetStats(void);
+void connPrintStats(FILE *out);
+
+#endif
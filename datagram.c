@@ -0,0 +1,276 @@
+// datagram.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "datagram.h"
+#include "networks.h"
+
+#define PEER_TABLE_GROW 64
+
+typedef struct DatagramPeer {
+    int registered;
+    struct sockaddr_in6 address;
+} DatagramPeer;
+
+// One datagram waiting for datagramFlush(): the address is copied so a
+// recipient that disconnects later in the tick doesn't matter
+typedef struct PendingDatagram {
+    struct sockaddr_in6 address;
+    SharedPDU *shared;
+} PendingDatagram;
+
+static int udpSocket = -1;
+static DatagramPeer *peers = NULL;      // by TCP socket
+static int peersSize = 0;
+
+static PendingDatagram *pending = NULL;
+static int pendingCount = 0;
+static int pendingSize = 0;
+
+static uint8_t receiveBuffers[DATAGRAM_BATCH][DATAGRAM_MAX_SIZE];
+static struct mmsghdr messages[DATAGRAM_BATCH];
+static struct iovec iovs[DATAGRAM_BATCH];
+static struct sockaddr_in6 sources[DATAGRAM_BATCH];
+
+static uint64_t received = 0;
+static uint64_t receiveCalls = 0;
+static uint64_t rejected = 0;
+static uint64_t sent = 0;
+static uint64_t sendCalls = 0;
+static uint64_t dropped = 0;
+
+static DatagramPeer *peerFor(int socket);
+static int fromPeer(int id, struct sockaddr_in6 *source);
+static int sendBatch(int first, int count);
+
+int datagramInit(int port) {
+    return datagramAdopt(udpServerSetup(port));
+}
+
+int datagramAdopt(int socket) {
+    udpSocket = socket;
+    fcntl(udpSocket, F_SETFL, fcntl(udpSocket, F_GETFL) | O_NONBLOCK);
+
+    // a fan-out tick writes a burst far bigger than the default buffers
+    int bufferSize = DATAGRAM_SOCKET_BUFFER;
+    setsockopt(udpSocket, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(udpSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    return udpSocket;
+}
+
+void datagramShutdown(void) {
+    for (int i = 0; i < pendingCount; i++) {
+        connReleaseShared(pending[i].shared);
+    }
+    pendingCount = 0;
+    if (udpSocket >= 0) {
+        close(udpSocket);
+        udpSocket = -1;
+    }
+}
+
+int datagramSocket(void) {
+    return udpSocket;
+}
+
+int datagramRegister(int socket, uint16_t port) {
+    DatagramPeer *peer = peerFor(socket);
+    if (udpSocket < 0 || port == 0 || peer == NULL) return -1;
+
+    // only the host the TCP connection comes from, so nobody can point the
+    // fan-out at someone else
+    socklen_t addressLen = sizeof(peer->address);
+    if (getpeername(socket, (struct sockaddr *)&peer->address, &addressLen) < 0
+            || peer->address.sin6_family != AF_INET6) {
+        peer->registered = 0;
+        return -1;
+    }
+    peer->address.sin6_port = htons(port);
+    peer->registered = 1;
+    return 0;
+}
+
+void datagramForget(int socket) {
+    if (socket < peersSize) {
+        peers[socket].registered = 0;
+    }
+}
+
+void datagramReceive(PduHandler handler, int maxPduLen) {
+    for (int i = 0; i < DATAGRAM_BATCH; i++) {
+        iovs[i].iov_base = receiveBuffers[i];
+        iovs[i].iov_len = DATAGRAM_MAX_SIZE;
+        memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &sources[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+    }
+
+    // one batch a wakeup, poll comes back if there is more
+    int count = recvmmsg(udpSocket, messages, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+    if (count <= 0) {
+        if (count < 0 && errno != EAGAIN && errno != EINTR) perror("recvmmsg");
+        return;
+    }
+    receiveCalls++;
+    received += count;
+
+    for (int i = 0; i < count; i++) {
+        int length = messages[i].msg_len;
+        if ((messages[i].msg_hdr.msg_flags & MSG_TRUNC) || length <= DATAGRAM_ID_LEN
+                || length - DATAGRAM_ID_LEN > maxPduLen) {
+            rejected++;
+            continue;
+        }
+        uint32_t id;
+        memcpy(&id, receiveBuffers[i], sizeof(id));
+        id = ntohl(id);
+        if (!fromPeer(id, &sources[i])) {
+            rejected++;
+            continue;
+        }
+        handler(id, receiveBuffers[i] + DATAGRAM_ID_LEN, length - DATAGRAM_ID_LEN);
+    }
+}
+
+int datagramQueue(int socket, SharedPDU *shared) {
+    if (shared == NULL || socket < 0 || socket >= peersSize || !peers[socket].registered) {
+        return -1;
+    }
+    if (pendingCount == pendingSize) {
+        int newSize = pendingSize > 0 ? pendingSize * 2 : DATAGRAM_BATCH;
+        PendingDatagram *table = realloc(pending, newSize * sizeof(PendingDatagram));
+        if (table == NULL) return -1;
+        pending = table;
+        pendingSize = newSize;
+    }
+    pending[pendingCount].address = peers[socket].address;
+    pending[pendingCount].shared = shared;
+    pendingCount++;
+    shared->refs++;
+    return 0;
+}
+
+void datagramFlush(void) {
+    for (int first = 0; first < pendingCount; first += DATAGRAM_BATCH) {
+        int count = pendingCount - first < DATAGRAM_BATCH ? pendingCount - first : DATAGRAM_BATCH;
+        if (sendBatch(first, count) < 0) {
+            dropped += pendingCount - first - count;
+            break;
+        }
+    }
+    for (int i = 0; i < pendingCount; i++) {
+        connReleaseShared(pending[i].shared);
+    }
+    pendingCount = 0;
+}
+
+void datagramPrintStats(FILE *out) {
+    fprintf(out, "Datagrams received: %llu in %llu recvmmsg calls (%llu rejected)\n",
+        (unsigned long long)received, (unsigned long long)receiveCalls, (unsigned long long)rejected);
+    fprintf(out, "Datagrams sent: %llu in %llu sendmmsg calls (%llu dropped)\n",
+        (unsigned long long)sent, (unsigned long long)sendCalls, (unsigned long long)dropped);
+}
+
+void datagramSave(Snapshot *snapshot) {
+    int count = 0;
+    for (int i = 0; i < peersSize; i++) {
+        count += peers[i].registered;
+    }
+    snapshotPassSocket(snapshot, udpSocket);
+    snapshotPutU32(snapshot, count);
+    for (int i = 0; i < peersSize; i++) {
+        if (peers[i].registered) {
+            snapshotPutSocket(snapshot, i);
+            snapshotPutBytes(snapshot, &peers[i].address, sizeof(peers[i].address));
+        }
+    }
+}
+
+int datagramLoad(Snapshot *snapshot, int port) {
+    int inherited = snapshotGetSocket(snapshot);
+    if (port == 0) {
+        if (inherited >= 0) close(inherited);
+    } else if (inherited >= 0) {
+        datagramAdopt(inherited);
+    } else {
+        datagramInit(port);
+    }
+
+    uint32_t count = snapshotGetU32(snapshot);
+    for (uint32_t i = 0; i < count && !snapshot->failed; i++) {
+        int socket = snapshotGetSocket(snapshot);
+        const uint8_t *address = NULL;
+        int addressLen = snapshotGetBytes(snapshot, &address);
+        // the client's id is its socket number, which the handoff kept
+        DatagramPeer *peer = port != 0 && socket >= 0 ? peerFor(socket) : NULL;
+        if (peer != NULL && addressLen == sizeof(peer->address)) {
+            memcpy(&peer->address, address, addressLen);
+            peer->registered = 1;
+        }
+    }
+    return snapshot->failed ? -1 : 0;
+}
+
+static DatagramPeer *peerFor(int socket) {
+    if (socket < 0) return NULL;
+    if (socket >= peersSize) {
+        int newSize = socket + PEER_TABLE_GROW;
+        DatagramPeer *table = realloc(peers, newSize * sizeof(DatagramPeer));
+        if (table == NULL) return NULL;
+        memset(table + peersSize, 0, (newSize - peersSize) * sizeof(DatagramPeer));
+        peers = table;
+        peersSize = newSize;
+    }
+    return &peers[socket];
+}
+
+static int fromPeer(int id, struct sockaddr_in6 *source) {
+    if (id < 0 || id >= peersSize || !peers[id].registered) {
+        return 0;
+    }
+    struct sockaddr_in6 *address = &peers[id].address;
+    return source->sin6_family == AF_INET6 && source->sin6_port == address->sin6_port
+        && memcmp(&source->sin6_addr, &address->sin6_addr, sizeof(address->sin6_addr)) == 0;
+}
+
+// Lossy by design: what the socket buffer won't take is dropped, and a
+// message the kernel refuses is skipped.  -1 if the buffer is full.
+static int sendBatch(int first, int count) {
+    for (int i = 0; i < count; i++) {
+        SharedPDU *shared = pending[first + i].shared;
+        iovs[i].iov_base = shared->bytes + PDU_HEADER_LEN;
+        iovs[i].iov_len = shared->len - PDU_HEADER_LEN;
+        memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &pending[first + i].address;
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+    }
+
+    int done = 0;
+    while (done < count) {
+        int n = sendmmsg(udpSocket, messages + done, count - done, 0);
+        sendCalls++;
+        if (n > 0) {
+            sent += n;
+            done += n;
+        } else if (errno == EAGAIN || errno == ENOBUFS) {
+            dropped += count - done;
+            return -1;
+        } else if (errno != EINTR) {
+            dropped++;
+            done++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+// datagram.h
+// UDP side channel for traffic that can stand to be lost.  A client
+// registers a UDP port over its TCP connection (FLAG_UDP_REGISTER) and is
+// told the id to put in front of its datagrams (FLAG_UDP_CONFIRM).  From
+// then on its broadcasts can come in as datagrams and broadcasts to it go
+// out as datagrams.  Both directions are batched: one recvmmsg() takes in a
+// burst, and what a tick fanned out leaves in one sendmmsg() per
+// DATAGRAM_BATCH recipients instead of a write per recipient.
+//
+// Datagrams carry bare PDUs (no length field); the ones clients send start
+// with the 4 byte id.  They are only taken from the address registered for
+// that id.
+#ifndef __DATAGRAM_H__
+#define __DATAGRAM_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "connection.h"
+#include "pduSchema.h"
+
+#define DATAGRAM_ID_LEN 4
+#define DATAGRAM_MAX_SIZE 1500          // bigger ones are dropped
+#define DATAGRAM_BATCH 256              // messages per recvmmsg()/sendmmsg()
+#define DATAGRAM_SOCKET_BUFFER (4 * 1024 * 1024)
+
+// The UDP socket on port (the same number as the TCP listener), or -1
+int datagramInit(int port);
+// Or one that is already bound
+int datagramAdopt(int socket);
+void datagramShutdown(void);
+int datagramSocket(void);
+
+// Per client, keyed by its TCP socket: the UDP port it receives on, at the
+// address its TCP connection comes from
+int datagramRegister(int socket, uint16_t port);
+void datagramForget(int socket);
+
+// Take in what's waiting (one batch) and hand each PDU of at most
+// maxPduLen to handler as if it came from the sender's TCP socket
+void datagramReceive(PduHandler handler, int maxPduLen);
+
+// Queue a shared PDU for socket's UDP address.  -1 if it has none: send it
+// over TCP instead.  datagramFlush() writes everything queued this tick.
+int datagramQueue(int socket, SharedPDU *shared);
+void datagramFlush(void);
+
+void datagramPrintStats(FILE *out);
+
+// Handoff (handoff.h): the UDP socket and every registered address.
+// datagramLoad() takes the old socket over, or opens one on port if the old
+// server had none; port 0 (UDP is off here) closes it instead.
+void datagramSave(Snapshot *snapshot);
+int datagramLoad(Snapshot *snapshot, int port);
+
+#endif
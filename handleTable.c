@@ -56,6 +56,16 @@ int findSocketByHandle(HandleNode *head, const char *handle){
     return -1; 
 }
 
+// Same lookup for a handle still inside a PDU
+int findSocketByView(HandleNode *head, PduView handle){
+    for (HandleNode *current = head; current != NULL; current = current->next) {
+        if (pduViewEquals(handle, current->handle)) {
+            return current->socket;
+        }
+    }
+    return -1;
+}
+
 // 
 const char* findHandleBySocket(HandleNode *head, int socket) {
     HandleNode *current = head;
@@ -4,6 +4,8 @@
 
 #include <stdbool.h>
 
+#include "pduView.h"
+
 // Node structure for linked list
 typedef struct HandleNode {
     char *handle;
@@ -16,6 +18,7 @@ HandleNode *createHandleTable(void);
 const char *findHandle(HandleNode *head, const char *handle);
 const char *findHandleBySocket(HandleNode *head, int socket);
 int findSocketByHandle(HandleNode *head, const char *handle); 
+int findSocketByView(HandleNode *head, PduView handle);
 bool addHandle(HandleNode **head, const char *handle, int socket); 
 bool removeHandle(HandleNode **head, const char *handle);
 void destroyHandleTable(HandleNode *head);
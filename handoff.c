@@ -0,0 +1,316 @@
+// handoff.c
+#define _GNU_SOURCE     // struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "handoff.h"
+#include "networks.h"
+
+// The header goes first, and the successor answers it with one byte before
+// anything else is sent.  Sockets go in fixed size messages: a count, then
+// the old numbers, with the descriptors attached.  After them comes the
+// snapshot itself.
+#define CHUNK_WORDS (1 + HANDOFF_SOCKETS_PER_MESSAGE)
+#define HANDOFF_ACCEPTED 1
+
+typedef struct HandoffHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t socketCount;
+    uint32_t snapshotLen;
+} HandoffHeader;
+
+static void setTimeouts(int socket);
+static int sendAll(int socket, const void *bytes, int len);
+static int receiveAll(int socket, void *bytes, int len);
+static int sendSockets(int successor, const int *sockets, int count);
+static int receiveSockets(int socket, Snapshot *snapshot, int *remaining);
+static int keepNumbers(int socket, Snapshot *snapshot);
+
+int handoffListen(char *path) {
+    return unixServerSetup(path, 1);
+}
+
+int handoffAccept(int listener) {
+    int successor = accept(listener, NULL, NULL);
+    if (successor < 0) {
+        return -1;
+    }
+    // whoever takes over gets every client, so only the same user
+    struct ucred peer;
+    socklen_t peerLen = sizeof(peer);
+    if (getsockopt(successor, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0 || peer.uid != getuid()) {
+        printf("Handoff refused: connection from another user\n");
+        close(successor);
+        return -1;
+    }
+    setTimeouts(successor);
+    return successor;
+}
+
+int handoffSend(int successor, Snapshot *snapshot) {
+    if (snapshot->failed) {
+        return -1;
+    }
+    HandoffHeader header = {
+        htonl(HANDOFF_MAGIC), htonl(HANDOFF_VERSION), htonl(snapshot->socketCount), htonl(snapshot->len)
+    };
+    if (sendAll(successor, &header, sizeof(header)) < 0) {
+        return -1;
+    }
+    // a successor that can't read this snapshot closes instead
+    uint8_t answer = 0;
+    if (receiveAll(successor, &answer, 1) < 0 || answer != HANDOFF_ACCEPTED) {
+        printf("Successor refused the handoff\n");
+        return -1;
+    }
+    for (int first = 0; first < snapshot->socketCount; first += HANDOFF_SOCKETS_PER_MESSAGE) {
+        int count = snapshot->socketCount - first;
+        if (count > HANDOFF_SOCKETS_PER_MESSAGE) {
+            count = HANDOFF_SOCKETS_PER_MESSAGE;
+        }
+        if (sendSockets(successor, snapshot->sockets + first, count) < 0) {
+            return -1;
+        }
+    }
+    return sendAll(successor, snapshot->bytes, snapshot->len);
+}
+
+int handoffReceive(char *path, Snapshot *snapshot) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int socketNum = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketNum < 0) {
+        perror("socket call");
+        return -1;
+    }
+    if (connect(socketNum, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        int error = errno;
+        close(socketNum);
+        if (error == ENOENT || error == ECONNREFUSED) {
+            return 0;   // nobody there: a fresh start
+        }
+        perror("handoff connect");
+        return -1;
+    }
+    setTimeouts(socketNum);
+
+    HandoffHeader header;
+    uint8_t accepted = HANDOFF_ACCEPTED;
+    int result = -1;
+    snapshotInit(snapshot);
+    if (receiveAll(socketNum, &header, sizeof(header)) < 0) {
+        fprintf(stderr, "No handoff header from %s\n", path);
+    } else if (ntohl(header.magic) != HANDOFF_MAGIC || ntohl(header.version) != HANDOFF_VERSION) {
+        // closing without an answer leaves the old server running
+        if (ntohl(header.magic) != HANDOFF_MAGIC) {
+            fprintf(stderr, "Whatever listens at %s doesn't hand over this way: not taking over\n", path);
+        } else {
+            fprintf(stderr, "Server at %s writes snapshot version %u, this one reads %u: not taking over\n",
+                    path, ntohl(header.version), HANDOFF_VERSION);
+        }
+        close(socketNum);
+        return -1;
+    } else if (sendAll(socketNum, &accepted, 1) == 0) {
+        int remaining = ntohl(header.socketCount);
+        int snapshotLen = ntohl(header.snapshotLen);
+        while (remaining > 0 && receiveSockets(socketNum, snapshot, &remaining) == 0) {
+        }
+        if (remaining == 0) {
+            socketNum = keepNumbers(socketNum, snapshot);
+        }
+        if (remaining == 0 && snapshotLen >= 0 && (snapshot->bytes = malloc(snapshotLen + 1)) != NULL
+                && receiveAll(socketNum, snapshot->bytes, snapshotLen) == 0) {
+            snapshot->len = snapshot->size = snapshotLen;
+            result = 1;
+        }
+    }
+
+    // the old server closes once its files are shut, then they are ours
+    uint8_t byte;
+    if (result == 1 && recv(socketNum, &byte, 1, 0) != 0) {
+        result = -1;
+    }
+    if (result < 0) {
+        fprintf(stderr, "Handoff from %s failed\n", path);
+        for (int i = 0; i < snapshot->socketMapSize; i++) {
+            if (snapshot->socketMap[i] >= 0) close(snapshot->socketMap[i]);
+        }
+        snapshotFree(snapshot);
+    }
+    close(socketNum);
+    return result;
+}
+
+// Put every socket back on the number it had in the old server, so what is
+// keyed by socket number outside this process (the UDP ids clients were
+// given) still holds.  Anything in the way is moved above the highest old
+// number first.  Returns where socket ended up.
+static int keepNumbers(int socket, Snapshot *snapshot) {
+    int above = snapshot->socketMapSize;
+    if (socket < above) {
+        int moved = fcntl(socket, F_DUPFD_CLOEXEC, above);
+        if (moved >= 0) {
+            close(socket);
+            socket = moved;
+        }
+    }
+    for (int old = 0; old < snapshot->socketMapSize; old++) {
+        int current = snapshot->socketMap[old];
+        if (current >= 0 && current != old && current < above) {
+            int moved = fcntl(current, F_DUPFD_CLOEXEC, above);
+            if (moved >= 0) {
+                close(current);
+                snapshot->socketMap[old] = moved;
+            }
+        }
+    }
+    for (int old = 0; old < snapshot->socketMapSize; old++) {
+        int current = snapshot->socketMap[old];
+        // a number this process already uses keeps the socket where it is
+        if (current >= 0 && current != old && fcntl(old, F_GETFD) < 0
+                && dup3(current, old, O_CLOEXEC) == old) {
+            close(current);
+            snapshot->socketMap[old] = old;
+        }
+    }
+    return socket;
+}
+
+static void setTimeouts(int socket) {
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+static int sendAll(int socket, const void *bytes, int len) {
+    const uint8_t *at = bytes;
+    while (len > 0) {
+        int sent = send(socket, at, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            perror("handoff send");
+            return -1;
+        }
+        at += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int receiveAll(int socket, void *bytes, int len) {
+    uint8_t *at = bytes;
+    while (len > 0) {
+        int received = recv(socket, at, len, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) {
+            return -1;
+        }
+        at += received;
+        len -= received;
+    }
+    return 0;
+}
+
+static int sendSockets(int successor, const int *sockets, int count) {
+    uint32_t words[CHUNK_WORDS];
+    memset(words, 0, sizeof(words));
+    words[0] = htonl(count);
+    for (int i = 0; i < count; i++) {
+        words[1 + i] = htonl(sockets[i]);
+    }
+
+    union {
+        struct cmsghdr header;
+        uint8_t space[CMSG_SPACE(HANDOFF_SOCKETS_PER_MESSAGE * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { words, sizeof(words) };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), sockets, count * sizeof(int));
+
+    // the descriptors travel with the first byte, the rest can follow
+    int sent = sendmsg(successor, &message, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR) {
+        sent = sendmsg(successor, &message, MSG_NOSIGNAL);
+    }
+    if (sent < 0) {
+        perror("handoff sendmsg");
+        return -1;
+    }
+    return sendAll(successor, (uint8_t *)words + sent, sizeof(words) - sent);
+}
+
+static int receiveSockets(int socket, Snapshot *snapshot, int *remaining) {
+    uint32_t words[CHUNK_WORDS];
+    union {
+        struct cmsghdr header;
+        uint8_t space[CMSG_SPACE(HANDOFF_SOCKETS_PER_MESSAGE * sizeof(int))];
+    } control;
+    struct iovec iov = { words, sizeof(words) };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+
+    int received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    while (received < 0 && errno == EINTR) {
+        received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    }
+    if (received <= 0) {
+        return -1;
+    }
+
+    int sockets[HANDOFF_SOCKETS_PER_MESSAGE];
+    int socketCount = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        socketCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(sockets, CMSG_DATA(cmsg), socketCount * sizeof(int));
+    }
+
+    int count = -1;
+    if (!(message.msg_flags & MSG_CTRUNC)
+            && receiveAll(socket, (uint8_t *)words + received, sizeof(words) - received) == 0) {
+        count = ntohl(words[0]);
+    }
+    if (count != socketCount || count > *remaining) {
+        for (int i = 0; i < socketCount; i++) {
+            close(sockets[i]);
+        }
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (snapshotMapSocket(snapshot, (int)ntohl(words[1 + i]), sockets[i]) < 0) {
+            close(sockets[i]);
+        }
+    }
+    *remaining -= count;
+    return 0;
+}
@@ -0,0 +1,41 @@
+// handoff.h
+// Upgrading the server without dropping a connection.  The running server
+// listens on a UNIX socket (-K path).  A new server started with the same
+// -K connects there first, and the old one passes it every socket it holds
+// with SCM_RIGHTS, along with a snapshot of the state that goes with them,
+// then exits.  The kernel keeps the connections open throughout, and the
+// listening sockets with their backlog, so clients never notice.
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "snapshot.h"
+
+#define HANDOFF_SOCKETS_PER_MESSAGE 250     // the kernel takes at most 253
+#define HANDOFF_TIMEOUT_MS 10000            // a stalled peer, give up on it
+
+// The snapshot layout is whatever the *Save() functions write, so a
+// successor only takes one from a server that writes the same.  Bump the
+// version whenever one of them changes.
+#define HANDOFF_MAGIC 0x43484b31            // "CHK1"
+#define HANDOFF_VERSION 1
+
+// Old server: the listener, polled for a successor
+int handoffListen(char *path);
+
+// A successor is waiting on listener: its socket, or -1 if it failed or is
+// run by someone else
+int handoffAccept(int listener);
+
+// Send the snapshot and its sockets, blocking.  Nothing is passed until the
+// successor has accepted the magic and version.  0, or -1 and the sender
+// carries on as if nothing happened.  Closing successor afterwards tells it
+// the old server has let go of its files.
+int handoffSend(int successor, Snapshot *snapshot);
+
+// New server: 1 with the snapshot read and its sockets mapped, 0 if no
+// server is listening at path, -1 if the handoff failed or the old server
+// writes another snapshot version (it keeps running).  Returns once the old
+// server has closed its end.
+int handoffReceive(char *path, Snapshot *snapshot);
+
+#endif
@@ -0,0 +1,99 @@
+// hashRing.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashRing.h"
+
+typedef struct RingPoint {
+    uint32_t hash;
+    int node;
+} RingPoint;
+
+static char *nodes[HASH_RING_MAX_NODES];
+static int nodeCount = 0;
+static RingPoint points[HASH_RING_MAX_NODES * HASH_RING_VNODES];
+static int pointCount = 0;
+
+static uint32_t hashKey(const char *key, int keyLength, int replica);
+static int comparePoints(const void *a, const void *b);
+
+void hashRingReset(void) {
+    for (int i = 0; i < nodeCount; i++) {
+        free(nodes[i]);
+    }
+    nodeCount = 0;
+    pointCount = 0;
+}
+
+// Returns 0, or -1 if the ring is full
+int hashRingAdd(const char *node) {
+    if (nodeCount == HASH_RING_MAX_NODES) {
+        return -1;
+    }
+    nodes[nodeCount] = strdup(node);
+
+    for (int replica = 0; replica < HASH_RING_VNODES; replica++) {
+        points[pointCount].hash = hashKey(node, strlen(node), replica);
+        points[pointCount].node = nodeCount;
+        pointCount++;
+    }
+    nodeCount++;
+
+    // ties are broken by name so every node builds the identical ring
+    qsort(points, pointCount, sizeof(RingPoint), comparePoints);
+    return 0;
+}
+
+const char *hashRingOwner(const char *key, int keyLength) {
+    if (pointCount == 0) {
+        return NULL;
+    }
+
+    // first point at or after the key's hash, wrapping past the top
+    uint32_t hash = hashKey(key, keyLength, -1);
+    int low = 0;
+    int high = pointCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return nodes[points[low == pointCount ? 0 : low].node];
+}
+
+int hashRingNodes(void) {
+    return nodeCount;
+}
+
+// FNV-1a over the key and the replica number, then a murmur3 finalizer
+// (FNV alone clusters the points of similar names)
+static uint32_t hashKey(const char *key, int keyLength, int replica) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < keyLength; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    if (replica >= 0) {
+        for (int i = 0; i < 4; i++) {
+            hash = (hash ^ ((replica >> (i * 8)) & 0xff)) * 16777619u;
+        }
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int comparePoints(const void *a, const void *b) {
+    const RingPoint *left = a;
+    const RingPoint *right = b;
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return strcmp(nodes[left->node], nodes[right->node]);
+}
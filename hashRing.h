@@ -0,0 +1,19 @@
+// hashRing.h
+// Consistent hashing: every node gets HASH_RING_VNODES points on a 32 bit
+// ring and a key belongs to the first point at or after its own hash.
+// Adding or removing a node only moves the keys next to that node's points,
+// about 1/N of them.
+#ifndef __HASHRING_H__
+#define __HASHRING_H__
+
+#include <stdint.h>
+
+#define HASH_RING_VNODES 128
+#define HASH_RING_MAX_NODES 64
+
+void hashRingReset(void);
+int hashRingAdd(const char *node);
+const char *hashRingOwner(const char *key, int keyLength);     // NULL while the ring is empty
+int hashRingNodes(void);
+
+#endif
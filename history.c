@@ -0,0 +1,191 @@
+// history.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "history.h"
+#include "connection.h"
+
+#define HISTORY_MAGIC 0x54534843        // "CHST"
+#define HISTORY_VERSION 1
+
+typedef struct HistoryEntry {
+    uint64_t offset;                // position in the byte stream, not the ring
+    uint32_t len;
+    uint32_t unused;
+} HistoryEntry;
+
+// Start of the mapping: this header, the entry index, then the byte ring.
+// Entry n sits at entries[n % maxEntries], byte offset o at data[o % dataSize].
+typedef struct HistoryRing {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dataSize;
+    uint32_t maxEntries;
+    uint64_t firstEntry;            // oldest entry still held
+    uint64_t nextEntry;
+    uint64_t writeOffset;           // bytes ever appended
+    HistoryEntry entries[];
+} HistoryRing;
+
+struct History {
+    HistoryRing *ring;
+    uint8_t *data;
+    size_t mapLen;
+    int fd;
+};
+
+static void copyIn(History *history, uint64_t offset, uint8_t *bytes, int len);
+
+History *historyOpen(const char *path, int dataSize) {
+    size_t indexLen = sizeof(HistoryRing) + HISTORY_MAX_ENTRIES * sizeof(HistoryEntry);
+    size_t mapLen = indexLen + dataSize;
+    int fd = -1;
+    int fresh = 1;
+    uint8_t *map = NULL;
+
+    if (path != NULL) {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) < 0) {
+            perror("history file");
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        fresh = (size_t)info.st_size != mapLen;
+        if (fresh && ftruncate(fd, mapLen) < 0) {
+            perror("history file size");
+            close(fd);
+            return NULL;
+        }
+        map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        map = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror("history mmap");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    HistoryRing *ring = (HistoryRing *)map;
+    if (!fresh && (ring->magic != HISTORY_MAGIC || ring->version != HISTORY_VERSION
+            || ring->dataSize != (uint32_t)dataSize || ring->maxEntries != HISTORY_MAX_ENTRIES
+            || ring->nextEntry - ring->firstEntry > HISTORY_MAX_ENTRIES)) {
+        fprintf(stderr, "history: %s doesn't match, starting it over\n", path);
+        fresh = 1;
+    }
+    if (fresh) {
+        memset(ring, 0, sizeof(HistoryRing));
+        ring->magic = HISTORY_MAGIC;
+        ring->version = HISTORY_VERSION;
+        ring->dataSize = dataSize;
+        ring->maxEntries = HISTORY_MAX_ENTRIES;
+    }
+
+    History *history = malloc(sizeof(History));
+    if (history == NULL) {
+        munmap(map, mapLen);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    history->ring = ring;
+    history->data = map + indexLen;
+    history->mapLen = mapLen;
+    history->fd = fd;
+    return history;
+}
+
+void historyClose(History *history) {
+    if (history == NULL) return;
+    munmap(history->ring, history->mapLen);
+    if (history->fd >= 0) close(history->fd);
+    free(history);
+}
+
+void historyAppend(History *history, uint8_t *pdu, int pduLen) {
+    if (history == NULL) return;
+    HistoryRing *ring = history->ring;
+    uint32_t recordLen = pduLen + PDU_HEADER_LEN;
+    if (recordLen > ring->dataSize) return;
+
+    // make room: the oldest entries fall off by count or by bytes
+    while (ring->nextEntry > ring->firstEntry) {
+        HistoryEntry *oldest = &ring->entries[ring->firstEntry % ring->maxEntries];
+        int full = ring->nextEntry - ring->firstEntry == ring->maxEntries;
+        int overwritten = ring->writeOffset + recordLen - oldest->offset > ring->dataSize;
+        if (!full && !overwritten) break;
+        ring->firstEntry++;
+    }
+
+    uint16_t lengthField = htons(recordLen);
+    uint8_t header[PDU_HEADER_LEN];
+    memcpy(header, &lengthField, sizeof(lengthField));
+    copyIn(history, ring->writeOffset, header, PDU_HEADER_LEN);
+    copyIn(history, ring->writeOffset + PDU_HEADER_LEN, pdu, pduLen);
+
+    HistoryEntry *entry = &ring->entries[ring->nextEntry % ring->maxEntries];
+    entry->offset = ring->writeOffset;
+    entry->len = recordLen;
+    ring->writeOffset += recordLen;
+    ring->nextEntry++;
+}
+
+// The last count PDUs are contiguous in the stream, so at most two pieces
+// of the ring: one sendmsg() for the whole catch-up.  It skips the slow
+// consumer check, so it is cut down to the newest PDUs that fit in the
+// connection's catch-up allowance.
+int historyReplay(History *history, int count, int socket) {
+    int held = historyCount(history);
+    if (count > held) count = held;
+    if (count <= 0) return 0;
+
+    HistoryRing *ring = history->ring;
+    uint64_t room = connCatchUpRoom(socket);
+    uint64_t start = ring->entries[(ring->nextEntry - count) % ring->maxEntries].offset;
+    while (count > 0 && ring->writeOffset - start > room) {
+        count--;
+        start = ring->entries[(ring->nextEntry - count) % ring->maxEntries].offset;
+    }
+    if (count == 0) return 0;
+    uint64_t length = ring->writeOffset - start;
+    uint32_t position = start % ring->dataSize;
+
+    struct iovec iov[2];
+    int iovCount = 1;
+    iov[0].iov_base = history->data + position;
+    iov[0].iov_len = length;
+    if (position + length > ring->dataSize) {
+        iov[0].iov_len = ring->dataSize - position;
+        iov[1].iov_base = history->data;
+        iov[1].iov_len = length - iov[0].iov_len;
+        iovCount = 2;
+    }
+
+    if (connSendFramed(socket, iov, iovCount) < 0) {
+        return 0;
+    }
+    return count;
+}
+
+int historyCount(History *history) {
+    if (history == NULL) return 0;
+    return history->ring->nextEntry - history->ring->firstEntry;
+}
+
+static void copyIn(History *history, uint64_t offset, uint8_t *bytes, int len) {
+    uint32_t dataSize = history->ring->dataSize;
+    uint32_t position = offset % dataSize;
+    int first = len < (int)(dataSize - position) ? len : (int)(dataSize - position);
+
+    memcpy(history->data + position, bytes, first);
+    if (first < len) {
+        memcpy(history->data, bytes + first, len - first);
+    }
+}
@@ -0,0 +1,28 @@
+// history.h
+// Bounded history of recent traffic on a channel, kept as framed PDUs in a
+// byte ring so a joining client can be caught up with a single scatter/gather
+// write.  The ring lives in a mapping, backed by a file when one is given so
+// the history survives a server restart.
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stdint.h>
+
+#define HISTORY_DEFAULT_BYTES (256 * 1024)
+#define HISTORY_MAX_ENTRIES 4096            // messages held, whatever their size
+
+typedef struct History History;
+
+// path may be NULL for a ring that only lives in memory
+History *historyOpen(const char *path, int dataSize);
+void historyClose(History *history);
+
+// Record one PDU (flag onward, the length header is added)
+void historyAppend(History *history, uint8_t *pdu, int pduLen);
+
+// Send the last count PDUs on socket, or as many of the newest as fit in
+// its catch-up allowance (connection.h).  Returns how many were sent.
+int historyReplay(History *history, int count, int socket);
+int historyCount(History *history);
+
+#endif
@@ -0,0 +1,496 @@
+// journal.c
+#define _GNU_SOURCE     // mremap()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "journal.h"
+#include "connection.h"
+#include "timerWheel.h"
+
+#define JOURNAL_MAGIC 0x4c4e4a43        // "CJNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_INITIAL_SIZE (64 * 1024)
+#define JOURNAL_PATH_MAX 1024
+#define KNOWN_BUCKETS 1024
+
+// On disk: this header, then framed PDUs back to back.  'used' is bumped
+// after each record is written, so a torn append is never replayed.
+typedef struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t used;
+    uint32_t registered;            // the handle has registered, else a stranger
+    uint32_t reserved;
+} JournalHeader;
+
+typedef struct Journal {
+    struct Journal *next;           // most recently used first
+    char *handle;
+    int fd;
+    uint8_t *map;
+    size_t capacity;
+    int dirty;
+    // replay: the records go out in chunks from the mapping, and the file
+    // only loses what was written
+    int socket;
+    uint64_t queued;                // record bytes handed to the connection
+    uint64_t delivered;             // of those, written to the socket
+    int chunks;                     // queued chunks not released yet
+    int stopped;                    // the connection went away first
+} Journal;
+
+typedef struct ReplayChunk {
+    Journal *journal;
+    int len;
+} ReplayChunk;
+
+// Handles that registered since the server started
+typedef struct KnownHandle {
+    struct KnownHandle *next;
+    char handle[];
+} KnownHandle;
+
+static char *journalDirectory = NULL;
+static int syncIntervalMs = 0;
+static Journal *openJournals = NULL;
+static int openCount = 0;
+static Journal *replayingJournals = NULL;
+static Timer syncTimer;
+static KnownHandle *knownHandles[KNOWN_BUCKETS];
+static int strangerCount = 0;
+
+static Journal *openJournal(const char *handle, int create);
+static void closeJournal(Journal *journal);
+static void unlinkJournal(Journal *journal);
+static int growJournal(Journal *journal, size_t needed);
+static void journalPath(const char *handle, char *path, int pathSize);
+static void syncJournals(Timer *timer, void *arg);
+static int refillReplay(int socket, void *arg);
+static void releaseChunk(void *arg, int written);
+static void stopReplay(void *arg, int written);
+static void endReplay(Journal *journal, uint64_t done);
+static int countStrangers(void);
+static int isKnown(const char *handle);
+static void addKnown(const char *handle);
+
+int journalInit(const char *directory, int syncMs) {
+    if (mkdir(directory, 0700) < 0 && errno != EEXIST) {
+        perror("journal directory");
+        return -1;
+    }
+    journalDirectory = strdup(directory);
+    syncIntervalMs = syncMs;
+    timerInit(&syncTimer, syncJournals, NULL);
+    strangerCount = countStrangers();
+    return 0;
+}
+
+int journalEnabled(void) {
+    return journalDirectory != NULL;
+}
+
+int journalAppend(const char *handle, uint8_t *pdu, int pduLen) {
+    Journal *journal = openJournal(handle, 1);
+    if (journal == NULL) return -1;
+
+    JournalHeader *header = (JournalHeader *)journal->map;
+    size_t recordLen = pduLen + PDU_HEADER_LEN;
+    size_t maxBytes = header->registered ? JOURNAL_MAX_BYTES : JOURNAL_STRANGER_MAX_BYTES;
+    if (header->used + recordLen > maxBytes) {
+        return -1;
+    }
+
+    size_t end = sizeof(JournalHeader) + header->used;
+    if (end + recordLen > journal->capacity) {
+        if (growJournal(journal, end + recordLen) < 0) return -1;
+        header = (JournalHeader *)journal->map;
+    }
+
+    uint16_t lengthField = htons(recordLen);
+    memcpy(journal->map + end, &lengthField, sizeof(lengthField));
+    memcpy(journal->map + end + PDU_HEADER_LEN, pdu, pduLen);
+    header->used += recordLen;
+
+    // durability is the sync timer's job, never this path's
+    journal->dirty = 1;
+    if (syncIntervalMs > 0 && !timerPending(&syncTimer)) {
+        timerSchedule(&syncTimer, timerNowMs() + syncIntervalMs);
+    }
+    return 0;
+}
+
+int journalReplay(const char *handle, int socket) {
+    if (!journalEnabled()) return 0;
+    addKnown(handle);
+
+    Journal *journal = openJournal(handle, 0);
+    if (journal == NULL) return 0;
+
+    JournalHeader *header = (JournalHeader *)journal->map;
+    if (!header->registered) {
+        header->registered = 1;
+        strangerCount--;
+    }
+    int used = header->used;
+
+    // off the open list, so it is never unmapped under the queued chunks
+    Journal **link = &openJournals;
+    while (*link != journal) link = &(*link)->next;
+    *link = journal->next;
+    openCount--;
+    journal->next = replayingJournals;
+    replayingJournals = journal;
+    journal->socket = socket;
+    journal->queued = 0;
+    journal->delivered = 0;
+    journal->chunks = 0;
+    journal->stopped = 0;
+
+    if (used > 0) {
+        printf("Replaying %d stored bytes to %s\n", used, handle);
+    }
+    connSetRefill(socket, refillReplay, stopReplay, journal);
+    return used;
+}
+
+void journalShutdown(int handedOff) {
+    if (!journalEnabled()) return;
+    // after a handoff the successor writes what is queued, otherwise only
+    // what reached the socket is gone from the journal
+    while (replayingJournals != NULL) {
+        Journal *journal = replayingJournals;
+        endReplay(journal, handedOff ? journal->queued : journal->delivered);
+    }
+    syncJournals(&syncTimer, NULL);
+    while (openJournals != NULL) {
+        closeJournal(openJournals);
+    }
+    timerCancel(&syncTimer);
+}
+
+// Find (or open, or create) the journal for a handle and make it the most
+// recently used.  Older journals are unmapped beyond JOURNAL_MAX_OPEN.
+static Journal *openJournal(const char *handle, int create) {
+    // being replayed: stays as it is until the replay ends
+    for (Journal *journal = replayingJournals; journal != NULL; journal = journal->next) {
+        if (strcmp(journal->handle, handle) == 0) {
+            return NULL;
+        }
+    }
+
+    Journal **link = &openJournals;
+    while (*link != NULL) {
+        Journal *journal = *link;
+        if (strcmp(journal->handle, handle) == 0) {
+            *link = journal->next;
+            journal->next = openJournals;
+            openJournals = journal;
+            return journal;
+        }
+        link = &journal->next;
+    }
+
+    if (!journalEnabled()) return NULL;
+
+    char path[JOURNAL_PATH_MAX];
+    journalPath(handle, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd < 0) {
+        if (errno != ENOENT) perror("journal open");
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        perror("journal stat");
+        close(fd);
+        return NULL;
+    }
+
+    size_t capacity = info.st_size;
+    int fresh = capacity < sizeof(JournalHeader);
+    int known = isKnown(handle);
+    if (fresh && !known && strangerCount >= JOURNAL_MAX_STRANGERS) {
+        unlink(path);
+        close(fd);
+        return NULL;
+    }
+    if (fresh) {
+        capacity = JOURNAL_INITIAL_SIZE;
+        if (posix_fallocate(fd, 0, capacity) != 0) {
+            fprintf(stderr, "journal: can't allocate %s\n", path);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    uint8_t *map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("journal mmap");
+        close(fd);
+        return NULL;
+    }
+
+    JournalHeader *header = (JournalHeader *)map;
+    if (fresh) {
+        header->magic = JOURNAL_MAGIC;
+        header->version = JOURNAL_VERSION;
+        header->used = 0;
+        header->registered = known;
+        if (!known) strangerCount++;
+    } else if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION
+            || header->used > capacity - sizeof(JournalHeader)) {
+        fprintf(stderr, "journal: %s is not a valid journal, ignoring it\n", path);
+        munmap(map, capacity);
+        close(fd);
+        return NULL;
+    }
+
+    Journal *journal = calloc(1, sizeof(Journal));
+    if (journal == NULL) {
+        munmap(map, capacity);
+        close(fd);
+        return NULL;
+    }
+    journal->handle = strdup(handle);
+    journal->fd = fd;
+    journal->map = map;
+    journal->capacity = capacity;
+    journal->socket = -1;
+    journal->next = openJournals;
+    openJournals = journal;
+    openCount++;
+
+    if (openCount > JOURNAL_MAX_OPEN) {
+        Journal *last = openJournals;
+        while (last->next != NULL) last = last->next;
+        closeJournal(last);
+    }
+    return journal;
+}
+
+// Unmap and close a journal, keeping its file
+static void closeJournal(Journal *journal) {
+    Journal **link = &openJournals;
+    while (*link != NULL && *link != journal) link = &(*link)->next;
+    if (*link == journal) {
+        *link = journal->next;
+        openCount--;
+    }
+
+    if (journal->dirty) {
+        JournalHeader *header = (JournalHeader *)journal->map;
+        msync(journal->map, sizeof(JournalHeader) + header->used, MS_ASYNC);
+    }
+    munmap(journal->map, journal->capacity);
+    close(journal->fd);
+    free(journal->handle);
+    free(journal);
+}
+
+static void unlinkJournal(Journal *journal) {
+    if (!((JournalHeader *)journal->map)->registered) {
+        strangerCount--;
+    }
+    char path[JOURNAL_PATH_MAX];
+    journalPath(journal->handle, path, sizeof(path));
+    unlink(path);
+}
+
+// Double the file (at least up to needed) and remap it
+static int growJournal(Journal *journal, size_t needed) {
+    size_t capacity = journal->capacity * 2;
+    while (capacity < needed) capacity *= 2;
+
+    if (posix_fallocate(journal->fd, 0, capacity) != 0) {
+        fprintf(stderr, "journal: can't grow journal for %s\n", journal->handle);
+        return -1;
+    }
+    uint8_t *map = mremap(journal->map, journal->capacity, capacity, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        perror("journal mremap");
+        return -1;
+    }
+    journal->map = map;
+    journal->capacity = capacity;
+    return 0;
+}
+
+// <directory>/<handle>.jnl, with anything but [A-Za-z0-9_-] escaped as %XX
+static void journalPath(const char *handle, char *path, int pathSize) {
+    int len = snprintf(path, pathSize, "%s/", journalDirectory);
+    for (const unsigned char *c = (const unsigned char *)handle; *c && len < pathSize - 8; c++) {
+        if (isalnum(*c) || *c == '_' || *c == '-') {
+            path[len++] = *c;
+        } else {
+            len += snprintf(path + len, pathSize - len, "%%%02X", *c);
+        }
+    }
+    snprintf(path + len, pathSize - len, ".jnl");
+}
+
+// Periodic writeback: start every journal written since the last one on
+// its way to disk.  This runs on the poll loop, so it doesn't wait for it.
+static void syncJournals(Timer *timer, void *arg) {
+    for (Journal *journal = openJournals; journal != NULL; journal = journal->next) {
+        if (journal->dirty) {
+            JournalHeader *header = (JournalHeader *)journal->map;
+            msync(journal->map, sizeof(JournalHeader) + header->used, MS_ASYNC);
+            journal->dirty = 0;
+        }
+    }
+}
+
+// ----- Replay -----
+
+// The queue has room again: the next records, as many whole ones as fit in
+// the catch-up allowance (at least one if nothing else is queued).  The
+// mapped records are already framed PDUs and go out as they are.
+static int refillReplay(int socket, void *arg) {
+    Journal *journal = arg;
+    JournalHeader *header = (JournalHeader *)journal->map;
+    if (journal->delivered == header->used) {
+        endReplay(journal, journal->delivered);
+        return 0;
+    }
+
+    uint8_t *records = journal->map + sizeof(JournalHeader);
+    int room = connCatchUpRoom(socket);
+    int empty = connGet(socket)->outHead == NULL;
+    int len = 0;
+    while (journal->queued + len < header->used) {
+        uint16_t lengthField;
+        memcpy(&lengthField, records + journal->queued + len, sizeof(lengthField));
+        int recordLen = ntohs(lengthField);
+        if (recordLen < PDU_HEADER_LEN || journal->queued + len + recordLen > header->used) {
+            len = header->used - journal->queued;   // damaged: the rest goes as it is
+            break;
+        }
+        if (len + recordLen > room && !(empty && len == 0)) {
+            break;
+        }
+        len += recordLen;
+    }
+    if (len == 0) {
+        return 1;
+    }
+
+    ReplayChunk *chunk = malloc(sizeof(ReplayChunk));
+    if (chunk == NULL) {
+        return 1;
+    }
+    chunk->journal = journal;
+    chunk->len = len;
+    journal->chunks++;
+    uint8_t *at = records + journal->queued;
+    journal->queued += len;
+    connQueueExternal(socket, at, len, releaseChunk, chunk);
+    return 1;
+}
+
+static void releaseChunk(void *arg, int written) {
+    ReplayChunk *chunk = arg;
+    Journal *journal = chunk->journal;
+    journal->chunks--;
+    if (written) {
+        journal->delivered += chunk->len;
+    }
+    free(chunk);
+    if (journal->stopped && journal->chunks == 0) {
+        endReplay(journal, journal->delivered);
+    }
+}
+
+// The connection closed mid-replay: once its queue has let go of every
+// chunk, the journal keeps what was never written
+static void stopReplay(void *arg, int written) {
+    Journal *journal = arg;
+    journal->stopped = 1;
+    if (journal->chunks == 0) {
+        endReplay(journal, journal->delivered);
+    }
+}
+
+// Drop the first done record bytes, and the file with them once it's empty
+static void endReplay(Journal *journal, uint64_t done) {
+    Journal **link = &replayingJournals;
+    while (*link != journal) link = &(*link)->next;
+    *link = journal->next;
+
+    JournalHeader *header = (JournalHeader *)journal->map;
+    if (done >= header->used) {
+        unlinkJournal(journal);
+    } else if (done > 0) {
+        uint8_t *records = journal->map + sizeof(JournalHeader);
+        memmove(records, records + done, header->used - done);
+        header->used -= done;
+        msync(journal->map, sizeof(JournalHeader) + header->used, MS_ASYNC);
+    }
+    munmap(journal->map, journal->capacity);
+    close(journal->fd);
+    free(journal->handle);
+    free(journal);
+}
+
+// ----- Strangers -----
+
+// Journals for handles that never registered, left from earlier runs
+static int countStrangers(void) {
+    DIR *directory = opendir(journalDirectory);
+    if (directory == NULL) return 0;
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        int nameLen = strlen(entry->d_name);
+        if (nameLen < 4 || strcmp(entry->d_name + nameLen - 4, ".jnl") != 0) continue;
+
+        char path[JOURNAL_PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", journalDirectory, entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        JournalHeader header;
+        if (fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                && header.magic == JOURNAL_MAGIC && header.version == JOURNAL_VERSION
+                && !header.registered) {
+            count++;
+        }
+        if (fd >= 0) close(fd);
+    }
+    closedir(directory);
+    return count;
+}
+
+static uint32_t hashHandle(const char *handle) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)handle; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash % KNOWN_BUCKETS;
+}
+
+static int isKnown(const char *handle) {
+    for (KnownHandle *known = knownHandles[hashHandle(handle)]; known != NULL; known = known->next) {
+        if (strcmp(known->handle, handle) == 0) return 1;
+    }
+    return 0;
+}
+
+static void addKnown(const char *handle) {
+    if (isKnown(handle)) return;
+    KnownHandle *known = malloc(sizeof(KnownHandle) + strlen(handle) + 1);
+    if (known == NULL) return;
+    strcpy(known->handle, handle);
+    uint32_t bucket = hashHandle(handle);
+    known->next = knownHandles[bucket];
+    knownHandles[bucket] = known;
+}
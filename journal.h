@@ -0,0 +1,39 @@
+// journal.h
+// Store-and-forward for handles that are offline.  Undeliverable PDUs are
+// appended, already framed, to a memory-mapped append-only journal per
+// handle.  When the handle registers again the mapped records go to the
+// socket as they are, with no copy through user space, paced by the
+// connection's catch-up allowance.  The file only loses records once they
+// are written.
+//
+// Anyone can send to a handle that never registered, so those "stranger"
+// journals are held to fewer and smaller files.
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+
+#define JOURNAL_MAX_BYTES (16 * 1024 * 1024)   // per handle, beyond this PDUs are refused
+#define JOURNAL_STRANGER_MAX_BYTES (64 * 1024) // for a handle that never registered
+#define JOURNAL_MAX_STRANGERS 256              // stranger journals on disk
+#define JOURNAL_MAX_OPEN 64                    // journals kept mapped at once
+#define JOURNAL_DEFAULT_SYNC_MS 1000
+
+// Setup: directory for the journal files and how often dirty journals are
+// flushed to disk (0 leaves it to the kernel)
+int journalInit(const char *directory, int syncIntervalMs);
+int journalEnabled(void);
+
+// Append one PDU (flag onward, the length header is added) for handle.
+// Returns 0, or -1 if the journal is full or can't be written.
+int journalAppend(const char *handle, uint8_t *pdu, int pduLen);
+
+// handle registered on socket: send everything stored for it, forgetting
+// each record once it is written.  Returns the stored bytes (0 if none).
+int journalReplay(const char *handle, int socket);
+
+// Unmap everything.  handedOff: a successor took the connections, and with
+// them whatever replay output is still queued.
+void journalShutdown(int handedOff);
+
+#endif
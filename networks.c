@@ -2,6 +2,8 @@
 // Hugh Smith April 2017
 // Network code to support TCP/UDP client and server connections
 
+#define _GNU_SOURCE	// accept4()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -13,33 +15,53 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
 
 #include "networks.h"
 #include "gethostbyname.h"
+#include "resolver.h"
 
 
 
 // This function sets the server socket. The function returns the server
 // socket number and prints the port number to the screen.  
+// The socket is non-blocking so the server can drain the accept queue with
+// tcpAcceptNonBlocking() until it runs dry.
 
-int tcpServerSetup(int serverPort)
+int tcpServerSetup(int serverPort, int backlog, int sharePort)
 {
 	// Opens a server socket, binds that socket, prints out port, call listens
 	// returns the mainServerSocket
 	
 	int mainServerSocket = 0;
+	int reuse = 1;
 	struct sockaddr_in6 serverAddress;     
 	socklen_t serverAddressLen = sizeof(serverAddress);  
 
-	mainServerSocket= socket(AF_INET6, SOCK_STREAM, 0);
+	mainServerSocket= socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if(mainServerSocket < 0)
 	{
 		perror("socket call");
 		exit(1);
 	}
 
+	// lets a restarted server rebind while old connections sit in TIME_WAIT
+	if (setsockopt(mainServerSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+	{
+		perror("setsockopt SO_REUSEADDR");
+	}
+
+	// several server processes can listen on the same port, the kernel
+	// spreads new connections across them
+	if (sharePort && setsockopt(mainServerSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+	{
+		perror("setsockopt SO_REUSEPORT");
+		exit(-1);
+	}
+
 	memset(&serverAddress, 0, sizeof(struct sockaddr_in6));
 	serverAddress.sin6_family= AF_INET6;         		
 	serverAddress.sin6_addr = in6addr_any;   
@@ -59,7 +81,12 @@ int tcpServerSetup(int serverPort)
 		exit(-1);
 	}
 
-	if (listen(mainServerSocket, LISTEN_BACKLOG) < 0)
+	if (backlog <= 0)
+	{
+		backlog = LISTEN_BACKLOG;
+	}
+
+	if (listen(mainServerSocket, backlog) < 0)
 	{
 		perror("listen call");
 		exit(-1);
@@ -71,7 +98,7 @@ int tcpServerSetup(int serverPort)
 }
 
 // This function waits for a client to ask for services.  It returns
-// the client socket number.   
+// the client socket number, or -1 if the accept failed.
 
 int tcpAccept(int mainServerSocket, int debugFlag)
 {
@@ -82,7 +109,7 @@ int tcpAccept(int mainServerSocket, int debugFlag)
 	if ((client_socket = accept(mainServerSocket, (struct sockaddr*) &clientAddress, (socklen_t *) &clientAddressSize)) < 0)
 	{
 		perror("accept call");
-		exit(-1);
+		return -1;
 	}
 	  
 	if (debugFlag)
@@ -95,36 +122,207 @@ int tcpAccept(int mainServerSocket, int debugFlag)
 	return(client_socket);
 }
 
+// Accepts one pending connection off a non-blocking listening socket.  The
+// new socket is non-blocking and close-on-exec.  Returns -1 (errno set) instead
+// of exiting; errno == EAGAIN/EWOULDBLOCK means the accept queue is empty.
+
+int tcpAcceptNonBlocking(int mainServerSocket, int debugFlag)
+{
+	struct sockaddr_storage clientStorage;	// big enough for a UNIX listener's clients too
+	struct sockaddr_in6 *clientAddress = (struct sockaddr_in6 *) &clientStorage;
+	socklen_t clientAddressSize = sizeof(clientStorage);
+	int client_socket = 0;
+
+	client_socket = accept4(mainServerSocket, (struct sockaddr*) &clientStorage, &clientAddressSize,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_socket < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			perror("accept4 call");
+		}
+		return -1;
+	}
+
+	if (debugFlag && clientStorage.ss_family == AF_UNIX)
+	{
+		printf("Client accepted.  Local client\n");
+	}
+	else if (debugFlag)
+	{
+		printf("Client accepted.  Client IP: %s Client Port Number: %d\n",  
+				getIPAddressString6(clientAddress->sin6_addr.s6_addr), ntohs(clientAddress->sin6_port));
+	}
+
+	return(client_socket);
+}
+
 // This funciton opens a TCP socket, and connects to the server
 // returns the socket number to the server
 
 int tcpClientSetup(char * serverName, char * serverPort, int debugFlag)
 {
-	// This is used by the client to connect to a server using TCP
+	// This is used by the client to connect to a server using TCP.  The
+	// name comes from the resolver's cache when it can, and the connect
+	// races its IPv6 and IPv4 addresses.
 	
 	int socket_num;
-	uint8_t * ipAddress = NULL;
-	struct sockaddr_in6 serverAddress;      
+	Resolved resolved;
+	struct sockaddr_in6 serverAddress;
+	socklen_t serverAddressLen = sizeof(serverAddress);
+	char ipString[INET6_ADDRSTRLEN];
+
+	if (resolverLookup(serverName, serverPort, &resolved) < 0)
+	{
+		fprintf(stderr, "Error getaddrinfo (host: %s): %s\n", serverName, gai_strerror(resolved.error));
+		exit(-1);
+	}
+
+	if ((socket_num = resolverConnect(&resolved)) < 0)
+	{
+		perror("connect call");
+		exit(-1);
+	}
+
+	if (debugFlag)
+	{
+		getpeername(socket_num, (struct sockaddr *) &serverAddress, &serverAddressLen);
+		inet_ntop(AF_INET6, &serverAddress.sin6_addr, ipString, sizeof(ipString));
+		printf("Connected to %s IP: %s Port Number: %d\n", serverName, ipString, atoi(serverPort));
+	}
 	
-	// create the socket
-	if ((socket_num = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
+	return socket_num;
+}
+
+// Starts a TCP connect without waiting for it.  Returns the non-blocking
+// socket with the connect in progress (poll for POLLOUT, then check
+// SO_ERROR), or -1 if the name can't be resolved or the connect fails
+// right away.
+
+int tcpConnectNonBlocking(char * serverName, char * serverPort)
+{
+	Resolved resolved;
+
+	if (resolverLookup(serverName, serverPort, &resolved) < 0)
+	{
+		return -1;
+	}
+
+	return tcpConnectAddressNonBlocking(&resolved.addresses[0]);
+}
+
+// The same for an address that is already resolved (resolverStart())
+
+int tcpConnectAddressNonBlocking(const struct sockaddr_in6 * serverAddress)
+{
+	int socket_num;
+
+	if ((socket_num = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
 	{
 		perror("socket call");
+		return -1;
+	}
+
+	if (connect(socket_num, (const struct sockaddr*)serverAddress, sizeof(*serverAddress)) < 0 && errno != EINPROGRESS)
+	{
+		close(socket_num);
+		return -1;
+	}
+
+	return socket_num;
+}
+
+// UNIX domain stream sockets for clients on the same host: the same PDUs
+// and the same accept loop (tcpAcceptNonBlocking() takes these too), without
+// the TCP/IP stack.  A socket left at socketPath by an earlier run is
+// removed first, anything else there is an error.
+
+int unixServerSetup(char * socketPath, int backlog)
+{
+	int mainServerSocket = 0;
+	struct sockaddr_un serverAddress;
+	struct stat existing;
+
+	if (strlen(socketPath) >= sizeof(serverAddress.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", socketPath);
 		exit(-1);
 	}
 
-	// setup the server structure
-	memset(&serverAddress, 0, sizeof(struct sockaddr_in6));
-	serverAddress.sin6_family = AF_INET6;
-	serverAddress.sin6_port = htons(atoi(serverPort));
-	
-	// get the address of the server 
-	if ((ipAddress = gethostbyname6(serverName, &serverAddress)) == NULL)
+	mainServerSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (mainServerSocket < 0)
+	{
+		perror("socket call");
+		exit(1);
+	}
+
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sun_family = AF_UNIX;
+	strcpy(serverAddress.sun_path, socketPath);
+
+	// a socket left behind by a server that is gone can go, but not one a
+	// running server still listens on
+	if (lstat(socketPath, &existing) == 0 && S_ISSOCK(existing.st_mode))
+	{
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int refused = probe >= 0 && connect(probe, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0
+			&& errno == ECONNREFUSED;
+		if (probe >= 0)
+		{
+			close(probe);
+		}
+		if (!refused)
+		{
+			fprintf(stderr, "Socket path in use: %s\n", socketPath);
+			exit(-1);
+		}
+		unlink(socketPath);
+	}
+
+	if (bind(mainServerSocket, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0)
 	{
+		perror("bind call");
+		exit(-1);
+	}
+
+	if (backlog <= 0)
+	{
+		backlog = LISTEN_BACKLOG;
+	}
+
+	if (listen(mainServerSocket, backlog) < 0)
+	{
+		perror("listen call");
+		exit(-1);
+	}
+
+	printf("Server Socket Path %s \n", socketPath);
+
+	return mainServerSocket;
+}
+
+int unixClientSetup(char * socketPath, int debugFlag)
+{
+	int socket_num;
+	struct sockaddr_un serverAddress;
+
+	if (strlen(socketPath) >= sizeof(serverAddress.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", socketPath);
+		exit(-1);
+	}
+
+	if ((socket_num = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror("socket call");
 		exit(-1);
 	}
 
-	if(connect(socket_num, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sun_family = AF_UNIX;
+	strcpy(serverAddress.sun_path, socketPath);
+
+	if (connect(socket_num, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
 	{
 		perror("connect call");
 		exit(-1);
@@ -132,9 +330,9 @@ int tcpClientSetup(char * serverName, char * serverPort, int debugFlag)
 
 	if (debugFlag)
 	{
-		printf("Connected to %s IP: %s Port Number: %d\n", serverName, getIPAddressString6(ipAddress), atoi(serverPort));
+		printf("Connected to %s\n", socketPath);
 	}
-	
+
 	return socket_num;
 }
 
@@ -16,14 +16,22 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
-#define LISTEN_BACKLOG 10
+// default listen() backlog, the kernel clamps it to net.core.somaxconn
+#define LISTEN_BACKLOG SOMAXCONN
 
 // for the TCP server side
-int tcpServerSetup(int serverPort);
+int tcpServerSetup(int serverPort, int backlog, int sharePort);
 int tcpAccept(int mainServerSocket, int debugFlag);
+int tcpAcceptNonBlocking(int mainServerSocket, int debugFlag);
 
 // for the TCP client side
 int tcpClientSetup(char * serverName, char * serverPort, int debugFlag);
+int tcpConnectNonBlocking(char * serverName, char * serverPort);
+int tcpConnectAddressNonBlocking(const struct sockaddr_in6 * serverAddress);
+
+// for clients on the same host (UNIX domain stream sockets)
+int unixServerSetup(char * socketPath, int backlog);
+int unixClientSetup(char * socketPath, int debugFlag);
 
 // For UDP Server and Client
 int udpServerSetup(int serverPort);
@@ -22,10 +22,24 @@ typedef enum uint8_t {
     FLAG_LIST_COUNT = 11,
     FLAG_LIST_HANDLE = 12,
     FLAG_LIST_END = 13,
+    FLAG_ROOM_JOIN = 14,
+    FLAG_ROOM_LEAVE = 15,
+    FLAG_ROOM_MESSAGE = 16,
+    FLAG_ROOM_ERROR = 17,
+    FLAG_PEER_HELLO = 18,           // server to server (cluster.h)
+    FLAG_PEER_HANDLE_ADD = 19,
+    FLAG_PEER_HANDLE_REMOVE = 20,
+    FLAG_HANDLE_REDIRECT = 21,      // register at host:port instead
+    FLAG_PEER_HANDLE_ERROR = 22,
+    FLAG_THROTTLED = 23,            // over the rate limit, try again later
+    FLAG_UDP_REGISTER = 24,         // broadcasts over UDP to this port (datagram.h)
+    FLAG_UDP_CONFIRM = 25,
+    FLAG_RESUME_TOKEN = 26,         // reconnect with this within the grace window (resume.h)
+    FLAG_RESUME = 27,               // INITIAL with the token of a dropped session
 } flagType;
 
 int sendPDU(int clientSocket, uint8_t * dataBuffer, int lengthOfData); 
 int recvPDU(int socketNumber, uint8_t * dataBuffer, int lengthOfData); 
 
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+// pduSchema.h
+// The wire layout of every PDU, in one place.  Each PDU is a list of fields
+// after its flag, and PDU_SCHEMA expands the lists into encoders, decoders
+// and the dispatch glue:
+//
+//     int pduEncode<Name>(uint8_t *out, int outSize, <one argument per field>)
+//         writes the flag and fields straight into out and returns the
+//         length, or -1 if out is too small
+//     int pduDecode<Name>(const uint8_t *pdu, int pduLen, Pdu<Name> *view)
+//         checks the flag and every field against pduLen and fills in a
+//         Pdu<Name> (flag, then one member per field), 0 or -1
+//     PDU_DISPATCHER(Name, handler), PDU_ROUTE(Name, handler)
+//         the flag-indexed tables of PduHandler, see below
+//
+// Field kinds, and what they are as arguments and in a view:
+//     NAME     PduView        length byte, then the bytes (rooms, addresses, tokens)
+//     HANDLE   PduView        a NAME of 1 to PDU_MAX_HANDLE bytes and no NUL
+//     HANDLES  PduViewList    count byte (1 to PDU_MAX_DESTINATIONS), then a
+//              PduHandleList  HANDLE for each
+//     U8, U16, U32            integers, network byte order
+//     TEXT     PduView        the bytes up to the end of the PDU
+// Decoded views point into the PDU, they are not NUL terminated and only
+// live as long as it does.  Bytes after the last field are ignored.
+// Changing a layout here changes it for the client, the server and the peers.
+#ifndef __PDUSCHEMA_H__
+#define __PDUSCHEMA_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "pdu.h"
+#include "pduView.h"
+
+#define PDU_FLAG_COUNT 256
+
+typedef struct PduViewList {
+    int count;
+    const PduView *items;
+} PduViewList;
+
+typedef struct PduHandleList {
+    int count;
+    PduView items[PDU_MAX_DESTINATIONS];
+} PduHandleList;
+
+// Handlers for the flag-indexed dispatch tables (NULL: unknown flag)
+typedef void (*PduHandler)(int socket, uint8_t *pdu, int pduLen);
+
+// ----- Fields -----
+#define PDU_INITIAL_FIELDS(F)           F(HANDLE, handle)
+#define PDU_INITIAL_HISTORY_FIELDS(F)   F(HANDLE, handle) F(U16, historyCount)
+#define PDU_CONFIRM_FIELDS(F)           F(U8, status)
+#define PDU_REJECT_FIELDS(F)            F(HANDLE, handle)
+#define PDU_BROADCAST_FIELDS(F)         F(HANDLE, sender) F(TEXT, text)
+#define PDU_MESSAGE_FIELDS(F)           F(HANDLE, sender) F(HANDLES, destinations) F(TEXT, text)
+#define PDU_HANDLE_ERROR_FIELDS(F)      F(HANDLE, handle)
+#define PDU_LIST_FIELDS(F)              F(HANDLE, handle)
+#define PDU_LIST_COUNT_FIELDS(F)        F(U32, count)
+#define PDU_LIST_HANDLE_FIELDS(F)       F(HANDLE, handle)
+#define PDU_LIST_END_FIELDS(F)
+#define PDU_ROOM_FIELDS(F)              F(NAME, room)
+#define PDU_ROOM_MESSAGE_FIELDS(F)      F(HANDLE, sender) F(NAME, room) F(TEXT, text)
+#define PDU_PEER_HELLO_FIELDS(F)        F(NAME, name) F(NAME, address) F(NAME, key)
+#define PDU_PEER_HANDLE_FIELDS(F)       F(HANDLE, handle)
+#define PDU_REDIRECT_FIELDS(F)          F(NAME, address)
+#define PDU_PEER_HANDLE_ERROR_FIELDS(F) F(HANDLE, sender) F(HANDLE, destination)
+#define PDU_THROTTLED_FIELDS(F)         F(U8, refusedFlag) F(U32, retryMs)
+#define PDU_UDP_REGISTER_FIELDS(F)      F(U16, port)
+#define PDU_UDP_CONFIRM_FIELDS(F)       F(U32, id)
+#define PDU_RESUME_TOKEN_FIELDS(F)      F(U32, graceMs) F(NAME, token)
+#define PDU_RESUME_FIELDS(F)            F(HANDLE, handle) F(NAME, token)
+
+// ----- PDUs: name, flag, fields -----
+#define PDU_SCHEMA(X) \
+    X(Initial,          FLAG_CLIENT_TO_SEVER_INITIAL,   PDU_INITIAL_FIELDS) \
+    X(InitialHistory,   FLAG_CLIENT_TO_SEVER_INITIAL,   PDU_INITIAL_HISTORY_FIELDS) \
+    X(Confirm,          FLAG_HANDLE_CONFIRM,            PDU_CONFIRM_FIELDS) \
+    X(Reject,           FLAG_HANDLE_REJECT,             PDU_REJECT_FIELDS) \
+    X(Broadcast,        FLAG_BROADCAST,                 PDU_BROADCAST_FIELDS) \
+    X(Message,          FLAG_MESSAGE,                   PDU_MESSAGE_FIELDS) \
+    X(Multicast,        FLAG_MULTICAST,                 PDU_MESSAGE_FIELDS) \
+    X(HandleError,      FLAG_HANDLE_ERROR,              PDU_HANDLE_ERROR_FIELDS) \
+    X(List,             FLAG_LIST,                      PDU_LIST_FIELDS) \
+    X(ListCount,        FLAG_LIST_COUNT,                PDU_LIST_COUNT_FIELDS) \
+    X(ListHandle,       FLAG_LIST_HANDLE,               PDU_LIST_HANDLE_FIELDS) \
+    X(ListEnd,          FLAG_LIST_END,                  PDU_LIST_END_FIELDS) \
+    X(RoomJoin,         FLAG_ROOM_JOIN,                 PDU_ROOM_FIELDS) \
+    X(RoomLeave,        FLAG_ROOM_LEAVE,                PDU_ROOM_FIELDS) \
+    X(RoomMessage,      FLAG_ROOM_MESSAGE,              PDU_ROOM_MESSAGE_FIELDS) \
+    X(RoomError,        FLAG_ROOM_ERROR,                PDU_ROOM_FIELDS) \
+    X(PeerHello,        FLAG_PEER_HELLO,                PDU_PEER_HELLO_FIELDS) \
+    X(PeerHandleAdd,    FLAG_PEER_HANDLE_ADD,           PDU_PEER_HANDLE_FIELDS) \
+    X(PeerHandleRemove, FLAG_PEER_HANDLE_REMOVE,        PDU_PEER_HANDLE_FIELDS) \
+    X(Redirect,         FLAG_HANDLE_REDIRECT,           PDU_REDIRECT_FIELDS) \
+    X(PeerHandleError,  FLAG_PEER_HANDLE_ERROR,         PDU_PEER_HANDLE_ERROR_FIELDS) \
+    X(Throttled,        FLAG_THROTTLED,                 PDU_THROTTLED_FIELDS) \
+    X(UdpRegister,      FLAG_UDP_REGISTER,              PDU_UDP_REGISTER_FIELDS) \
+    X(UdpConfirm,       FLAG_UDP_CONFIRM,               PDU_UDP_CONFIRM_FIELDS) \
+    X(ResumeToken,      FLAG_RESUME_TOKEN,              PDU_RESUME_TOKEN_FIELDS) \
+    X(Resume,           FLAG_RESUME,                    PDU_RESUME_FIELDS)
+
+// ----- Field writers -----
+// Each takes the length so far and returns the new one, -1 stays -1.  They
+// are inline so the offsets of the leading fixed-size fields fold away.
+
+static inline int pduPutU8(uint8_t *out, int outSize, int len, uint8_t value) {
+    if (len < 0 || len + 1 > outSize) return -1;
+    out[len] = value;
+    return len + 1;
+}
+
+static inline int pduPutU16(uint8_t *out, int outSize, int len, uint16_t value) {
+    if (len < 0 || len + 2 > outSize) return -1;
+    value = htons(value);
+    memcpy(out + len, &value, sizeof(value));
+    return len + 2;
+}
+
+static inline int pduPutU32(uint8_t *out, int outSize, int len, uint32_t value) {
+    if (len < 0 || len + 4 > outSize) return -1;
+    value = htonl(value);
+    memcpy(out + len, &value, sizeof(value));
+    return len + 4;
+}
+
+static inline int pduPutTEXT(uint8_t *out, int outSize, int len, PduView text) {
+    if (len < 0 || len + text.length > outSize) return -1;
+    memcpy(out + len, text.data, text.length);
+    return len + text.length;
+}
+
+static inline int pduPutNAME(uint8_t *out, int outSize, int len, PduView name) {
+    if (name.length > UINT8_MAX) return -1;
+    return pduPutTEXT(out, outSize, pduPutU8(out, outSize, len, name.length), name);
+}
+
+static inline int pduPutHANDLE(uint8_t *out, int outSize, int len, PduView handle) {
+    return pduPutNAME(out, outSize, len, handle);
+}
+
+static inline int pduPutHANDLES(uint8_t *out, int outSize, int len, PduViewList handles) {
+    if (handles.count > UINT8_MAX) return -1;
+    len = pduPutU8(out, outSize, len, handles.count);
+    for (int i = 0; i < handles.count; i++) {
+        len = pduPutHANDLE(out, outSize, len, handles.items[i]);
+    }
+    return len;
+}
+
+// ----- Field readers -----
+// Each takes the offset so far and returns the one past its field, -1 if
+// the field runs past pduLen or isn't valid.  -1 stays -1.
+
+static inline int pduTakeU8(const uint8_t *pdu, int pduLen, int offset, uint8_t *value) {
+    if (offset < 0 || offset + 1 > pduLen) return -1;
+    *value = pdu[offset];
+    return offset + 1;
+}
+
+static inline int pduTakeU16(const uint8_t *pdu, int pduLen, int offset, uint16_t *value) {
+    if (offset < 0 || offset + 2 > pduLen) return -1;
+    memcpy(value, pdu + offset, sizeof(*value));
+    *value = ntohs(*value);
+    return offset + 2;
+}
+
+static inline int pduTakeU32(const uint8_t *pdu, int pduLen, int offset, uint32_t *value) {
+    if (offset < 0 || offset + 4 > pduLen) return -1;
+    memcpy(value, pdu + offset, sizeof(*value));
+    *value = ntohl(*value);
+    return offset + 4;
+}
+
+static inline int pduTakeTEXT(const uint8_t *pdu, int pduLen, int offset, PduView *text) {
+    if (offset < 0 || offset > pduLen) return -1;
+    text->data = pdu + offset;
+    text->length = pduLen - offset;
+    return pduLen;
+}
+
+static inline int pduTakeNAME(const uint8_t *pdu, int pduLen, int offset, PduView *name) {
+    uint8_t length = 0;
+    offset = pduTakeU8(pdu, pduLen, offset, &length);
+    if (offset < 0 || offset + length > pduLen) return -1;
+    name->data = pdu + offset;
+    name->length = length;
+    return offset + length;
+}
+
+// Handles are kept as C strings, so a NUL inside one would make it a
+// different handle
+static inline int pduTakeHANDLE(const uint8_t *pdu, int pduLen, int offset, PduView *handle) {
+    offset = pduTakeNAME(pdu, pduLen, offset, handle);
+    if (offset < 0 || handle->length == 0 || handle->length > PDU_MAX_HANDLE
+            || memchr(handle->data, '\0', handle->length) != NULL) {
+        return -1;
+    }
+    return offset;
+}
+
+static inline int pduTakeHANDLES(const uint8_t *pdu, int pduLen, int offset, PduHandleList *handles) {
+    uint8_t count = 0;
+    offset = pduTakeU8(pdu, pduLen, offset, &count);
+    if (count < 1 || count > PDU_MAX_DESTINATIONS) return -1;
+    handles->count = count;
+    for (int i = 0; i < count; i++) {
+        offset = pduTakeHANDLE(pdu, pduLen, offset, &handles->items[i]);
+    }
+    return offset;
+}
+
+// ----- Generated encoders -----
+#define PDU_ARG_NAME PduView
+#define PDU_ARG_HANDLE PduView
+#define PDU_ARG_HANDLES PduViewList
+#define PDU_ARG_U8 uint8_t
+#define PDU_ARG_U16 uint16_t
+#define PDU_ARG_U32 uint32_t
+#define PDU_ARG_TEXT PduView
+#define PDU_PARAM(kind, field) , PDU_ARG_##kind field
+#define PDU_PUT(kind, field) len = pduPut##kind(out, outSize, len, field);
+#define PDU_ENCODER(name, pduFlag, fields) \
+    static inline int pduEncode##name(uint8_t *out, int outSize fields(PDU_PARAM)) { \
+        int len = pduPutU8(out, outSize, 0, pduFlag); \
+        fields(PDU_PUT) \
+        return len; \
+    }
+
+PDU_SCHEMA(PDU_ENCODER)
+
+// ----- Generated decoders -----
+#define PDU_VIEW_NAME PduView
+#define PDU_VIEW_HANDLE PduView
+#define PDU_VIEW_HANDLES PduHandleList
+#define PDU_VIEW_U8 uint8_t
+#define PDU_VIEW_U16 uint16_t
+#define PDU_VIEW_U32 uint32_t
+#define PDU_VIEW_TEXT PduView
+#define PDU_MEMBER(kind, field) PDU_VIEW_##kind field;
+#define PDU_TAKE(kind, field) offset = pduTake##kind(pdu, pduLen, offset, &view->field);
+#define PDU_DECODER(name, pduFlag, fields) \
+    typedef struct Pdu##name { \
+        uint8_t flag; \
+        fields(PDU_MEMBER) \
+    } Pdu##name; \
+    static inline int pduDecode##name(const uint8_t *pdu, int pduLen, Pdu##name *view) { \
+        int offset = pduTakeU8(pdu, pduLen, 0, &view->flag); \
+        fields(PDU_TAKE) \
+        return offset < 0 || view->flag != (pduFlag) ? -1 : 0; \
+    }
+
+PDU_SCHEMA(PDU_DECODER)
+
+// ----- Dispatch -----
+// The dispatch tables are indexed by flag and hold PduHandler.  Handlers
+// take the decoded view (and the PDU itself, for forwarding it as is):
+//
+//     void handler(int socket, const Pdu<Name> *view, uint8_t *pdu, int pduLen)
+//
+// PDU_DISPATCHER(Name, handler) defines handler##Pdu, the PduHandler that
+// decodes and calls handler, or reports the PDU as malformed.  It goes once
+// per handler in a file, before the tables; PDU_ROUTE(Name, handler) is the
+// table entry for it, at Name's flag.
+#define PDU_FLAG_ENUM(name, pduFlag, fields) PDU_FLAG_##name = (pduFlag),
+enum { PDU_SCHEMA(PDU_FLAG_ENUM) };
+
+#define PDU_DISPATCHER(name, handler) \
+    static void handler##Pdu(int socket, uint8_t *pdu, int pduLen) { \
+        Pdu##name view; \
+        if (pduDecode##name(pdu, pduLen, &view) < 0) { \
+            printf("Malformed %s PDU on socket %d\n", #name, socket); \
+            return; \
+        } \
+        handler(socket, &view, pdu, pduLen); \
+    }
+#define PDU_ROUTE(name, handler) [PDU_FLAG_##name] = handler##Pdu,
+
+#endif
@@ -0,0 +1,23 @@
+// pduView.c
+#include <string.h>
+
+#include "pduView.h"
+
+PduView pduViewOf(const char *string) {
+    PduView view = { (const uint8_t *)string, strlen(string) };
+    return view;
+}
+
+int pduViewEquals(PduView view, const char *string) {
+    return strnlen(string, view.length + 1) == (size_t)view.length
+        && memcmp(string, view.data, view.length) == 0;
+}
+
+int pduViewString(PduView view, char *out, int outSize) {
+    if (view.length >= outSize) {
+        return -1;
+    }
+    memcpy(out, view.data, view.length);
+    out[view.length] = '\0';
+    return 0;
+}
@@ -0,0 +1,24 @@
+// pduView.h
+// Views - pointer and length - into a PDU, which the decoders generated in
+// pduSchema.h fill in once the PDU is checked against its own length, so
+// handles and text are never copied out.  Views are not NUL terminated and
+// only live as long as that buffer.
+#ifndef __PDUVIEW_H__
+#define __PDUVIEW_H__
+
+#include <stdint.h>
+
+#define PDU_MAX_HANDLE 100
+#define PDU_MAX_DESTINATIONS 9
+
+typedef struct PduView {
+    const uint8_t *data;
+    int length;
+} PduView;
+
+PduView pduViewOf(const char *string);
+int pduViewEquals(PduView view, const char *string);
+// NUL terminated copy for the places that keep a name, -1 if it won't fit
+int pduViewString(PduView view, char *out, int outSize);
+
+#endif
@@ -8,12 +8,14 @@
 //    are using pthreads do NOT use this code.
 // 2. pollCall() always returns the lowest available file descriptor 
 //    which could cause higher file descriptors to never be processed
+//    (use pollCallAll()/pollNextReady() to walk every ready descriptor)
 //
 // This is for student projects so I don't intend on improving this. 
 
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include "safeUtil.h"
 #include "pollLib.h"
@@ -23,14 +25,23 @@
 static struct pollfd * pollFileDescriptors;
 static int maxFileDescriptor = 0;
 static int currentPollSetSize = 0;
+static int nextReadyIndex = 0;
 
 static void growPollSet(int newSetSize);
 
 // Poll functions (setup, add, remove, call)
 void setupPollSet()
 {
+	int i = 0;
+	
 	currentPollSetSize = POLL_SET_SIZE;
 	pollFileDescriptors = (struct pollfd *) sCalloc(POLL_SET_SIZE, sizeof(struct pollfd));
+	
+	// negative fds are ignored by poll(), fd 0 would watch stdin
+	for (i = 0; i < POLL_SET_SIZE; i++)
+	{
+		pollFileDescriptors[i].fd = -1;
+	}
 }
 
 
@@ -52,12 +63,32 @@ void addToPollSet(int socketNumber)
 
 	pollFileDescriptors[socketNumber].fd = socketNumber;
 	pollFileDescriptors[socketNumber].events = POLLIN;
+	pollFileDescriptors[socketNumber].revents = 0;
 }
 
 void removeFromPollSet(int socketNumber)
 {
-	pollFileDescriptors[socketNumber].fd = 0;
+	pollFileDescriptors[socketNumber].fd = -1;
 	pollFileDescriptors[socketNumber].events = 0;
+	pollFileDescriptors[socketNumber].revents = 0;
+}
+
+void setPollWrite(int socketNumber, int enable)
+{
+	// turns POLLOUT interest on/off for a socket already in the set
+	if (socketNumber >= currentPollSetSize || pollFileDescriptors[socketNumber].fd < 0)
+	{
+		return;
+	}
+	
+	if (enable)
+	{
+		pollFileDescriptors[socketNumber].events |= POLLOUT;
+	}
+	else
+	{
+		pollFileDescriptors[socketNumber].events &= ~POLLOUT;
+	}
 }
 
 int pollCall(int timeInMilliSeconds)
@@ -67,6 +98,7 @@ int pollCall(int timeInMilliSeconds)
 	// if timeInMilliSeconds == -1 blocks forever (until a socket ready)
 	// (this -1 is a feature of poll)
 	// If timeInMilliSeconds == 0 it will return immediately after looking at the poll set
+	// returns -1 on an interrupted or failed poll too, the caller just tries again
 	
 	int i = 0;
 	int returnValue = -1;
@@ -74,8 +106,11 @@ int pollCall(int timeInMilliSeconds)
 	
 	if ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0)
 	{
-		perror("pollCall");
-		exit(-1);
+		if (errno != EINTR)
+		{
+			perror("pollCall");
+		}
+		return -1;
 	}	
 			
 	// check to see if timeout occurred (poll returned 0)
@@ -101,6 +136,47 @@ int pollCall(int timeInMilliSeconds)
 	return returnValue;
 }
 
+int pollCallAll(int timeInMilliSeconds)
+{
+	// polls once and returns how many descriptors are ready (0 on timeout)
+	// walk them with pollNextReady() so no socket is starved
+	
+	int pollValue = 0;
+	
+	nextReadyIndex = maxFileDescriptor;
+	if ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			perror("pollCall");
+		}
+		return 0;	// signal or failure: nothing ready, the caller loops again
+	}
+	
+	nextReadyIndex = 0;
+	return pollValue;
+}
+
+int pollNextReady(int * revents)
+{
+	// returns the next ready socket from the last pollCallAll() and its
+	// revents, or -1 once every ready socket has been returned
+	
+	while (nextReadyIndex < maxFileDescriptor)
+	{
+		int i = nextReadyIndex++;
+		
+		if (pollFileDescriptors[i].fd >= 0 && pollFileDescriptors[i].revents > 0)
+		{
+			*revents = pollFileDescriptors[i].revents;
+			pollFileDescriptors[i].revents = 0;
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
 static void growPollSet(int newSetSize)
 {
 	int i = 0;
@@ -119,8 +195,9 @@ static void growPollSet(int newSetSize)
 	// zero out the new poll set elements
 	for (i = currentPollSetSize; i < newSetSize; i++)
 	{
-		pollFileDescriptors[i].fd = 0;
+		pollFileDescriptors[i].fd = -1;
 		pollFileDescriptors[i].events = 0;
+		pollFileDescriptors[i].revents = 0;
 	}
 	
 	currentPollSetSize = newSetSize;
@@ -18,4 +18,9 @@ void addToPollSet(int socketNumber);
 void removeFromPollSet(int socketNumber);
 int pollCall(int timeInMilliSeconds);
 
-#endif
\ No newline at end of file
+// walk every ready socket from one poll() instead of only the lowest
+int pollCallAll(int timeInMilliSeconds);
+int pollNextReady(int * revents);
+void setPollWrite(int socketNumber, int enable);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+// rateLimit.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rateLimit.h"
+#include "timerWheel.h"
+
+#define SOCKET_TABLE_GROW 64
+
+// Thousandths of a token, so a rate of r tokens a second is r per ms
+typedef struct TokenBucket {
+    int64_t milliTokens;
+    uint64_t refilledMs;            // 0: no connection on this socket
+} TokenBucket;
+
+static int rates[RATE_CLASSES] = {
+    RATE_DEFAULT_UNICAST,
+    RATE_DEFAULT_MULTICAST,
+    RATE_DEFAULT_BROADCAST,
+};
+static int globalRate = RATE_DEFAULT_GLOBAL_BROADCAST;
+static TokenBucket globalBucket;    // starts empty and fills on first use
+static TokenBucket *buckets = NULL; // RATE_CLASSES per socket
+static int bucketSockets = 0;
+static uint64_t refused = 0;
+
+static void refill(TokenBucket *bucket, int rate, uint64_t now);
+static int64_t capacity(int rate);
+static uint32_t waitMs(TokenBucket *bucket, int rate, int64_t milliTokens);
+
+void rateLimitSet(RateClass rateClass, int perSecond) {
+    rates[rateClass] = perSecond > 0 ? perSecond : 0;
+}
+
+void rateLimitSetGlobal(int deliveriesPerSecond) {
+    globalRate = deliveriesPerSecond > 0 ? deliveriesPerSecond : 0;
+}
+
+// A new connection starts with full buckets
+void rateLimitOpen(int socket) {
+    if (socket >= bucketSockets) {
+        int newSize = socket + SOCKET_TABLE_GROW;
+        TokenBucket *table = realloc(buckets, newSize * RATE_CLASSES * sizeof(TokenBucket));
+        if (table == NULL) return;
+        memset(table + bucketSockets * RATE_CLASSES, 0, (newSize - bucketSockets) * RATE_CLASSES * sizeof(TokenBucket));
+        buckets = table;
+        bucketSockets = newSize;
+    }
+
+    uint64_t now = timerNowMs();
+    for (int i = 0; i < RATE_CLASSES; i++) {
+        buckets[socket * RATE_CLASSES + i].milliTokens = capacity(rates[i]);
+        buckets[socket * RATE_CLASSES + i].refilledMs = now;
+    }
+}
+
+void rateLimitClose(int socket) {
+    if (socket < bucketSockets) {
+        memset(&buckets[socket * RATE_CLASSES], 0, RATE_CLASSES * sizeof(TokenBucket));
+    }
+}
+
+uint32_t rateLimitTake(int socket, RateClass rateClass, int deliveries) {
+    uint64_t now = timerNowMs();
+    int rate = rates[rateClass];
+    TokenBucket *bucket = NULL;
+    int64_t globalCost = 0;
+    uint32_t wait = 0;
+
+    if (rate > 0 && socket >= 0 && socket < bucketSockets
+            && buckets[socket * RATE_CLASSES + rateClass].refilledMs != 0) {
+        bucket = &buckets[socket * RATE_CLASSES + rateClass];
+        refill(bucket, rate, now);
+        wait = waitMs(bucket, rate, 1000);
+    }
+    if (rateClass != RATE_UNICAST && globalRate > 0) {
+        // a fan-out bigger than the whole burst still goes once it's full
+        refill(&globalBucket, globalRate, now);
+        globalCost = (int64_t)deliveries * 1000;
+        if (globalCost > capacity(globalRate)) {
+            globalCost = capacity(globalRate);
+        }
+        uint32_t globalWait = waitMs(&globalBucket, globalRate, globalCost);
+        wait = globalWait > wait ? globalWait : wait;
+    }
+
+    // nothing is taken from either bucket unless both can pay
+    if (wait > 0) {
+        refused++;
+        return wait;
+    }
+    if (bucket != NULL) {
+        bucket->milliTokens -= 1000;
+    }
+    globalBucket.milliTokens -= globalCost;
+    return 0;
+}
+
+uint64_t rateLimitRefused(void) {
+    return refused;
+}
+
+static void refill(TokenBucket *bucket, int rate, uint64_t now) {
+    bucket->milliTokens += (int64_t)(now - bucket->refilledMs) * rate;
+    if (bucket->milliTokens > capacity(rate)) {
+        bucket->milliTokens = capacity(rate);
+    }
+    bucket->refilledMs = now;
+}
+
+static int64_t capacity(int rate) {
+    return (int64_t)rate * RATE_BURST_SECONDS * 1000;
+}
+
+// 0 if the bucket holds milliTokens already
+static uint32_t waitMs(TokenBucket *bucket, int rate, int64_t milliTokens) {
+    if (bucket->milliTokens >= milliTokens) {
+        return 0;
+    }
+    return (milliTokens - bucket->milliTokens + rate - 1) / rate;
+}
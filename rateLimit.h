@@ -0,0 +1,40 @@
+// rateLimit.h
+// Token buckets for the operations that make the server do work for other
+// people.  Every connection has a bucket per class (one token per PDU), and
+// anything that fans out also draws on one server-wide bucket counted in
+// deliveries, so a few senders together can't turn the loop into a fan-out
+// machine.  A bucket refills at rate tokens a second up to burst.
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdint.h>
+
+typedef enum {
+    RATE_UNICAST,       // %M
+    RATE_MULTICAST,     // %C, and %R to a room's members
+    RATE_BROADCAST,     // %B, and %L, which sends every handle
+    RATE_CLASSES,
+} RateClass;
+
+// Defaults: only broadcasts are limited, unicast and multicast cost the
+// server no more than they cost the sender
+#define RATE_DEFAULT_UNICAST 0
+#define RATE_DEFAULT_MULTICAST 0
+#define RATE_DEFAULT_BROADCAST 50               // per second per connection
+#define RATE_DEFAULT_GLOBAL_BROADCAST 500000    // deliveries per second
+#define RATE_BURST_SECONDS 2                    // burst = this many seconds of rate
+
+// Setup (rate 0 turns a limit off)
+void rateLimitSet(RateClass rateClass, int perSecond);
+void rateLimitSetGlobal(int deliveriesPerSecond);
+
+// Per connection
+void rateLimitOpen(int socket);
+void rateLimitClose(int socket);
+
+// Take one token (and, past unicast, deliveries global tokens).  Returns
+// 0 if the PDU may go, otherwise the ms until it would have been allowed.
+uint32_t rateLimitTake(int socket, RateClass rateClass, int deliveries);
+uint64_t rateLimitRefused(void);
+
+#endif
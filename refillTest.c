@@ -0,0 +1,59 @@
+// refillTest.c
+// Two catch-ups started on one socket: the first has to be stopped when the
+// second is set, and the second when the connection closes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "connection.h"
+#include "timerWheel.h"
+
+typedef struct CatchUp {
+    int refills;
+    int stops;
+} CatchUp;
+
+// never done, and queues nothing, so only a stop ends it
+static int refill(int socket, void *arg) {
+    CatchUp *catchUp = arg;
+    catchUp->refills++;
+    return 1;
+}
+
+static void stop(void *arg, int written) {
+    CatchUp *catchUp = arg;
+    catchUp->stops++;
+}
+
+static int check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    return ok ? 0 : 1;
+}
+
+int main(void) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    timerWheelInit();
+    connSetLimits(CONN_DEFAULT_MAX_OUT_BYTES, 0, SLOW_DISCONNECT);
+    connOpen(sockets[0]);
+
+    CatchUp first = { 0, 0 };
+    CatchUp second = { 0, 0 };
+    int failed = 0;
+    connSetRefill(sockets[0], refill, stop, &first);
+    failed += check(first.refills == 1 && first.stops == 0, "first catch-up starts");
+    connSetRefill(sockets[0], refill, stop, &second);
+    failed += check(first.stops == 1, "second catch-up stops the first");
+    failed += check(second.refills == 1 && second.stops == 0, "second catch-up starts");
+
+    connClose(sockets[0]);
+    failed += check(first.stops == 1 && second.stops == 1, "close stops only the running one");
+
+    close(sockets[0]);
+    close(sockets[1]);
+    return failed > 0;
+}
@@ -0,0 +1,197 @@
+// relay.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "relay.h"
+#include "connection.h"
+#include "pdu.h"
+
+// Empty between calls: everything spliced in is spliced or read out again
+static int relayPipe[2] = { -1, -1 };
+static uint64_t relayed = 0;
+
+// Sockets whose SO_RCVLOWAT is raised to wait for the rest of a %M
+static uint8_t *waiting = NULL;
+static int waitingSize = 0;
+
+static int moveToPipe(int socket, int length);
+static int drainPipe(uint8_t *out, int length);
+static void emptyPipe(void);
+static void waitForBytes(int socket, int bytes);
+
+int relayInit(void) {
+    if (pipe2(relayPipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+    return 0;
+}
+
+void relayShutdown(void) {
+    if (relayPipe[0] >= 0) {
+        close(relayPipe[0]);
+        close(relayPipe[1]);
+        relayPipe[0] = relayPipe[1] = -1;
+    }
+}
+
+int relayPeekMessage(int socket, int maxPduLen, uint8_t *header, PduMessage *message, int *headerLen) {
+    int available = 0;
+    if (ioctl(socket, FIONREAD, &available) < 0 || available < PDU_HEADER_LEN + 1) {
+        return 0;
+    }
+
+    int peeked = recv(socket, header, RELAY_MAX_HEADER, MSG_PEEK);
+    if (peeked < PDU_HEADER_LEN + 1 || header[PDU_HEADER_LEN] != FLAG_MESSAGE) {
+        return 0;
+    }
+    uint16_t lengthField;
+    memcpy(&lengthField, header, sizeof(lengthField));
+    int pduLen = ntohs(lengthField);
+    if (pduLen <= PDU_HEADER_LEN || pduLen - PDU_HEADER_LEN > maxPduLen) {
+        return 0;       // bad length: the normal path deals with it
+    }
+    // reading the front of it would end the fast path for this socket, so
+    // have poll hold off until the rest is here
+    if (pduLen > available) {
+        if (socket < waitingSize && waiting[socket]) {
+            waitForBytes(socket, 1);    // woken without it: EOF or an error
+            return 0;
+        }
+        waitForBytes(socket, pduLen);
+        return RELAY_INCOMPLETE;
+    }
+    waitForBytes(socket, 1);
+
+    int visible = peeked < pduLen ? peeked : pduLen;
+    uint8_t *pdu = header + PDU_HEADER_LEN;
+    if (pduDecodeMessage(pdu, visible - PDU_HEADER_LEN, message) < 0 || message->destinations.count != 1) {
+        return 0;
+    }
+    *headerLen = PDU_HEADER_LEN + (message->text.data - pdu);
+    return pduLen;
+}
+
+int relayForward(int fromSocket, int toSocket, uint8_t *header, int headerLen, int pduLen) {
+    int bodyLen = pduLen - headerLen;
+    if (recv(fromSocket, header, headerLen, 0) != headerLen) {
+        return -1;
+    }
+    if (moveToPipe(fromSocket, bodyLen) < 0) {
+        emptyPipe();
+        return -1;
+    }
+    Connection *from = connGet(fromSocket);
+    if (from != NULL) {
+        from->lastActivity = timerNowMs();
+    }
+    relayed++;
+
+    // the header from our copy, then the body straight out of the pipe
+    int sent = send(toSocket, header, headerLen, MSG_NOSIGNAL | (bodyLen > 0 ? MSG_MORE : 0));
+    if (sent < 0) {
+        sent = 0;
+    }
+    while (sent == headerLen && sent < pduLen) {
+        int moved = splice(relayPipe[0], NULL, toSocket, NULL, pduLen - sent, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved <= 0) {
+            break;
+        }
+        sent += moved;
+    }
+    if (sent == pduLen) {
+        return 0;
+    }
+
+    // the recipient's socket is full: queue the rest like any partial write
+    // (a broken recipient shows up on its own next poll)
+    uint8_t rest[RELAY_MAX_HEADER + UINT16_MAX];
+    int restLen = 0;
+    if (sent < headerLen) {
+        memcpy(rest, header + sent, headerLen - sent);
+        restLen = headerLen - sent;
+    }
+    int bodyLeft = pduLen - (sent > headerLen ? sent : headerLen);
+    if (drainPipe(rest + restLen, bodyLeft) < 0) {
+        emptyPipe();
+        if (sent > 0) {
+            // the front of the PDU is on the recipient's stream and the
+            // rest is lost, so nothing after it would frame: cut it off
+            // (the normal disconnect path runs once poll reports the EOF)
+            Connection *to = connGet(toSocket);
+            if (to != NULL) {
+                to->closing = 1;
+            }
+            shutdown(toSocket, SHUT_RDWR);
+        }
+        return 0;
+    }
+    connQueueStarted(toSocket, rest, restLen + bodyLeft, sent);
+    return 0;
+}
+
+uint64_t relayCount(void) {
+    return relayed;
+}
+
+int relayDiscard(int socket, int pduLen) {
+    uint8_t discard[UINT16_MAX];
+    return recv(socket, discard, pduLen, 0) == pduLen ? 0 : -1;
+}
+
+// The whole PDU had arrived, so this only loops if the pipe takes it in pieces
+static int moveToPipe(int socket, int length) {
+    while (length > 0) {
+        int moved = splice(socket, NULL, relayPipe[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved <= 0) {
+            if (moved < 0) perror("splice");
+            return -1;
+        }
+        length -= moved;
+    }
+    return 0;
+}
+
+static int drainPipe(uint8_t *out, int length) {
+    int got = 0;
+    while (got < length) {
+        int n = read(relayPipe[0], out + got, length - got);
+        if (n <= 0) {
+            perror("relay pipe read");
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+static void waitForBytes(int socket, int bytes) {
+    if (socket >= waitingSize) {
+        int newSize = socket + 64;
+        uint8_t *table = realloc(waiting, newSize);
+        if (table == NULL) return;
+        memset(table + waitingSize, 0, newSize - waitingSize);
+        waiting = table;
+        waitingSize = newSize;
+    }
+    if (bytes == 1 && !waiting[socket]) {
+        return;
+    }
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVLOWAT, &bytes, sizeof(bytes)) == 0) {
+        waiting[socket] = bytes > 1;
+    }
+}
+
+static void emptyPipe(void) {
+    uint8_t discard[4096];
+    while (read(relayPipe[0], discard, sizeof(discard)) > 0) {
+    }
+}
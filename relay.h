@@ -0,0 +1,40 @@
+// relay.h
+// Fast path for %M between two local clients.  Only the header is read into
+// the server; the text goes sender socket -> pipe -> recipient socket with
+// splice() and never passes through user space.  The caller peeks, decides
+// from the header whether the message may take the fast path, and then
+// forwards or discards it.
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stdint.h>
+
+#include "pduSchema.h"
+
+// length, flag, sender, destination count and one destination
+#define RELAY_MAX_HEADER (2 + 1 + 1 + PDU_MAX_HANDLE + 1 + 1 + PDU_MAX_HANDLE)
+#define RELAY_MAX_PER_WAKEUP 64     // then the socket waits its turn like the rest
+#define RELAY_INCOMPLETE -2         // a %M is still arriving, poll waits for all of it
+
+int relayInit(void);
+void relayShutdown(void);
+
+// Look at the next PDU on socket without taking it.  If it is a %M of at
+// most maxPduLen that has fully arrived, its header is copied to header
+// (RELAY_MAX_HEADER bytes) and parsed into message, and the PDU length (with
+// its length field) is returned.  RELAY_INCOMPLETE if it is a %M that hasn't
+// all arrived (SO_RCVLOWAT is raised until it has), 0 otherwise.
+int relayPeekMessage(int socket, int maxPduLen, uint8_t *header, PduMessage *message, int *headerLen);
+
+// Take the peeked PDU off fromSocket and write it to toSocket, which must
+// have nothing queued.  Whatever toSocket won't take is queued on it; if
+// that part can't be read back from the pipe, toSocket is shut down, since
+// it already has the front of the PDU.  Returns 0, or -1 if fromSocket broke.
+int relayForward(int fromSocket, int toSocket, uint8_t *header, int headerLen, int pduLen);
+
+// Take the peeked PDU off socket and drop it
+int relayDiscard(int socket, int pduLen);
+
+uint64_t relayCount(void);      // messages forwarded so far
+
+#endif
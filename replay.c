@@ -0,0 +1,445 @@
+// replay.c
+// Plays a capture taken with server -C back against a server.  Every
+// captured session gets its own connection and sends its PDUs at the
+// recorded times, sped up with -s (-s 0: as fast as the server takes them).
+// Messages that come back out (%M, %C, %B and room messages arrive
+// unchanged at their destinations) are matched to the send for latency.
+// At max speed a session waits for the answer to its INITIAL before it sends
+// more (other sessions would race its registration), and sessions stay
+// open until the end, a recorded hang-up would cut off the replies.
+//
+// Usage: replay [-s speed] [-d drain ms] capture-file host port
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "networks.h"
+#include "pdu.h"
+#include "pollLib.h"
+#include "connection.h"
+#include "timerWheel.h"
+#include "capture.h"
+
+#define REPLAY_USAGE "Usage: %s [-s speed, 0 for max] [-d drain ms] capture-file host port\n"
+#define REPLAY_DEFAULT_DRAIN_MS 1000    // quiet time after the last send before stopping
+#define REPLAY_MAX_QUEUED (1024 * 1024) // at max speed, wait for the server below this
+#define REPLAY_BATCH 256                // records sent between polls at max speed
+#define REPLAY_MAXBUF 1024
+#define SENT_BUCKETS 65536
+
+// Send time of every message PDU, by content hash.  Identical messages
+// share an entry, so a repeat is timed from its latest send.
+typedef struct SentNode {
+    struct SentNode *next;
+    uint64_t hash;
+    uint64_t sentUs;
+} SentNode;
+
+typedef struct ReplayStats {
+    uint64_t sessions;
+    uint64_t pdusSent;
+    uint64_t bytesSent;
+    uint64_t pdusReceived;
+    uint64_t bytesReceived;
+    uint64_t brokenSessions;
+} ReplayStats;
+
+static double speed = 1.0;
+static int drainMs = REPLAY_DEFAULT_DRAIN_MS;
+static int *sessionSockets = NULL;      // socket by captured session number, -1 for none
+static uint32_t sessionTableSize = 0;
+static SentNode *sentTable[SENT_BUCKETS];
+static uint32_t *latencies = NULL;      // us, one per matched delivery
+static uint64_t latencyCount = 0;
+static uint64_t latencyCapacity = 0;
+static ReplayStats stats;
+
+void checkArgs(int argc, char *argv[]);
+void replayCapture(FILE *capture, char *host, char *port);
+void replayRecord(CaptureRecord *record, uint8_t *pdu, char *host, char *port);
+void openSession(uint32_t session, char *host, char *port);
+void closeSession(uint32_t session);
+void awaitRegistration(uint32_t session, int socket);
+int sessionSocket(uint32_t session);
+void serviceSockets(int timeoutMs);
+void receivePDUs(int socket);
+int queuedBytes(void);
+int isTimedFlag(uint8_t flag);
+void recordSend(uint8_t *pdu, int pduLen, uint64_t now);
+void recordDelivery(uint8_t *pdu, int pduLen, uint64_t now);
+uint64_t hashPDU(uint8_t *pdu, int pduLen);
+void printReport(uint64_t elapsedUs);
+int compareLatency(const void *a, const void *b);
+uint64_t nowUs(void);
+
+int main(int argc, char *argv[])
+{
+    checkArgs(argc, argv);
+
+    FILE *capture = captureOpenFile(argv[optind]);
+    if (capture == NULL) {
+        exit(-1);
+    }
+
+    timerWheelInit();
+    connSetLimits(0, 0, SLOW_DISCONNECT);   // the replay's own queues hold everything
+    setupPollSet();
+
+    replayCapture(capture, argv[optind + 1], argv[optind + 2]);
+    fclose(capture);
+    return 0;
+}
+
+void checkArgs(int argc, char *argv[])
+{
+    int option = 0;
+    while ((option = getopt(argc, argv, "s:d:")) != -1) {
+        switch (option) {
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'd':
+                drainMs = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, REPLAY_USAGE, argv[0]);
+                exit(-1);
+        }
+    }
+    if (argc - optind != 3 || speed < 0) {
+        fprintf(stderr, REPLAY_USAGE, argv[0]);
+        exit(-1);
+    }
+}
+
+// ----- Schedule -----
+
+void replayCapture(FILE *capture, char *host, char *port)
+{
+    static uint8_t pdu[UINT16_MAX];
+    CaptureRecord record;
+    int status = captureRead(capture, &record, pdu);
+    uint64_t startUs = nowUs();
+    uint64_t lastSendUs = 0;
+
+    while (status > 0) {
+        uint64_t now = nowUs();
+
+        if (speed == 0) {
+            // as fast as possible, but only as far ahead as the server reads
+            if (queuedBytes() > REPLAY_MAX_QUEUED) {
+                serviceSockets(-1);
+                continue;
+            }
+            for (int i = 0; i < REPLAY_BATCH && status > 0; i++) {
+                replayRecord(&record, pdu, host, port);
+                status = captureRead(capture, &record, pdu);
+            }
+            serviceSockets(0);
+            continue;
+        }
+
+        uint64_t dueUs = startUs + (uint64_t)(record.timeUs / speed);
+        if (dueUs > now) {
+            serviceSockets((int)((dueUs - now + 999) / 1000));
+            continue;
+        }
+        replayRecord(&record, pdu, host, port);
+        status = captureRead(capture, &record, pdu);
+    }
+    if (status < 0) {
+        fprintf(stderr, "Capture file is truncated, replayed what was readable\n");
+    }
+    lastSendUs = nowUs();
+
+    // wait for the queues to empty and the deliveries to stop
+    uint64_t quietSince = nowUs();
+    uint64_t received = stats.pdusReceived;
+    while (queuedBytes() > 0 || nowUs() - quietSince < (uint64_t)drainMs * 1000) {
+        serviceSockets(drainMs);
+        if (stats.pdusReceived != received) {
+            received = stats.pdusReceived;
+            quietSince = nowUs();
+        }
+    }
+
+    for (uint32_t session = 0; session < sessionTableSize; session++) {
+        closeSession(session);
+    }
+    printReport(lastSendUs - startUs);
+}
+
+void replayRecord(CaptureRecord *record, uint8_t *pdu, char *host, char *port)
+{
+    switch (record->event) {
+        case CAPTURE_OPEN:
+            openSession(record->session, host, port);
+            break;
+        case CAPTURE_CLOSE:
+            if (speed != 0) {
+                closeSession(record->session);
+            }
+            break;
+        case CAPTURE_PDU: {
+            int socket = sessionSocket(record->session);
+            if (socket < 0 || record->length == 0) {
+                break;
+            }
+            uint64_t now = nowUs();
+            if (isTimedFlag(pdu[0])) {
+                recordSend(pdu, record->length, now);
+            }
+            if (connSendPDU(socket, pdu, record->length) < 0) {
+                stats.brokenSessions++;
+                closeSession(record->session);
+                break;
+            }
+            stats.pdusSent++;
+            stats.bytesSent += record->length + PDU_HEADER_LEN;
+            if (speed == 0 && pdu[0] == FLAG_CLIENT_TO_SEVER_INITIAL) {
+                awaitRegistration(record->session, socket);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// ----- Sessions -----
+
+void openSession(uint32_t session, char *host, char *port)
+{
+    if (session >= sessionTableSize) {
+        uint32_t newSize = session + 64;
+        int *table = realloc(sessionSockets, newSize * sizeof(int));
+        if (table == NULL) {
+            perror("realloc");
+            exit(-1);
+        }
+        for (uint32_t i = sessionTableSize; i < newSize; i++) {
+            table[i] = -1;
+        }
+        sessionSockets = table;
+        sessionTableSize = newSize;
+    }
+
+    // each PDU leaves when its record is due, not when Nagle lets it
+    int socket = tcpClientSetup(host, port, 0);
+    int noDelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+    connOpen(socket);
+    addToPollSet(socket);
+    sessionSockets[session] = socket;
+    stats.sessions++;
+}
+
+void closeSession(uint32_t session)
+{
+    int socket = sessionSocket(session);
+    if (socket < 0) {
+        return;
+    }
+    // what the session sent before hanging up still goes out
+    while (connGet(socket)->outBytes > 0 && connFlush(socket) >= 0) {
+        serviceSockets(1);
+        if (sessionSockets[session] != socket) {
+            return;     // the server cut it off meanwhile
+        }
+    }
+    connClose(socket);
+    removeFromPollSet(socket);
+    close(socket);
+    sessionSockets[session] = -1;
+}
+
+// Registered here means the server answered the INITIAL at all
+void awaitRegistration(uint32_t session, int socket)
+{
+    while (sessionSockets[session] == socket && !connGet(socket)->registered) {
+        serviceSockets(POLL_WAIT_FOREVER);
+    }
+}
+
+int sessionSocket(uint32_t session)
+{
+    return session < sessionTableSize ? sessionSockets[session] : -1;
+}
+
+// ----- I/O -----
+
+void serviceSockets(int timeoutMs)
+{
+    if (pollCallAll(timeoutMs) == 0) {
+        return;
+    }
+    int socket = 0;
+    int revents = 0;
+    while ((socket = pollNextReady(&revents)) >= 0) {
+        if ((revents & POLLOUT) && connFlush(socket) < 0) {
+            revents |= POLLHUP;
+        }
+        if (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            receivePDUs(socket);
+        }
+    }
+}
+
+void receivePDUs(int socket)
+{
+    int bytesRead = connRead(socket);
+    if (bytesRead == CONN_AGAIN) {
+        return;
+    }
+    if (bytesRead > 0) {
+        uint64_t now = nowUs();
+        Connection *conn = connGet(socket);
+        uint8_t *pdu = NULL;
+        int pduLen = 0;
+        while ((pduLen = connNextPDU(socket, &pdu, REPLAY_MAXBUF)) > 0) {
+            conn->registered = 1;
+            stats.pdusReceived++;
+            stats.bytesReceived += pduLen + PDU_HEADER_LEN;
+            if (isTimedFlag(pdu[0])) {
+                recordDelivery(pdu, pduLen, now);
+            }
+        }
+        if (pduLen == 0) {
+            return;
+        }
+    }
+
+    // the server hung up on this session
+    for (uint32_t session = 0; session < sessionTableSize; session++) {
+        if (sessionSockets[session] == socket) {
+            stats.brokenSessions++;
+            connClose(socket);
+            removeFromPollSet(socket);
+            close(socket);
+            sessionSockets[session] = -1;
+            break;
+        }
+    }
+}
+
+int queuedBytes(void)
+{
+    int total = 0;
+    for (uint32_t session = 0; session < sessionTableSize; session++) {
+        if (sessionSockets[session] >= 0) {
+            total += connGet(sessionSockets[session])->outBytes;
+        }
+    }
+    return total;
+}
+
+// ----- Latency -----
+
+int isTimedFlag(uint8_t flag)
+{
+    return flag == FLAG_MESSAGE || flag == FLAG_MULTICAST || flag == FLAG_BROADCAST
+        || flag == FLAG_ROOM_MESSAGE;
+}
+
+void recordSend(uint8_t *pdu, int pduLen, uint64_t now)
+{
+    uint64_t hash = hashPDU(pdu, pduLen);
+    SentNode **bucket = &sentTable[hash % SENT_BUCKETS];
+    for (SentNode *node = *bucket; node != NULL; node = node->next) {
+        if (node->hash == hash) {
+            node->sentUs = now;
+            return;
+        }
+    }
+
+    SentNode *node = malloc(sizeof(SentNode));
+    if (node == NULL) {
+        return;
+    }
+    node->hash = hash;
+    node->sentUs = now;
+    node->next = *bucket;
+    *bucket = node;
+}
+
+void recordDelivery(uint8_t *pdu, int pduLen, uint64_t now)
+{
+    uint64_t hash = hashPDU(pdu, pduLen);
+    SentNode *node = sentTable[hash % SENT_BUCKETS];
+    while (node != NULL && node->hash != hash) {
+        node = node->next;
+    }
+    if (node == NULL) {
+        return;
+    }
+
+    if (latencyCount == latencyCapacity) {
+        uint64_t capacity = latencyCapacity ? latencyCapacity * 2 : 4096;
+        uint32_t *grown = realloc(latencies, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            return;
+        }
+        latencies = grown;
+        latencyCapacity = capacity;
+    }
+    uint64_t latency = now - node->sentUs;
+    latencies[latencyCount++] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+}
+
+// FNV-1a, 64 bit
+uint64_t hashPDU(uint8_t *pdu, int pduLen)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < pduLen; i++) {
+        hash = (hash ^ pdu[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// ----- Report -----
+
+void printReport(uint64_t elapsedUs)
+{
+    double seconds = elapsedUs > 0 ? elapsedUs / 1e6 : 1e-6;
+
+    printf("Sessions: %llu (%llu cut off by the server)\n",
+        (unsigned long long)stats.sessions, (unsigned long long)stats.brokenSessions);
+    printf("Sent: %llu PDUs, %llu bytes in %.3f s (%.0f PDUs/s, %.2f MB/s)\n",
+        (unsigned long long)stats.pdusSent, (unsigned long long)stats.bytesSent, seconds,
+        stats.pdusSent / seconds, stats.bytesSent / seconds / 1e6);
+    printf("Received: %llu PDUs, %llu bytes\n",
+        (unsigned long long)stats.pdusReceived, (unsigned long long)stats.bytesReceived);
+
+    if (latencyCount == 0) {
+        printf("Latency: no deliveries matched\n");
+        return;
+    }
+    qsort(latencies, latencyCount, sizeof(uint32_t), compareLatency);
+    printf("Latency over %llu deliveries (us): p50 %u  p90 %u  p99 %u  max %u\n",
+        (unsigned long long)latencyCount,
+        latencies[latencyCount / 2], latencies[latencyCount * 90 / 100],
+        latencies[latencyCount * 99 / 100], latencies[latencyCount - 1]);
+}
+
+int compareLatency(const void *a, const void *b)
+{
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return (left > right) - (left < right);
+}
+
+uint64_t nowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
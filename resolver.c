@@ -0,0 +1,407 @@
+// resolver.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "timerWheel.h"
+
+#define CACHE_BUCKETS 64
+
+typedef struct CacheEntry {
+    struct CacheEntry *next;
+    char *host;
+    char *port;
+    uint64_t expiresMs;
+    Resolved resolved;
+} CacheEntry;
+
+// A lookup handed to the workers, then back to the loop with its answer
+typedef struct Request {
+    struct Request *next;
+    char *host;
+    char *port;
+    ResolverCallback callback;
+    void *arg;
+    Resolved resolved;
+} Request;
+
+// Everything below is shared with the workers and guarded by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static CacheEntry *cache[CACHE_BUCKETS];
+static Request *queueHead = NULL;
+static Request *queueTail = NULL;
+static Request *doneHead = NULL;
+static Request *doneTail = NULL;
+static int workers = 0;
+static int notifyPipe[2] = { -1, -1 };
+static cpu_set_t workerCpus;
+static int workerCpusSet = 0;
+
+static int cacheGet(const char *host, const char *port, Resolved *resolved);
+static void cachePut(const char *host, const char *port, const Resolved *resolved);
+static uint32_t hashKey(const char *host, const char *port);
+static void resolve(const char *host, const char *port, Resolved *resolved);
+static int startWorkers(void);
+static void *worker(void *unused);
+static int startAttempt(const struct sockaddr_in6 *address, int *error);
+
+int resolverLookup(const char *host, const char *port, Resolved *resolved) {
+    if (!cacheGet(host, port, resolved)) {
+        resolve(host, port, resolved);
+        cachePut(host, port, resolved);
+    }
+    return resolved->count > 0 ? 0 : -1;
+}
+
+int resolverStart(const char *host, const char *port, ResolverCallback callback, void *arg) {
+    Resolved resolved;
+    if (cacheGet(host, port, &resolved)) {
+        callback(&resolved, arg);
+        return 0;
+    }
+    if (startWorkers() < 0) {
+        return -1;
+    }
+
+    Request *request = calloc(1, sizeof(Request));
+    if (request == NULL || (request->host = strdup(host)) == NULL || (request->port = strdup(port)) == NULL) {
+        if (request != NULL) free(request->host);
+        free(request);
+        return -1;
+    }
+    request->callback = callback;
+    request->arg = arg;
+
+    pthread_mutex_lock(&lock);
+    if (queueTail != NULL) {
+        queueTail->next = request;
+    } else {
+        queueHead = request;
+    }
+    queueTail = request;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void resolverAvoidCpu(int cpu) {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+        perror("sched_getaffinity");
+        return;
+    }
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_CLR(cpu, &cpus);
+    }
+    // a single core leaves them nowhere else to go
+    if (CPU_COUNT(&cpus) > 0) {
+        workerCpus = cpus;
+        workerCpusSet = 1;
+    }
+}
+
+int resolverFd(void) {
+    return startWorkers() < 0 ? -1 : notifyPipe[0];
+}
+
+void resolverDispatch(void) {
+    char drain[64];
+    while (read(notifyPipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    pthread_mutex_lock(&lock);
+    Request *request = doneHead;
+    doneHead = doneTail = NULL;
+    pthread_mutex_unlock(&lock);
+
+    // in the order they finished, on the loop's thread
+    while (request != NULL) {
+        Request *next = request->next;
+        request->callback(&request->resolved, request->arg);
+        free(request->host);
+        free(request->port);
+        free(request);
+        request = next;
+    }
+}
+
+int resolverConnect(const Resolved *resolved) {
+    struct pollfd attempts[RESOLVER_MAX_ADDRESSES];
+    int started = 0;
+    int inFlight = 0;
+    int winner = -1;
+    int error = EHOSTUNREACH;
+    uint64_t nextStart = 0;
+
+    while (winner < 0) {
+        uint64_t now = timerNowMs();
+        // a new attempt when nothing is pending or the last is taking too long
+        if (started < resolved->count && (inFlight == 0 || now >= nextStart)) {
+            int socket = startAttempt(&resolved->addresses[started], &error);
+            attempts[started].fd = socket;
+            attempts[started].events = POLLOUT;
+            attempts[started].revents = 0;
+            started++;
+            nextStart = now + RESOLVER_RACE_DELAY_MS;
+            if (socket >= 0 && error == 0) {
+                winner = socket;        // connected right away
+            } else if (socket >= 0) {
+                inFlight++;
+            }
+            continue;
+        }
+        if (inFlight == 0) {
+            break;                      // every address failed
+        }
+
+        int waitMs = started < resolved->count ? (int)(nextStart - now) : -1;
+        if (poll(attempts, started, waitMs) < 0 && errno != EINTR) {
+            error = errno;
+            break;
+        }
+        for (int i = 0; i < started && winner < 0; i++) {
+            if (attempts[i].fd < 0 || attempts[i].revents == 0) {
+                continue;
+            }
+            int result = 0;
+            socklen_t resultLen = sizeof(result);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &result, &resultLen);
+            if (result == 0) {
+                winner = attempts[i].fd;
+                attempts[i].fd = -1;
+            } else {
+                // that one is out: start the next now instead of waiting
+                close(attempts[i].fd);
+                attempts[i].fd = -1;
+                inFlight--;
+                error = result;
+                nextStart = now;
+            }
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        if (attempts[i].fd >= 0 && attempts[i].fd != winner) {
+            close(attempts[i].fd);
+        }
+    }
+    if (winner < 0) {
+        errno = error;
+        return -1;
+    }
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+    return winner;
+}
+
+// 1 and a copy of the answer if the cache has one that hasn't expired
+static int cacheGet(const char *host, const char *port, Resolved *resolved) {
+    int found = 0;
+    uint64_t now = timerNowMs();
+    pthread_mutex_lock(&lock);
+    for (CacheEntry *entry = cache[hashKey(host, port)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) {
+            if (entry->expiresMs > now) {
+                *resolved = entry->resolved;
+                found = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+static void cachePut(const char *host, const char *port, const Resolved *resolved) {
+    uint32_t bucket = hashKey(host, port);
+    uint64_t ttl = resolved->count > 0 ? RESOLVER_TTL_MS : RESOLVER_NEGATIVE_TTL_MS;
+    pthread_mutex_lock(&lock);
+    CacheEntry *entry = cache[bucket];
+    while (entry != NULL && (strcmp(entry->host, host) != 0 || strcmp(entry->port, port) != 0)) {
+        entry = entry->next;
+    }
+    if (entry == NULL && (entry = calloc(1, sizeof(CacheEntry))) != NULL) {
+        entry->host = strdup(host);
+        entry->port = strdup(port);
+        if (entry->host == NULL || entry->port == NULL) {
+            free(entry->host);
+            free(entry->port);
+            free(entry);
+            entry = NULL;
+        } else {
+            entry->next = cache[bucket];
+            cache[bucket] = entry;
+        }
+    }
+    if (entry != NULL) {
+        entry->resolved = *resolved;
+        entry->expiresMs = timerNowMs() + ttl;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static uint32_t hashKey(const char *host, const char *port) {
+    uint32_t hash = 2166136261u;        // FNV-1a
+    for (const char *c = host; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    for (const char *c = port; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash % CACHE_BUCKETS;
+}
+
+// getaddrinfo() is re-entrant.  The answers are interleaved IPv6 first, so
+// a broken path in one family costs a race delay, not a full timeout.
+static void resolve(const char *host, const char *port, Resolved *resolved) {
+    struct addrinfo hints;
+    struct addrinfo *answers = NULL;
+    struct sockaddr_in6 families[2][RESOLVER_MAX_ADDRESSES];
+    int familyCount[2] = { 0, 0 };
+
+    memset(resolved, 0, sizeof(Resolved));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((resolved->error = getaddrinfo(host, port, &hints, &answers)) != 0) {
+        return;
+    }
+
+    for (struct addrinfo *answer = answers; answer != NULL; answer = answer->ai_next) {
+        int v4 = answer->ai_family == AF_INET;
+        if ((!v4 && answer->ai_family != AF_INET6) || familyCount[v4] == RESOLVER_MAX_ADDRESSES) {
+            continue;
+        }
+        struct sockaddr_in6 *address = &families[v4][familyCount[v4]++];
+        if (v4) {
+            struct sockaddr_in *in = (struct sockaddr_in *)answer->ai_addr;
+            memset(address, 0, sizeof(*address));
+            address->sin6_family = AF_INET6;
+            address->sin6_port = in->sin_port;
+            address->sin6_addr.s6_addr[10] = 0xff;
+            address->sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&address->sin6_addr.s6_addr[12], &in->sin_addr, 4);
+        } else {
+            memcpy(address, answer->ai_addr, sizeof(*address));
+        }
+    }
+    freeaddrinfo(answers);
+
+    for (int i = 0; resolved->count < RESOLVER_MAX_ADDRESSES && i < RESOLVER_MAX_ADDRESSES; i++) {
+        for (int v4 = 0; v4 < 2 && resolved->count < RESOLVER_MAX_ADDRESSES; v4++) {
+            if (i < familyCount[v4]) {
+                resolved->addresses[resolved->count++] = families[v4][i];
+            }
+        }
+    }
+    if (resolved->count == 0) {
+        resolved->error = EAI_NONAME;
+    }
+}
+
+// The pool and its pipe, on first use.  Workers never take signals, so
+// the loop's poll() still wakes for them.
+static int startWorkers(void) {
+    if (workers > 0) {
+        return 0;
+    }
+    if (pipe2(notifyPipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    // without their own cores they would inherit the loop's
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    if (workerCpusSet) {
+        pthread_attr_setaffinity_np(&attributes, sizeof(workerCpus), &workerCpus);
+    }
+
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attributes, worker, NULL) == 0) {
+            pthread_detach(thread);
+            workers++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    pthread_attr_destroy(&attributes);
+
+    if (workers == 0) {
+        fprintf(stderr, "Failed to start resolver threads\n");
+        close(notifyPipe[0]);
+        close(notifyPipe[1]);
+        notifyPipe[0] = notifyPipe[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void *worker(void *unused) {
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (queueHead == NULL) {
+            pthread_cond_wait(&work, &lock);
+        }
+        Request *request = queueHead;
+        queueHead = request->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        resolverLookup(request->host, request->port, &request->resolved);
+
+        request->next = NULL;
+        pthread_mutex_lock(&lock);
+        if (doneTail != NULL) {
+            doneTail->next = request;
+        } else {
+            doneHead = request;
+        }
+        doneTail = request;
+        pthread_mutex_unlock(&lock);
+        // a full pipe already means a wakeup is pending
+        if (write(notifyPipe[1], "", 1) < 0 && errno != EAGAIN) {
+            perror("resolver notify");
+        }
+    }
+    return NULL;
+}
+
+// A non-blocking connect to address.  The socket, with *error 0 if it
+// connected already, or -1 with *error set.
+static int startAttempt(const struct sockaddr_in6 *address, int *error) {
+    int attempt = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (attempt < 0) {
+        *error = errno;
+        return -1;
+    }
+    if (connect(attempt, (const struct sockaddr *)address, sizeof(*address)) == 0) {
+        *error = 0;
+        return attempt;
+    }
+    if (errno == EINPROGRESS) {
+        *error = EINPROGRESS;
+        return attempt;
+    }
+    *error = errno;
+    close(attempt);
+    return -1;
+}
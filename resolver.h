@@ -0,0 +1,49 @@
+// resolver.h
+// Name resolution that can be shared between threads and doesn't have to
+// block.  Answers are cached for RESOLVER_TTL_MS (failures for
+// RESOLVER_NEGATIVE_TTL_MS), so a load generator opening thousands of
+// sessions to one host resolves it once.  Lookups can run on a small pool of
+// threads, with the callbacks run later by the event loop that polls
+// resolverFd().  Connects race the answers: IPv6 and IPv4 addresses take
+// turns, and the next one starts if the last hasn't connected within
+// RESOLVER_RACE_DELAY_MS (RFC 8305).
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <netinet/in.h>
+
+#define RESOLVER_MAX_ADDRESSES 8
+#define RESOLVER_TTL_MS 60000
+#define RESOLVER_NEGATIVE_TTL_MS 5000
+#define RESOLVER_THREADS 4
+#define RESOLVER_RACE_DELAY_MS 250
+
+// IPv4 addresses are mapped, so every one fits an AF_INET6 socket
+typedef struct Resolved {
+    int count;
+    int error;                      // getaddrinfo() error when count is 0
+    struct sockaddr_in6 addresses[RESOLVER_MAX_ADDRESSES];
+} Resolved;
+
+typedef void (*ResolverCallback)(const Resolved *resolved, void *arg);
+
+// Blocking, from any thread.  0, or -1 with resolved->error set.
+int resolverLookup(const char *host, const char *port, Resolved *resolved);
+
+// Non-blocking.  A cached answer runs callback right away, otherwise a
+// worker resolves it and the callback runs from resolverDispatch().
+int resolverStart(const char *host, const char *port, ResolverCallback callback, void *arg);
+
+// Keep the workers off cpu (the event loop's, before it is pinned there):
+// they get every other core the process may use
+void resolverAvoidCpu(int cpu);
+
+// Readable when answers are waiting for resolverDispatch()
+int resolverFd(void);
+void resolverDispatch(void);
+
+// Race connects to the addresses, returns the first socket to connect (in
+// blocking mode), or -1 with errno from the last failure
+int resolverConnect(const Resolved *resolved);
+
+#endif
@@ -0,0 +1,484 @@
+// resume.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "resume.h"
+#include "connection.h"
+#include "rooms.h"
+#include "timerWheel.h"
+
+#define HELD_BUCKETS 256
+#define SOCKET_TABLE_GROW 64
+
+typedef struct IssuedToken {
+    int issued;
+    uint8_t token[RESUME_TOKEN_LEN];
+} IssuedToken;
+
+// A dropped session waiting for its client
+typedef struct HeldSession {
+    struct HeldSession *next;
+    char handle[PDU_MAX_HANDLE + 1];
+    uint8_t token[RESUME_TOKEN_LEN];
+    Timer graceTimer;
+    uint64_t expiresAt;             // ms
+    uint8_t *buffer;                // framed PDUs, oldest first
+    int bufferLen;
+    int bufferSize;
+    uint64_t dropped;
+    char *rooms;                    // names, each NUL terminated
+    int roomsLen;
+} HeldSession;
+
+// A claimed buffer being fed to the resumed connection as its queue drains
+typedef struct HeldReplay {
+    struct HeldReplay *next;
+    int socket;
+    uint8_t *buffer;
+    int len;
+    int queued;
+} HeldReplay;
+
+static int graceMs = 0;
+static ResumeExpired onExpired = NULL;
+static ResumeUnclaimed onUnclaimed = NULL;
+static IssuedToken *issued = NULL;     // by socket
+static int issuedSize = 0;
+static HeldSession *held[HELD_BUCKETS];
+static HeldReplay *replaying = NULL;
+
+static HeldSession **findHeld(PduView handle);
+static void graceOver(Timer *timer, void *arg);
+static void freeHeld(HeldSession **link);
+static int holdIn(HeldSession *session, uint8_t *pdu, int pduLen);
+static int tokenEquals(const uint8_t *token, PduView candidate);
+static HeldSession *holdSession(PduView name, const uint8_t *token, uint64_t expiresAt);
+static void startReplay(int socket, uint8_t *buffer, int len);
+static int refillHeld(int socket, void *arg);
+static void stopHeld(void *arg, int written);
+static void endReplay(HeldReplay *replay);
+static void keepRoom(const char *name, void *arg);
+static int inRoom(HeldSession *session, const char *room);
+static void releaseHeld(const char *handle, uint8_t *buffer, int len);
+
+void resumeInit(int grace, ResumeExpired expired, ResumeUnclaimed unclaimed) {
+    graceMs = grace > 0 ? grace : 0;
+    onExpired = expired;
+    onUnclaimed = unclaimed;
+}
+
+int resumeEnabled(void) {
+    return graceMs > 0;
+}
+
+int resumeGraceMs(void) {
+    return graceMs;
+}
+
+int resumeIssue(int socket, uint8_t *token) {
+    if (!resumeEnabled()) return -1;
+    if (socket >= issuedSize) {
+        int newSize = socket + SOCKET_TABLE_GROW;
+        IssuedToken *table = realloc(issued, newSize * sizeof(IssuedToken));
+        if (table == NULL) return -1;
+        memset(table + issuedSize, 0, (newSize - issuedSize) * sizeof(IssuedToken));
+        issued = table;
+        issuedSize = newSize;
+    }
+    if (getrandom(issued[socket].token, RESUME_TOKEN_LEN, 0) != RESUME_TOKEN_LEN) {
+        perror("getrandom");
+        issued[socket].issued = 0;
+        return -1;
+    }
+    issued[socket].issued = 1;
+    memcpy(token, issued[socket].token, RESUME_TOKEN_LEN);
+    return 0;
+}
+
+int resumeIsTokenOf(int socket, PduView token) {
+    return socket >= 0 && socket < issuedSize && issued[socket].issued
+        && tokenEquals(issued[socket].token, token);
+}
+
+void resumeForget(int socket) {
+    if (socket < issuedSize) {
+        issued[socket].issued = 0;
+    }
+}
+
+int resumeSuspend(int socket, const char *handle) {
+    if (socket >= issuedSize || !issued[socket].issued) {
+        return 0;
+    }
+    issued[socket].issued = 0;
+
+    HeldSession *session = holdSession(pduViewOf(handle), issued[socket].token, timerNowMs() + graceMs);
+    if (session == NULL) {
+        return 0;
+    }
+    roomForEachOf(socket, keepRoom, session);
+    return 1;
+}
+
+int resumeIsSuspended(PduView handle) {
+    return *findHeld(handle) != NULL;
+}
+
+int resumeHold(PduView handle, uint8_t *pdu, int pduLen) {
+    HeldSession *session = *findHeld(handle);
+    if (session == NULL) {
+        return -1;
+    }
+    return holdIn(session, pdu, pduLen);
+}
+
+void resumeHoldAll(uint8_t *pdu, int pduLen) {
+    for (int i = 0; i < HELD_BUCKETS; i++) {
+        for (HeldSession *session = held[i]; session != NULL; session = session->next) {
+            holdIn(session, pdu, pduLen);
+        }
+    }
+}
+
+void resumeHoldRoom(const char *room, uint8_t *pdu, int pduLen) {
+    for (int i = 0; i < HELD_BUCKETS; i++) {
+        for (HeldSession *session = held[i]; session != NULL; session = session->next) {
+            if (inRoom(session, room)) {
+                holdIn(session, pdu, pduLen);
+            }
+        }
+    }
+}
+
+int resumeCheck(PduView handle, PduView token) {
+    HeldSession *session = *findHeld(handle);
+    return session != NULL && tokenEquals(session->token, token);
+}
+
+int resumeClaim(PduView handle, int socket) {
+    HeldSession **link = findHeld(handle);
+    HeldSession *session = *link;
+    if (session == NULL) {
+        return 0;
+    }
+    for (int at = 0; at < session->roomsLen; at += strlen(session->rooms + at) + 1) {
+        if (roomJoin(session->rooms + at, socket) == NULL) {
+            printf("%s could not rejoin room %s\n", session->handle, session->rooms + at);
+        }
+    }
+    // a full buffer at once would push live traffic past the slow consumer
+    // limit, so it goes in as the queue drains
+    int heldBytes = session->bufferLen;
+    if (heldBytes > 0) {
+        startReplay(socket, session->buffer, heldBytes);
+        session->buffer = NULL;
+    }
+    if (session->dropped > 0) {
+        printf("%s missed %llu PDUs while away\n", session->handle, (unsigned long long)session->dropped);
+    }
+    freeHeld(link);
+    return heldBytes;
+}
+
+void resumeSave(Snapshot *snapshot) {
+    int count = 0;
+    for (int i = 0; i < issuedSize; i++) {
+        count += issued[i].issued;
+    }
+    snapshotPutU32(snapshot, count);
+    for (int i = 0; i < issuedSize; i++) {
+        if (issued[i].issued) {
+            snapshotPutSocket(snapshot, i);
+            snapshotPutBytes(snapshot, issued[i].token, RESUME_TOKEN_LEN);
+        }
+    }
+
+    count = 0;
+    for (int i = 0; i < HELD_BUCKETS; i++) {
+        for (HeldSession *session = held[i]; session != NULL; session = session->next) {
+            count++;
+        }
+    }
+    // the monotonic clock is the same in the next process
+    snapshotPutU32(snapshot, count);
+    for (int i = 0; i < HELD_BUCKETS; i++) {
+        for (HeldSession *session = held[i]; session != NULL; session = session->next) {
+            snapshotPutString(snapshot, session->handle);
+            snapshotPutBytes(snapshot, session->token, RESUME_TOKEN_LEN);
+            snapshotPutU64(snapshot, session->expiresAt);
+            snapshotPutU64(snapshot, session->dropped);
+            snapshotPutBytes(snapshot, session->buffer, session->bufferLen);
+            snapshotPutBytes(snapshot, session->rooms, session->roomsLen);
+        }
+    }
+
+    // what the connection queued already goes with it (connSave())
+    count = 0;
+    for (HeldReplay *replay = replaying; replay != NULL; replay = replay->next) {
+        count++;
+    }
+    snapshotPutU32(snapshot, count);
+    for (HeldReplay *replay = replaying; replay != NULL; replay = replay->next) {
+        snapshotPutSocket(snapshot, replay->socket);
+        snapshotPutBytes(snapshot, replay->buffer + replay->queued, replay->len - replay->queued);
+    }
+}
+
+int resumeLoad(Snapshot *snapshot) {
+    uint32_t count = snapshotGetU32(snapshot);
+    for (uint32_t i = 0; i < count && !snapshot->failed; i++) {
+        int socket = snapshotGetSocket(snapshot);
+        const uint8_t *token = NULL;
+        uint8_t unused[RESUME_TOKEN_LEN];
+        if (snapshotGetBytes(snapshot, &token) == RESUME_TOKEN_LEN && socket >= 0
+                && resumeIssue(socket, unused) == 0) {
+            memcpy(issued[socket].token, token, RESUME_TOKEN_LEN);
+        }
+    }
+
+    count = snapshotGetU32(snapshot);
+    for (uint32_t i = 0; i < count && !snapshot->failed; i++) {
+        char handle[PDU_MAX_HANDLE + 1];
+        const uint8_t *token = NULL;
+        const uint8_t *buffer = NULL;
+        const uint8_t *rooms = NULL;
+        snapshotGetString(snapshot, handle, sizeof(handle));
+        int tokenLen = snapshotGetBytes(snapshot, &token);
+        uint64_t expiresAt = snapshotGetU64(snapshot);
+        uint64_t dropped = snapshotGetU64(snapshot);
+        int bufferLen = snapshotGetBytes(snapshot, &buffer);
+        int roomsLen = snapshotGetBytes(snapshot, &rooms);
+        if (snapshot->failed || tokenLen != RESUME_TOKEN_LEN) {
+            continue;
+        }
+        if (!resumeEnabled()) {
+            // this server doesn't hold sessions: they expire here and now
+            releaseHeld(handle, (uint8_t *)buffer, bufferLen);
+            continue;
+        }
+        HeldSession *session = holdSession(pduViewOf(handle), token, expiresAt);
+        if (session != NULL && bufferLen > 0 && (session->buffer = malloc(bufferLen)) != NULL) {
+            memcpy(session->buffer, buffer, bufferLen);
+            session->bufferLen = session->bufferSize = bufferLen;
+        }
+        // the names were NUL terminated when they were written
+        if (session != NULL && roomsLen > 0 && rooms[roomsLen - 1] == '\0'
+                && (session->rooms = malloc(roomsLen)) != NULL) {
+            memcpy(session->rooms, rooms, roomsLen);
+            session->roomsLen = roomsLen;
+        }
+        if (session != NULL) {
+            session->dropped = dropped;
+        }
+    }
+
+    count = snapshotGetU32(snapshot);
+    for (uint32_t i = 0; i < count && !snapshot->failed; i++) {
+        int socket = snapshotGetSocket(snapshot);
+        const uint8_t *rest = NULL;
+        int restLen = snapshotGetBytes(snapshot, &rest);
+        uint8_t *buffer;
+        if (socket >= 0 && restLen > 0 && (buffer = malloc(restLen)) != NULL) {
+            memcpy(buffer, rest, restLen);
+            startReplay(socket, buffer, restLen);
+        }
+    }
+    return snapshot->failed ? -1 : 0;
+}
+
+// Every byte is compared, so the time taken doesn't give away a prefix
+static int tokenEquals(const uint8_t *token, PduView candidate) {
+    if (candidate.length != RESUME_TOKEN_LEN) {
+        return 0;
+    }
+    uint8_t difference = 0;
+    for (int i = 0; i < RESUME_TOKEN_LEN; i++) {
+        difference |= token[i] ^ candidate.data[i];
+    }
+    return difference == 0;
+}
+
+static HeldSession **findHeld(PduView handle) {
+    uint32_t hash = 2166136261u;        // FNV-1a
+    for (int i = 0; i < handle.length; i++) {
+        hash = (hash ^ handle.data[i]) * 16777619u;
+    }
+    HeldSession **link = &held[hash % HELD_BUCKETS];
+    while (*link != NULL && !pduViewEquals(handle, (*link)->handle)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static HeldSession *holdSession(PduView name, const uint8_t *token, uint64_t expiresAt) {
+    HeldSession **link = findHeld(name);
+    if (*link != NULL) {
+        freeHeld(link);
+    }
+    HeldSession *session = calloc(1, sizeof(HeldSession));
+    if (session == NULL || pduViewString(name, session->handle, sizeof(session->handle)) < 0) {
+        free(session);
+        return NULL;
+    }
+    memcpy(session->token, token, RESUME_TOKEN_LEN);
+    session->expiresAt = expiresAt;
+    timerInit(&session->graceTimer, graceOver, session);
+    timerSchedule(&session->graceTimer, expiresAt);
+    session->next = *link;
+    *link = session;
+    return session;
+}
+
+// Takes buffer over and frees it once it is all queued or the connection goes
+static void startReplay(int socket, uint8_t *buffer, int len) {
+    HeldReplay *replay = malloc(sizeof(HeldReplay));
+    if (replay == NULL) {
+        free(buffer);
+        return;
+    }
+    replay->socket = socket;
+    replay->buffer = buffer;
+    replay->len = len;
+    replay->queued = 0;
+    replay->next = replaying;
+    replaying = replay;
+    connSetRefill(socket, refillHeld, stopHeld, replay);
+}
+
+// As many whole PDUs as fit in the catch-up allowance (at least one if
+// nothing else is queued).  What the socket takes straight away leaves
+// nothing queued to bring connFlush() back, so that goes on to the next part.
+static int refillHeld(int socket, void *arg) {
+    HeldReplay *replay = arg;
+    Connection *conn = connGet(socket);
+    while (replay->queued < replay->len && !conn->closing) {
+        int room = connCatchUpRoom(socket);
+        int empty = conn->outHead == NULL;
+        int len = 0;
+        while (replay->queued + len < replay->len) {
+            uint16_t lengthField;
+            memcpy(&lengthField, replay->buffer + replay->queued + len, sizeof(lengthField));
+            int framedLen = ntohs(lengthField);
+            if (framedLen < PDU_HEADER_LEN || replay->queued + len + framedLen > replay->len) {
+                len = replay->len - replay->queued;     // damaged: the rest goes as it is
+                break;
+            }
+            if (len + framedLen > room && !(empty && len == 0)) {
+                break;
+            }
+            len += framedLen;
+        }
+        if (len == 0) {
+            return 1;
+        }
+        struct iovec iov = { replay->buffer + replay->queued, len };
+        if (connSendFramed(socket, &iov, 1) < 0) {
+            return 1;       // the connection is going, stopHeld() follows
+        }
+        replay->queued += len;
+    }
+    if (replay->queued < replay->len) {
+        return 1;
+    }
+    endReplay(replay);
+    return 0;
+}
+
+static void stopHeld(void *arg, int written) {
+    endReplay(arg);
+}
+
+static void endReplay(HeldReplay *replay) {
+    HeldReplay **link = &replaying;
+    while (*link != replay) link = &(*link)->next;
+    *link = replay->next;
+    free(replay->buffer);
+    free(replay);
+}
+
+static void keepRoom(const char *name, void *arg) {
+    HeldSession *session = arg;
+    int len = strlen(name) + 1;
+    char *rooms = realloc(session->rooms, session->roomsLen + len);
+    if (rooms == NULL) {
+        printf("%s loses room %s while away\n", session->handle, name);
+        return;
+    }
+    memcpy(rooms + session->roomsLen, name, len);
+    session->rooms = rooms;
+    session->roomsLen += len;
+}
+
+static int inRoom(HeldSession *session, const char *room) {
+    for (int at = 0; at < session->roomsLen; at += strlen(session->rooms + at) + 1) {
+        if (strcmp(session->rooms + at, room) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Hand each framed PDU in buffer to onUnclaimed
+static void releaseHeld(const char *handle, uint8_t *buffer, int len) {
+    int at = 0;
+    while (onUnclaimed != NULL && len - at > PDU_HEADER_LEN) {
+        uint16_t lengthField;
+        memcpy(&lengthField, buffer + at, sizeof(lengthField));
+        int framedLen = ntohs(lengthField);
+        if (framedLen <= PDU_HEADER_LEN || framedLen > len - at) {
+            break;
+        }
+        onUnclaimed(handle, buffer + at + PDU_HEADER_LEN, framedLen - PDU_HEADER_LEN);
+        at += framedLen;
+    }
+}
+
+static void graceOver(Timer *timer, void *arg) {
+    HeldSession *session = arg;
+    char handle[PDU_MAX_HANDLE + 1];
+    strcpy(handle, session->handle);
+    releaseHeld(handle, session->buffer, session->bufferLen);
+    freeHeld(findHeld(pduViewOf(handle)));
+    if (onExpired != NULL) {
+        onExpired(handle);
+    }
+}
+
+static void freeHeld(HeldSession **link) {
+    HeldSession *session = *link;
+    *link = session->next;
+    timerCancel(&session->graceTimer);
+    free(session->buffer);
+    free(session->rooms);
+    free(session);
+}
+
+static int holdIn(HeldSession *session, uint8_t *pdu, int pduLen) {
+    int framedLen = PDU_HEADER_LEN + pduLen;
+    if (session->bufferLen + framedLen > RESUME_MAX_BYTES) {
+        session->dropped++;
+        return -1;
+    }
+    if (session->bufferLen + framedLen > session->bufferSize) {
+        int newSize = session->bufferSize > 0 ? session->bufferSize * 2 : 4096;
+        while (newSize < session->bufferLen + framedLen) {
+            newSize *= 2;
+        }
+        uint8_t *buffer = realloc(session->buffer, newSize);
+        if (buffer == NULL) {
+            session->dropped++;
+            return -1;
+        }
+        session->buffer = buffer;
+        session->bufferSize = newSize;
+    }
+    uint16_t lengthField = htons(framedLen);
+    memcpy(session->buffer + session->bufferLen, &lengthField, sizeof(lengthField));
+    memcpy(session->buffer + session->bufferLen + PDU_HEADER_LEN, pdu, pduLen);
+    session->bufferLen += framedLen;
+    return 0;
+}
@@ -0,0 +1,61 @@
+// resume.h
+// Session resumption.  A registered client is given a token, and when its
+// connection drops the handle is held for a grace window instead of being
+// freed: nobody else can take it, and what is sent to it meanwhile is kept,
+// already framed, in one buffer.  The session stays in its rooms, so room
+// traffic is kept too.  A reconnect that shows the token within the window
+// gets the handle and its rooms back, and the buffer is fed to it as
+// catch-up (connSetRefill()) so it never crowds out live traffic.
+#ifndef __RESUME_H__
+#define __RESUME_H__
+
+#include <stdint.h>
+
+#include "pduView.h"
+#include "snapshot.h"
+
+#define RESUME_TOKEN_LEN 16
+#define RESUME_MAX_BYTES (256 * 1024)   // held per session, later PDUs are dropped
+
+// Called when a window closes without a reconnect and the handle is free
+typedef void (*ResumeExpired)(const char *handle);
+// Called before that with each PDU that was held for handle, oldest first
+typedef void (*ResumeUnclaimed)(const char *handle, uint8_t *pdu, int pduLen);
+
+// Setup: graceMs 0 leaves resumption off
+void resumeInit(int graceMs, ResumeExpired expired, ResumeUnclaimed unclaimed);
+int resumeEnabled(void);
+int resumeGraceMs(void);
+
+// A fresh token for the session on socket, replacing any earlier one
+int resumeIssue(int socket, uint8_t *token);
+// 1 if token is the one issued to the session on socket
+int resumeIsTokenOf(int socket, PduView token);
+// The session ends for good when socket closes (its handle moved away)
+void resumeForget(int socket);
+
+// socket is closing: hold handle, and the names of the rooms socket is in,
+// for the grace window.  1 if it is held, 0 if the session has no token.
+int resumeSuspend(int socket, const char *handle);
+int resumeIsSuspended(PduView handle);
+
+// Keep a PDU (flag onward) for a held handle.  -1 if handle isn't held or
+// its buffer is full.
+int resumeHold(PduView handle, uint8_t *pdu, int pduLen);
+void resumeHoldAll(uint8_t *pdu, int pduLen);
+void resumeHoldRoom(const char *room, uint8_t *pdu, int pduLen);
+
+// A reconnect: resumeCheck() is 1 if token matches the session held for
+// handle, resumeClaim() then puts socket in the session's rooms, starts
+// feeding its buffer to socket and forgets the session.  Returns the bytes
+// held.
+int resumeCheck(PduView handle, PduView token);
+int resumeClaim(PduView handle, int socket);
+
+// Handoff (handoff.h): issued tokens, held sessions with what is left of
+// their windows, and the unqueued rest of buffers being fed in.  A server
+// without -G lets the sessions go as if their windows closed.
+void resumeSave(Snapshot *snapshot);
+int resumeLoad(Snapshot *snapshot);
+
+#endif
@@ -0,0 +1,180 @@
+// rooms.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rooms.h"
+
+static Room *buckets[ROOM_BUCKETS];
+static int rooms = 0;
+
+static Room **findLink(const char *name);
+static void freeRoom(Room **link);
+static uint32_t hashName(const char *name);
+
+Room *roomFind(const char *name) {
+    return *findLink(name);
+}
+
+// Subscribe socket to a room, creating the room if needed.
+// Returns the room, or NULL if out of memory.
+Room *roomJoin(const char *name, int socket) {
+    Room **link = findLink(name);
+    Room *room = *link;
+    if (room == NULL) {
+        room = calloc(1, sizeof(Room));
+        if (room == NULL || (room->name = strdup(name)) == NULL) {
+            free(room);
+            return NULL;
+        }
+        *link = room;
+        rooms++;
+    }
+
+    int word = socket / 64;
+    if (word >= room->memberWords) {
+        int words = word + 1;
+        uint64_t *members = realloc(room->members, words * sizeof(uint64_t));
+        if (members == NULL) {
+            if (room->memberCount == 0) freeRoom(link);
+            return NULL;
+        }
+        memset(members + room->memberWords, 0, (words - room->memberWords) * sizeof(uint64_t));
+        room->members = members;
+        room->memberWords = words;
+    }
+
+    if (!roomIsMember(room, socket)) {
+        room->members[word] |= 1ULL << (socket % 64);
+        room->memberCount++;
+    }
+    return room;
+}
+
+// Returns 0, or -1 if socket wasn't in the room.  Empty rooms are freed.
+int roomLeave(const char *name, int socket) {
+    Room **link = findLink(name);
+    Room *room = *link;
+    if (room == NULL || !roomIsMember(room, socket)) {
+        return -1;
+    }
+
+    room->members[socket / 64] &= ~(1ULL << (socket % 64));
+    room->memberCount--;
+    if (room->memberCount == 0) {
+        freeRoom(link);
+    }
+    return 0;
+}
+
+// A socket is going away: take it out of every room
+void roomLeaveAll(int socket) {
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        Room **link = &buckets[i];
+        while (*link != NULL) {
+            Room *room = *link;
+            if (roomIsMember(room, socket)) {
+                room->members[socket / 64] &= ~(1ULL << (socket % 64));
+                if (--room->memberCount == 0) {
+                    freeRoom(link);
+                    continue;
+                }
+            }
+            link = &room->next;
+        }
+    }
+}
+
+// Every room socket is in
+void roomForEachOf(int socket, void (*callback)(const char *name, void *arg), void *arg) {
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        for (Room *room = buckets[i]; room != NULL; room = room->next) {
+            if (roomIsMember(room, socket)) {
+                callback(room->name, arg);
+            }
+        }
+    }
+}
+
+void roomSave(Snapshot *snapshot) {
+    snapshotPutU32(snapshot, rooms);
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        for (Room *room = buckets[i]; room != NULL; room = room->next) {
+            snapshotPutString(snapshot, room->name);
+            snapshotPutU32(snapshot, room->memberCount);
+            for (int s = roomNextMember(room, 0); s >= 0; s = roomNextMember(room, s + 1)) {
+                snapshotPutSocket(snapshot, s);
+            }
+        }
+    }
+}
+
+int roomLoad(Snapshot *snapshot) {
+    char name[UINT8_MAX + 1];     // names come from PDUs, 8 bit length
+    uint32_t count = snapshotGetU32(snapshot);
+    for (uint32_t i = 0; i < count && !snapshot->failed; i++) {
+        snapshotGetString(snapshot, name, sizeof(name));
+        uint32_t members = snapshotGetU32(snapshot);
+        for (uint32_t m = 0; m < members && !snapshot->failed; m++) {
+            int socket = snapshotGetSocket(snapshot);
+            if (socket >= 0) {
+                roomJoin(name, socket);
+            }
+        }
+    }
+    return snapshot->failed ? -1 : 0;
+}
+
+int roomCount(void) {
+    return rooms;
+}
+
+int roomIsMember(Room *room, int socket) {
+    int word = socket / 64;
+    if (socket < 0 || word >= room->memberWords) {
+        return 0;
+    }
+    return (room->members[word] >> (socket % 64)) & 1;
+}
+
+// First subscribed socket at or after fromSocket, or -1
+int roomNextMember(Room *room, int fromSocket) {
+    if (fromSocket < 0) fromSocket = 0;
+
+    for (int word = fromSocket / 64; word < room->memberWords; word++) {
+        uint64_t bits = room->members[word];
+        if (word == fromSocket / 64) {
+            bits &= ~0ULL << (fromSocket % 64);
+        }
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+static Room **findLink(const char *name) {
+    Room **link = &buckets[hashName(name) % ROOM_BUCKETS];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void freeRoom(Room **link) {
+    Room *room = *link;
+    *link = room->next;
+    free(room->members);
+    free(room->name);
+    free(room);
+    rooms--;
+}
+
+// FNV-1a
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,39 @@
+// rooms.h
+// Named rooms for publish/subscribe.  Each room keeps its subscribers as a
+// bitset indexed by socket number, so fan-out walks set bits only and
+// membership tests are a single word lookup.
+#ifndef __ROOMS_H__
+#define __ROOMS_H__
+
+#include <stdint.h>
+
+#include "snapshot.h"
+
+#define ROOM_BUCKETS 256
+
+typedef struct Room {
+    struct Room *next;              // hash chain
+    char *name;
+    uint64_t *members;              // bit n set: socket n is subscribed
+    int memberWords;
+    int memberCount;
+} Room;
+
+// Functions to manage rooms (a room exists while it has members)
+Room *roomFind(const char *name);
+Room *roomJoin(const char *name, int socket);
+int roomLeave(const char *name, int socket);
+void roomLeaveAll(int socket);
+void roomForEachOf(int socket, void (*callback)(const char *name, void *arg), void *arg);
+int roomCount(void);
+
+// Members: test one, or walk them with
+//     for (s = roomNextMember(room, 0); s >= 0; s = roomNextMember(room, s + 1))
+int roomIsMember(Room *room, int socket);
+int roomNextMember(Room *room, int fromSocket);
+
+// Handoff (handoff.h): every room with its members
+void roomSave(Snapshot *snapshot);
+int roomLoad(Snapshot *snapshot);
+
+#endif
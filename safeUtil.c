@@ -24,9 +24,17 @@
 #include "networks.h"
 #include "safeUtil.h"
 
+// The socket calls report errors back to the caller instead of exiting:
+// a failure on one connection must not take the whole process down.
+
 int safeRecv(int socketNum, uint8_t * buffer, int bufferLen, int flag)
 {
-    int bytesReceived = recv(socketNum, buffer, bufferLen, flag);
+    int bytesReceived = 0;
+    do
+    {
+        bytesReceived = recv(socketNum, buffer, bufferLen, flag);
+    } while (bytesReceived < 0 && errno == EINTR);
+
     if (bytesReceived < 0)
     {
         if (errno == ECONNRESET)
@@ -36,7 +44,6 @@ int safeRecv(int socketNum, uint8_t * buffer, int bufferLen, int flag)
         else
         {
             perror("recv call");
-            exit(-1);
         }
     }
     return bytesReceived ;
@@ -45,11 +52,17 @@ int safeRecv(int socketNum, uint8_t * buffer, int bufferLen, int flag)
 int safeSend(int socketNum, uint8_t * buffer, int bufferLen, int flag)
 {
 	int bytesSent = 0;
-	if ((bytesSent = send(socketNum, buffer, bufferLen, flag)) < 0)
+
+	// MSG_NOSIGNAL: a peer that went away gives EPIPE here, not SIGPIPE
+	do
 	{
-        perror("recv call");
-       exit(-1);
-     }
+		bytesSent = send(socketNum, buffer, bufferLen, flag | MSG_NOSIGNAL);
+	} while (bytesSent < 0 && errno == EINTR);
+
+	if (bytesSent < 0)
+	{
+		perror("send call");
+	}
 	 
     return bytesSent;
 }
@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 
+// return -1 (errno set) on error, safeRecv() returns 0 for a reset
 int safeRecv(int socketNum, uint8_t * buffer, int bufferLen, int flag);
 int safeSend(int socketNum, uint8_t * buffer, int bufferLen, int flag);
 
@@ -15,4 +16,4 @@ void * srealloc(void *ptr, size_t size);
 void * sCalloc(size_t nmemb, size_t size);
 
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
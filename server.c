@@ -20,32 +20,210 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <getopt.h>
+#include <signal.h>
 
 #include "networks.h"
 #include "safeUtil.h"
 #include "pdu.h"
 #include "pollLib.h"
 #include "handleTable.h"
+#include "pduView.h"
+#include "pduSchema.h"
+#include "connection.h"
+#include "timerWheel.h"
+#include "journal.h"
+#include "history.h"
+#include "rooms.h"
+#include "cluster.h"
+#include "capture.h"
+#include "rateLimit.h"
+#include "affinity.h"
+#include "relay.h"
+#include "datagram.h"
+#include "resolver.h"
+#include "resume.h"
+#include "handoff.h"
 
 #define MAXBUF 1024
 #define DEBUG_FLAG 1
 #define MAX_HANDLES 9
 #define MAX_HANDLE_LENGTH 100
+#define REGISTRATION_TIMEOUT_MS 10000
+#define ACCEPT_BACKOFF_MS 100
+#define SERVER_USAGE "Usage %s [-b listen backlog] [-q max queued bytes] [-w max queued ms]\n" \
+    "\t[-P oldest|newest|disconnect] [-r registration timeout ms] [-i idle timeout ms]\n" \
+    "\t[-j journal directory] [-J journal sync ms] [-R history bytes] [-H history file]\n" \
+    "\t[-n cluster node name] [-p peer host:port]... [-a client host:port] [-c] [-k cluster key]\n" \
+    "\t[-C capture file] [-l unicast,multicast,broadcast per second]\n" \
+    "\t[-g fan-out deliveries per second] [-A cpu] [-u] [-z zerocopy min bytes] [-S] [-U]\n" \
+    "\t[-L local socket path] [-G resume grace ms] [-K handoff socket path]\n" \
+    "\t[optional port number]\n"
 
 void serverControl(int mainServerSocket); 
 void addNewSocket(int socketNumber); 
+Connection *openClient(int clientSocket);
 void processClient(int clientSocket); 
+int relayMessage(int clientSocket);
+void processDatagram(int clientSocket, uint8_t *pdu, int pduLen);
+void disconnectClient(int clientSocket);
+void dispatchPDU(int clientSocket, uint8_t *pdu, int pduLen);
 int checkArgs(int argc, char *argv[]);
+SlowPolicy parsePolicy(const char *name);
+void requestStats(int signalNumber);
+void shedAccepts(int mainServerSocket);
+void resumeAccepts(Timer *timer, void *arg);
+int isConnectionAcceptError(int error);
+void connectionExpired(Timer *timer, void *arg);
+int listenerPort(int mainServerSocket);
+
+// ----- Handoff Functions -----
+int handOff(int mainServerSocket);
+void saveState(Snapshot *snapshot, int mainServerSocket);
+void restoreState(Snapshot *snapshot, int mainServerSocket);
 
 // ----- Helper Functions ------
-int isHandleTaken(HandleNode *head, const uint8_t *handle);
-void initialPacket(int clientSocket, uint8_t *pdu, int pduLen); 
-void processMessage(int clientSocket, uint8_t *pdu, int pduLen); 
-void processMulticast(int clientSocket, uint8_t *pdu, int pduLen); 
-void processList(int clientSocket, uint8_t *pdu, int pduLen); 
-void processBroadcast(int clientSocket, uint8_t *pdu, int pduLen);
+void initialPacket(int clientSocket, const PduInitial *initial, uint8_t *pdu, int pduLen); 
+void resumePacket(int clientSocket, const PduResume *resume, uint8_t *pdu, int pduLen);
+void sendResumeToken(int clientSocket);
+void resumeExpired(const char *handle);
+void resumeUnclaimed(const char *handle, uint8_t *pdu, int pduLen);
+void processMessage(int clientSocket, const PduMessage *message, uint8_t *pdu, int pduLen); 
+void processMulticast(int clientSocket, const PduMulticast *multicast, uint8_t *pdu, int pduLen); 
+void processList(int clientSocket, const PduList *list, uint8_t *pdu, int pduLen); 
+void processBroadcast(int clientSocket, const PduBroadcast *broadcast, uint8_t *pdu, int pduLen);
+void processRoomJoin(int clientSocket, const PduRoomJoin *join, uint8_t *pdu, int pduLen);
+void processRoomLeave(int clientSocket, const PduRoomLeave *leave, uint8_t *pdu, int pduLen);
+void processRoomMessage(int clientSocket, const PduRoomMessage *message, uint8_t *pdu, int pduLen);
+int roomName(PduView room, char *name);
+void sendRoomError(int clientSocket, const char *room);
+void processPeerHello(int clientSocket, const PduPeerHello *hello, uint8_t *pdu, int pduLen);
+void processUdpRegister(int clientSocket, const PduUdpRegister *udp, uint8_t *pdu, int pduLen);
+void sendListHandle(const char *handle, void *arg);
+void sendRedirect(int clientSocket, const char *address);
+void rebalanceHandles(void);
+void sendPeerHandleError(int peerSocket, PduView sender, PduView destination);
+void sendHandleError(int clientSocket, PduView handle);
+void processPeerHandleError(int peerSocket, const PduPeerHandleError *error, uint8_t *pdu, int pduLen);
+void processPeerHandleAdd(int peerSocket, const PduPeerHandleAdd *add, uint8_t *pdu, int pduLen);
+void processPeerHandleRemove(int peerSocket, const PduPeerHandleRemove *remove, uint8_t *pdu, int pduLen);
+int isThrottled(int clientSocket, uint8_t flag, RateClass rateClass, int deliveries);
+void parseRates(const char *rates);
+
+// Every PDU the server takes, and its handler
+#define SERVER_PDUS(X) \
+    X(Initial,          initialPacket) \
+    X(Resume,           resumePacket) \
+    X(Message,          processMessage) \
+    X(Multicast,        processMulticast) \
+    X(Broadcast,        processBroadcast) \
+    X(List,             processList) \
+    X(RoomJoin,         processRoomJoin) \
+    X(RoomLeave,        processRoomLeave) \
+    X(RoomMessage,      processRoomMessage) \
+    X(PeerHello,        processPeerHello) \
+    X(UdpRegister,      processUdpRegister) \
+    X(PeerHandleAdd,    processPeerHandleAdd) \
+    X(PeerHandleRemove, processPeerHandleRemove) \
+    X(PeerHandleError,  processPeerHandleError)
+
+SERVER_PDUS(PDU_DISPATCHER)
+
+// Client PDUs by flag (a node dialing us sends its HELLO this way too)
+const PduHandler clientHandlers[PDU_FLAG_COUNT] = {
+    PDU_ROUTE(Initial, initialPacket)
+    PDU_ROUTE(Message, processMessage)
+    PDU_ROUTE(Multicast, processMulticast)
+    PDU_ROUTE(Broadcast, processBroadcast)
+    PDU_ROUTE(List, processList)
+    PDU_ROUTE(RoomJoin, processRoomJoin)
+    PDU_ROUTE(RoomLeave, processRoomLeave)
+    PDU_ROUTE(RoomMessage, processRoomMessage)
+    PDU_ROUTE(PeerHello, processPeerHello)
+    PDU_ROUTE(UdpRegister, processUdpRegister)
+    PDU_ROUTE(Resume, resumePacket)
+};
+
+// What a client may send over UDP: only what can stand to be lost
+const PduHandler datagramHandlers[PDU_FLAG_COUNT] = {
+    PDU_ROUTE(Broadcast, processBroadcast)
+};
+
+// Traffic from another node: delivered to our own handles, never forwarded
+const PduHandler peerHandlers[PDU_FLAG_COUNT] = {
+    PDU_ROUTE(PeerHandleAdd, processPeerHandleAdd)
+    PDU_ROUTE(PeerHandleRemove, processPeerHandleRemove)
+    PDU_ROUTE(PeerHandleError, processPeerHandleError)
+    PDU_ROUTE(Message, processMessage)
+    PDU_ROUTE(Multicast, processMulticast)
+    PDU_ROUTE(Broadcast, processBroadcast)
+};
 char handleNames[MAX_HANDLES][MAX_HANDLE_LENGTH];
 HandleNode *handleHead = NULL; 
+int listenBacklog = LISTEN_BACKLOG;
+int maxOutBytes = CONN_DEFAULT_MAX_OUT_BYTES;
+int maxOutMs = CONN_DEFAULT_MAX_OUT_MS;
+SlowPolicy slowPolicy = SLOW_DISCONNECT;
+int registrationTimeoutMs = REGISTRATION_TIMEOUT_MS;
+int idleTimeoutMs = 0;
+char *journalDirectory = NULL;
+int journalSyncMs = JOURNAL_DEFAULT_SYNC_MS;
+
+// Recent broadcasts, replayed to clients that ask for them when they register
+History *broadcastHistory = NULL;
+int historyBytes = HISTORY_DEFAULT_BYTES;
+char *historyFile = NULL;
+
+// Cluster mode: on with -n, or with -p (named after the listening address).
+// -c partitions handles across the nodes instead of replicating them, and
+// -k is the key a node has to show to link up.
+char *clusterNodeName = NULL;
+char *clusterAddress = NULL;
+char *clusterKey = NULL;
+int clusterPeers = 0;
+int clusterPartition = 0;
+
+// Every client PDU goes to this file for the replay tool (-C)
+char *capturePath = NULL;
+
+// Placement: -A pins the event loop to a core and steers the listener's
+// connections to it, -u shares the client port with the servers on the
+// other cores.  Those servers are separate chat servers: each has its own
+// handles, and a client only reaches the users that landed on its process.
+int loopCpu = AFFINITY_NONE;
+int sharePort = 0;
+
+// -S: %M between local clients is spliced through a pipe instead of read
+int spliceRelay = 0;
+
+// -U: broadcasts to and from clients that register a UDP port go as
+// datagrams, on the same port number as the listener
+int udpTransport = 0;
+
+// -L: a UNIX domain listener as well, for bots and bridges on this host
+char *localPath = NULL;
+int localServerSocket = -1;
+
+// -G: a dropped client's handle and messages are held this long for it
+int resumeGrace = 0;
+
+// -K: a new server started with the same path takes this one over, sockets
+// and all (handoff.h)
+char *handoffPath = NULL;
+int handoffSocket = -1;
+int handedOff = 0;
+Snapshot inherited;             // what the old server handed us
+int tookOver = 0;
+volatile sig_atomic_t statsRequested = 0;
+
+// Out of descriptors: one fd is held in reserve so pending connections can
+// still be accepted and closed, and accepting pauses for a back-off
+int spareFd = -1;
+Timer acceptTimer;
+Timer localAcceptTimer;
+uint64_t acceptsShed = 0;
 
 int main(int argc, char *argv[])
 {
@@ -54,11 +232,116 @@ int main(int argc, char *argv[])
 
 	portNumber = checkArgs(argc, argv);
     handleHead = createHandleTable(); 
-	mainServerSocket = tcpServerSetup(portNumber);   
+    timerWheelInit();
+    connSetLimits(maxOutBytes, maxOutMs, slowPolicy);
+    resumeInit(resumeGrace, resumeExpired, resumeUnclaimed);
+    if (loopCpu != AFFINITY_NONE) {
+        // lookups block, so the resolver threads stay off the loop's core
+        resolverAvoidCpu(loopCpu);
+        if (affinityPin(loopCpu) < 0) {
+            exit(-1);
+        }
+    }
+    // a peer or a redirected client dialing the shared port would land on
+    // any of the servers, not the node it meant
+    if (sharePort && (clusterNodeName != NULL || clusterPeers > 0)) {
+        fprintf(stderr, "A shared port (-u) can't be used with a cluster (-n, -p)\n");
+        exit(-1);
+    }
+    if (handoffPath != NULL && (clusterNodeName != NULL || clusterPeers > 0)) {
+        printf("Cluster links can't be handed over, -K is off\n");
+        handoffPath = NULL;
+    }
+    // a server already running at the handoff path gives us its sockets
+    if (handoffPath != NULL && (tookOver = handoffReceive(handoffPath, &inherited)) < 0) {
+        exit(-1);
+    }
+    int inheritedLocal = -1;
+    if (tookOver) {
+        mainServerSocket = snapshotGetSocket(&inherited);
+        inheritedLocal = snapshotGetSocket(&inherited);
+        if (mainServerSocket < 0) {
+            fprintf(stderr, "Handoff came without a listening socket\n");
+            exit(-1);
+        }
+        printf("Took over from the server at %s\n", handoffPath);
+    } else {
+	mainServerSocket = tcpServerSetup(portNumber, listenBacklog, sharePort);   
+    }
+    if (loopCpu != AFFINITY_NONE) {
+        affinitySteerListener(mainServerSocket, loopCpu);
+    }
+    if (localPath != NULL && inheritedLocal >= 0) {
+        localServerSocket = inheritedLocal;
+    } else if (localPath != NULL) {
+        localServerSocket = unixServerSetup(localPath, listenBacklog);
+    } else if (inheritedLocal >= 0) {
+        close(inheritedLocal);
+    }
+    if (handoffPath != NULL) {
+        handoffSocket = handoffListen(handoffPath);
+    }
+    spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+    if (journalDirectory != NULL && journalInit(journalDirectory, journalSyncMs) < 0) {
+        exit(-1);
+    }
+    if (historyBytes > 0 && (broadcastHistory = historyOpen(historyFile, historyBytes)) == NULL) {
+        exit(-1);
+    }
+    if (capturePath != NULL && captureStart(capturePath) < 0) {
+        exit(-1);
+    }
+    if (spliceRelay && capturePath != NULL) {
+        printf("Capture needs every PDU, splice relay is off\n");
+        spliceRelay = 0;
+    }
+    if (spliceRelay && relayInit() < 0) {
+        exit(-1);
+    }
+    if (udpTransport && sharePort) {
+        printf("Servers sharing a port can't share its datagrams, UDP is off\n");
+        udpTransport = 0;
+    }
+    if (udpTransport && !tookOver) {
+        datagramInit(listenerPort(mainServerSocket));
+    }
+    if (clusterNodeName != NULL || clusterPeers > 0) {
+        char defaultName[CLUSTER_NAME_MAX + 1];
+        struct sockaddr_in6 address;
+        socklen_t addressLen = sizeof(address);
+        char host[128] = "localhost";
+        getsockname(mainServerSocket, (struct sockaddr *)&address, &addressLen);
+        gethostname(host, sizeof(host) - 1);
+        snprintf(defaultName, sizeof(defaultName), "%s:%d", host, ntohs(address.sin6_port));
+        if (clusterNodeName == NULL) {
+            clusterNodeName = defaultName;
+        }
+        if (clusterAddress == NULL) {
+            clusterAddress = defaultName;
+        }
+        if (clusterInit(clusterNodeName, clusterAddress, clusterKey, clusterPartition) < 0) {
+            exit(-1);
+        }
+    }
 
     serverControl(mainServerSocket);
+    captureStop();
+    journalShutdown(0);
+    relayShutdown();
+    datagramShutdown();
+    historyClose(broadcastHistory);
     destroyHandleTable(handleHead);
 	close(mainServerSocket);
+    // after a handoff the paths belong to the new server
+    if (localServerSocket >= 0) {
+        close(localServerSocket);
+        if (!handedOff) unlink(localPath);
+    }
+    if (handoffSocket >= 0) {
+        close(handoffSocket);
+        if (!handedOff) unlink(handoffPath);
+    }
 
 	return 0;
 }
@@ -66,281 +349,866 @@ int main(int argc, char *argv[])
 void serverControl(int mainServerSocket){
     setupPollSet();
     addToPollSet(mainServerSocket);
+    if (localServerSocket >= 0) {
+        addToPollSet(localServerSocket);
+    }
+    if (handoffSocket >= 0) {
+        addToPollSet(handoffSocket);
+    }
+    if (tookOver) {
+        restoreState(&inherited, mainServerSocket);
+        snapshotFree(&inherited);
+    }
+    if (udpTransport) {
+        addToPollSet(datagramSocket());
+    }
+    // peers we dial are looked up off the loop
+    int resolverSocket = clusterPeers > 0 ? resolverFd() : -1;
+    if (resolverSocket >= 0) {
+        addToPollSet(resolverSocket);
+    }
+
+    // kill -USR1 <pid> prints the counters (no SA_RESTART so poll wakes up)
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStats;
+    sigaction(SIGUSR1, &action, NULL);
 
     while(1){
-        int socketNumber = pollCall(-1); 
-        printf("pollCall returned socketNumber: %d\n", socketNumber);
+        // sleep until I/O or the next timer deadline, whichever comes first
+        pollCallAll(timerNextTimeout(timerNowMs()));
 
-        if(socketNumber < 0){
-            printf("pollCall failed\n"); 
-            exit(-1); 
+        if (statsRequested) {
+            statsRequested = 0;
+            connPrintStats(stdout);
+            printf("Accepts shed while out of descriptors: %llu\n", (unsigned long long)acceptsShed);
+            printf("PDUs refused by rate limits: %llu\n", (unsigned long long)rateLimitRefused());
+            if (spliceRelay) {
+                printf("Messages spliced: %llu\n", (unsigned long long)relayCount());
+            }
+            if (udpTransport) {
+                datagramPrintStats(stdout);
+            }
+            fflush(stdout);
         }
 
-        (socketNumber == mainServerSocket) ?  addNewSocket(mainServerSocket) : processClient(socketNumber);
+        // Service every ready socket from this poll, not just the lowest
+        int socketNumber = 0;
+        int revents = 0;
+        while ((socketNumber = pollNextReady(&revents)) >= 0) {
+            if (socketNumber == mainServerSocket || socketNumber == localServerSocket) {
+                addNewSocket(socketNumber);
+                continue;
+            }
+            if (socketNumber == resolverSocket) {
+                resolverDispatch();
+                continue;
+            }
+            if (socketNumber == handoffSocket) {
+                if (handOff(mainServerSocket)) {
+                    return;
+                }
+                continue;
+            }
+            if (udpTransport && socketNumber == datagramSocket()) {
+                datagramReceive(processDatagram, MAXBUF);
+                continue;
+            }
+            if (clusterIsConnecting(socketNumber)) {
+                clusterFinishConnect(socketNumber);
+                continue;
+            }
+            if (revents & POLLERR) {
+                connZeroCopyDone(socketNumber);
+            }
+            if ((revents & POLLOUT) && connFlush(socketNumber) < 0) {
+                disconnectClient(socketNumber);
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+                processClient(socketNumber);
+            }
+        }
+        // one write per recipient for all the fan-out this wakeup read
+        connFlushDeferred();
+        if (udpTransport) {
+            datagramFlush();
+        }
+
+        timerRun(timerNowMs());
+
+        if (clusterRingChanged()) {
+            rebalanceHandles();
+        }
     }
 }
 
 
 void addNewSocket(int socketNumber){
-    // Processes a new connection (e.g. accept(), add to pollset())
-    int newSocket = tcpAccept(socketNumber, DEBUG_FLAG); 
-    addToPollSet(newSocket);
-    printf("New client connected: socket  %d\n", newSocket); 
+    // Drain the whole accept queue - during a reconnect storm one poll
+    // wakeup can have hundreds of connections behind it
+    while (1) {
+        int newSocket = tcpAcceptNonBlocking(socketNumber, DEBUG_FLAG);
+        if (newSocket < 0) {
+            if (isConnectionAcceptError(errno)) {
+                continue;   // that one connection failed, keep draining
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                shedAccepts(socketNumber);
+            }
+            break;          // EAGAIN: queue empty, anything else: try next wakeup
+        }
+        openClient(newSocket);
+        printf("New client connected: socket  %d\n", newSocket); 
+    }
+}
+
+Connection *openClient(int clientSocket){
+    Connection *conn = connOpen(clientSocket);
+    addToPollSet(clientSocket);
+    captureOpen(clientSocket);
+    rateLimitOpen(clientSocket);
+
+    // reap sockets that never send FLAG_CLIENT_TO_SEVER_INITIAL
+    timerInit(&conn->idleTimer, connectionExpired, conn);
+    if (registrationTimeoutMs > 0) {
+        timerSchedule(&conn->idleTimer, timerNowMs() + registrationTimeoutMs);
+    }
+    return conn;
+}
+
+int isConnectionAcceptError(int error){
+    // accept() errors that only concern the connection being accepted
+    // (Linux also passes pending network errors on the new socket through)
+    switch (error) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case ENETDOWN:
+        case ENOPROTOOPT:
+        case EHOSTDOWN:
+        case ENONET:
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void shedAccepts(int mainServerSocket){
+    // Give up the spare fd so the queued connections can be accepted and
+    // closed right away - those clients fail fast and retry instead of
+    // sitting in the backlog.  Then stop polling the listening socket for a
+    // moment so poll() doesn't spin on it.
+    if (spareFd >= 0) {
+        close(spareFd);
+        spareFd = -1;
+    }
+
+    int shedSocket = 0;
+    while ((shedSocket = tcpAcceptNonBlocking(mainServerSocket, 0)) >= 0) {
+        close(shedSocket);
+        acceptsShed++;
+    }
+    spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    printf("Out of descriptors, shed %llu connections so far, pausing accept\n",
+        (unsigned long long)acceptsShed);
+    // each listener backs off on its own timer
+    Timer *timer = mainServerSocket == localServerSocket ? &localAcceptTimer : &acceptTimer;
+    removeFromPollSet(mainServerSocket);
+    timerInit(timer, resumeAccepts, (void *)(intptr_t)mainServerSocket);
+    timerSchedule(timer, timerNowMs() + ACCEPT_BACKOFF_MS);
+}
+
+void resumeAccepts(Timer *timer, void *arg){
+    addToPollSet((int)(intptr_t)arg);
+}
+
+int listenerPort(int mainServerSocket){
+    struct sockaddr_in6 address;
+    socklen_t addressLen = sizeof(address);
+    getsockname(mainServerSocket, (struct sockaddr *)&address, &addressLen);
+    return ntohs(address.sin6_port);
+}
+
+void requestStats(int signalNumber){
+    statsRequested = 1;
+}
+
+void connectionExpired(Timer *timer, void *arg){
+    Connection *conn = arg;
+
+    if (conn->registered) {
+        // reads don't touch the timer, so check when it fires instead
+        uint64_t idleUntil = conn->lastActivity + idleTimeoutMs;
+        if (idleUntil > timerNowMs()) {
+            timerSchedule(timer, idleUntil);
+            return;
+        }
+        printf("Idle timeout: socket %d\n", conn->socket);
+    } else {
+        printf("Registration timeout: socket %d\n", conn->socket);
+    }
+    disconnectClient(conn->socket);
+}
+
+void disconnectClient(int clientSocket){
+    printf("Client disconnected: socket %d\n", clientSocket);
+    const char *handle = findHandleBySocket(handleHead, clientSocket);
+    if(handle != NULL && resumeSuspend(clientSocket, handle)){
+        // still ours as far as the other nodes know, until the window closes
+        printf("Holding handle %s for %d ms\n", handle, resumeGraceMs());
+        removeHandle(&handleHead, handle);
+    } else if(handle != NULL){
+        printf("Removing handle: %s\n", handle);
+        clusterAnnounce(handle, 0);
+        removeHandle(&handleHead, handle); 
+    } 
+    resumeForget(clientSocket);
+    roomLeaveAll(clientSocket);
+    datagramForget(clientSocket);
+    captureClose(clientSocket);
+    rateLimitClose(clientSocket);
+    clusterPeerClosed(clientSocket);
+    connClose(clientSocket);
+    removeFromPollSet(clientSocket);
+    close(clientSocket);
 }
 
 void processClient(int clientSocket){
-    printf("\nProcessing client on socket: %d\n", clientSocket);
-    uint8_t pdu[MAXBUF];
-    int pduLen = recvPDU(clientSocket, pdu, MAXBUF);
+    if (spliceRelay) {
+        int relayed = 0;
+        for (int i = 0; i < RELAY_MAX_PER_WAKEUP && (relayed = relayMessage(clientSocket)) > 0; i++) {
+        }
+        if (relayed == -1) {
+            disconnectClient(clientSocket);
+            return;
+        }
+        if (relayed != 0) {
+            return;     // at the limit, or waiting for the rest of a %M
+        }
+    }
 
+    int bytesRead = connRead(clientSocket);
+    if (bytesRead == CONN_AGAIN) {
+        return;
+    } else if (bytesRead <= 0) {
+        disconnectClient(clientSocket);
+        return;
+    }
+
+    // A single read may carry several PDUs
+    uint8_t *pdu = NULL;
+    int pduLen = 0;
+    while ((pduLen = connNextPDU(clientSocket, &pdu, MAXBUF)) > 0) {
+        // peer links and UDP ports aren't client traffic a replay can
+        // reproduce
+        if (pdu[0] != FLAG_PEER_HELLO && pdu[0] != FLAG_UDP_REGISTER && !clusterIsPeer(clientSocket)) {
+            capturePDU(clientSocket, pdu, pduLen);
+        }
+        dispatchPDU(clientSocket, pdu, pduLen);
+    }
     if (pduLen < 0) {
-        perror("recvPDU call");
-        close(clientSocket);
+        disconnectClient(clientSocket);
+    }
+}
+
+void dispatchPDU(int clientSocket, uint8_t *pdu, int pduLen){
+    int fromPeer = clusterIsPeer(clientSocket);
+    PduHandler handler = fromPeer ? peerHandlers[pdu[0]] : clientHandlers[pdu[0]];
+    if (handler == NULL) {
+        printf(fromPeer ? "Invalid flag from peer: %d\n" : "Invalid flag: %d\n", pdu[0]);
         return;
-    } else if (pduLen == 0) {
-        printf("Client disconnected: socket %d\n", clientSocket);
-        const char *handle = findHandleBySocket(handleHead, clientSocket);
-        if(handle != NULL){
-            printf("Removing handle: %s\n", handle);
-            removeHandle(&handleHead, handle); 
-        } 
-        removeFromPollSet(clientSocket);
-        close(clientSocket);
+    }
+    handler(clientSocket, pdu, pduLen);
+}
+
+void processBroadcast(int clientSocket, const PduBroadcast *broadcast, uint8_t *pdu, int pduLen){
+    if (isThrottled(clientSocket, FLAG_BROADCAST, RATE_BROADCAST, getNumHandles(handleHead))) {
         return;
     }
+    printf("Broadcast from [%.*s] (Length: %d)\n", broadcast->sender.length, broadcast->sender.data, broadcast->sender.length);
+    printf("Message received: %.*s\n", broadcast->text.length, broadcast->text.data);
 
-    uint8_t flag = pdu[0];
-    switch (flag) {
-		case FLAG_CLIENT_TO_SEVER_INITIAL:
-            initialPacket(clientSocket, pdu, pduLen); 
-            break;
+    // Queue for every handle except the sender, written at the end of the tick.
+    // Every queue references the same framed copy, and handles with a UDP
+    // port get it in the tick's datagram batch instead.
+    SharedPDU *shared = connSharePDU(pdu, pduLen);
+    for (HandleNode *node = handleHead; node != NULL; node = node->next) {
+        if (node->socket != clientSocket && datagramQueue(node->socket, shared) < 0) {
+            connDeferShared(node->socket, shared);
+        }
+    }
+    connReleaseShared(shared);
+    resumeHoldAll(pdu, pduLen);
+    // other nodes get it once each and deliver it to their own handles
+    if (!clusterIsPeer(clientSocket)) {
+        clusterBroadcast(pdu, pduLen);
+    }
+    historyAppend(broadcastHistory, pdu, pduLen);
+}
 
-        case FLAG_MESSAGE:
-            processMessage(clientSocket, pdu, pduLen); 
-            break;
 
-        case FLAG_MULTICAST:
-            processMulticast(clientSocket, pdu, pduLen); 
-            break; 
+// ----- Cluster -----
 
-        case FLAG_BROADCAST:
-            processBroadcast(clientSocket, pdu, pduLen); 
-            break; 
+void processPeerHandleAdd(int peerSocket, const PduPeerHandleAdd *add, uint8_t *pdu, int pduLen){
+    // a node can't claim a handle registered (or held for resuming) here
+    if (findSocketByView(handleHead, add->handle) >= 0 || resumeIsSuspended(add->handle)) {
+        printf("Peer on socket %d claims %.*s, held here, ignoring it\n", peerSocket, add->handle.length, add->handle.data);
+        return;
+    }
+    clusterPeerHandle(peerSocket, add->handle, 1);
+}
 
-        case FLAG_LIST:
-            processList(clientSocket, pdu, pduLen); 
-            break;
+void processPeerHandleRemove(int peerSocket, const PduPeerHandleRemove *remove, uint8_t *pdu, int pduLen){
+    clusterPeerHandle(peerSocket, remove->handle, 0);
+}
 
-        default:
-            printf("Invalid flag: %d\n", flag);
-            break;
-    }    
-}
-
-void processBroadcast(int clientSocket, uint8_t *pdu, int pduLen){
-    int offset = 1;
-
-// ----- Sender: Handle Length, Handle name -----
-    uint8_t senderHandleLength = pdu[offset++];
-    uint8_t senderHandle[100];
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-    senderHandle[senderHandleLength] = '\0';
-    offset += senderHandleLength; 
-    printf("Broadcast from [%s] (Length: %u)\n", senderHandle, senderHandleLength);
-
-// ----- Message -----
-    uint8_t message[100];    
-    int messageLength = pduLen - offset;
-    memcpy(message, pdu + offset, messageLength); 
-    message[messageLength] = '\0'; 
-    printf("Message received: %s\n", message);
-
-// Get current handles count and broadcast to all except sender
-    int handleCount = getNumHandles(handleHead);
-    printf("Total handles to receive broadcast: %d\n", handleCount);
+void processPeerHello(int clientSocket, const PduPeerHello *hello, uint8_t *pdu, int pduLen){
+    Connection *conn = connGet(clientSocket);
+    int isUser = findHandleBySocket(handleHead, clientSocket) != NULL;
+    if (!clusterEnabled() || isUser || !clusterHello(clientSocket, hello)) {
+        // the normal disconnect path runs once poll reports the EOF
+        shutdown(clientSocket, SHUT_RDWR);
+        return;
+    }
+
+    // a peer, not a user: no deadlines, and it learns every local handle.
+    // Dropping directory or forwarded PDUs would split the cluster, so the
+    // link is never treated as a slow consumer either.
+    conn->registered = 1;
+    conn->unlimited = 1;
+    timerCancel(&conn->idleTimer);
+    timerCancel(&conn->writeTimer);
+    for (HandleNode *node = handleHead; node != NULL; node = node->next) {
+        clusterAnnounceTo(clientSocket, node->handle);
+    }
+}
+
+// PEER_HANDLE_ERROR: a forwarded %M or %C named a handle the far node
+// doesn't have
+void sendPeerHandleError(int peerSocket, PduView sender, PduView destination){
+    uint8_t errorPdu[2 * UINT8_MAX + 3];
+    connSendPDU(peerSocket, errorPdu, pduEncodePeerHandleError(errorPdu, sizeof(errorPdu), sender, destination));
+}
+
+void processPeerHandleError(int peerSocket, const PduPeerHandleError *error, uint8_t *pdu, int pduLen){
+    // to the sender it's the usual error
+    int senderSocket = findSocketByView(handleHead, error->sender);
+    if (senderSocket >= 0) {
+        sendHandleError(senderSocket, error->destination);
+    }
+}
+
+// REDIRECT: "host:port" of the node owning the handle
+void sendRedirect(int clientSocket, const char *address){
+    uint8_t redirectPdu[CLUSTER_NAME_MAX + 2];
+    connSendPDU(clientSocket, redirectPdu, pduEncodeRedirect(redirectPdu, sizeof(redirectPdu), pduViewOf(address)));
+}
+
+// Nodes came or went, so some handles hash to another node now.  Only the
+// ones next to the changed node's points move - send those clients over.
+void rebalanceHandles(void){
+    int moved = 0;
+    for (HandleNode *node = handleHead; node != NULL; node = node->next) {
+        const char *address = clusterOwnerAddress(node->handle);
+        if (address != NULL) {
+            resumeForget(node->socket);             // the handle is the other node's now
+            sendRedirect(node->socket, address);     // the client hangs up and moves
+            moved++;
+        }
+    }
+    printf("Cluster ring changed, %d of %d local handles moved\n", moved, getNumHandles(handleHead));
+}
+
+// ----- Rooms -----
+// A ROOM_MESSAGE is forwarded as is to the other members.
+
+void processRoomJoin(int clientSocket, const PduRoomJoin *join, uint8_t *pdu, int pduLen){
+    char room[UINT8_MAX + 1];
+    Connection *conn = connGet(clientSocket);
+    if (conn == NULL || !conn->registered || roomName(join->room, room) < 0) {
+        return;
+    }
+    Room *joined = roomJoin(room, clientSocket);
+    if (joined == NULL) {
+        sendRoomError(clientSocket, room);
+        return;
+    }
+    printf("Socket %d joined room %s (%d members)\n", clientSocket, room, joined->memberCount);
+}
+
+void processRoomLeave(int clientSocket, const PduRoomLeave *leave, uint8_t *pdu, int pduLen){
+    char room[UINT8_MAX + 1];
+    if (roomName(leave->room, room) < 0) {
+        return;
+    }
+    if (roomLeave(room, clientSocket) < 0) {
+        sendRoomError(clientSocket, room);
+        return;
+    }
+    printf("Socket %d left room %s\n", clientSocket, room);
+}
 
-    for (int i = 0; i < handleCount; i++) {
-        const char *handle = getHandleByIndex(handleHead, i);
-        int destSocket = findSocketByHandle(handleHead, handle);
+void processRoomMessage(int clientSocket, const PduRoomMessage *message, uint8_t *pdu, int pduLen){
+    char room[UINT8_MAX + 1];
+    if (roomName(message->room, room) < 0) return;
 
-        if (destSocket != clientSocket) { // Do not send back to the sender
-        // Send the constructed PDU
-        int destSocket = findSocketByHandle(handleHead, handle);
-        printf("Sending multicast message to: %s (Socket: %d)\n", handle, destSocket);
-        sendPDU(destSocket, pdu, pduLen);
+    Room *target = roomFind(room);
+    if (target == NULL || !roomIsMember(target, clientSocket)) {
+        sendRoomError(clientSocket, room);
+        return;
+    }
+    // a room can hold everyone, so it costs what a multicast to all of it would
+    if (isThrottled(clientSocket, FLAG_ROOM_MESSAGE, RATE_MULTICAST, target->memberCount)) {
+        return;
+    }
+
+    // one pass over the subscriber bits, nobody else is looked at
+    SharedPDU *shared = connSharePDU(pdu, pduLen);
+    for (int member = roomNextMember(target, 0); member >= 0; member = roomNextMember(target, member + 1)) {
+        if (member != clientSocket) {
+            connDeferShared(member, shared);
         }
     }
+    connReleaseShared(shared);
+    // and for members whose client dropped and may be back
+    resumeHoldRoom(room, pdu, pduLen);
+}
+
+// Copy a room name into name (UINT8_MAX + 1 bytes, NUL terminated), -1 if
+// it is empty
+int roomName(PduView room, char *name){
+    if (room.length == 0) return -1;
+    return pduViewString(room, name, UINT8_MAX + 1);
+}
+
+void sendRoomError(int clientSocket, const char *room){
+    uint8_t errorPdu[UINT8_MAX + 2];
+    connSendPDU(clientSocket, errorPdu, pduEncodeRoomError(errorPdu, sizeof(errorPdu), pduViewOf(room)));
 }
 
 
-void processList(int clientSocket, uint8_t *pdu, int pduLen){
+void processList(int clientSocket, const PduList *list, uint8_t *pdu, int pduLen){
     int handleCount = getNumHandles(handleHead);
-    printf("Starting to process the list of handles. Total handles: %d\n", handleCount);
+    int remoteCount = clusterHandleCount();
+    // a PDU per handle, as much work as a broadcast
+    if (isThrottled(clientSocket, FLAG_LIST, RATE_BROADCAST, handleCount + remoteCount)) {
+        return;
+    }
+    printf("Starting to process the list of handles. Total handles: %d\n", handleCount + remoteCount);
     // Send the total number of handles
-    uint32_t networkHandleCount = htonl(handleCount);  // Convert to network byte order
-    uint8_t initialPdu[1024];
-    int len = 0;
-    initialPdu[len++] = FLAG_LIST_COUNT;  // Flag = 11
-    memcpy(initialPdu + len, &networkHandleCount, sizeof(networkHandleCount));
-    len += sizeof(networkHandleCount);
-    sendPDU(clientSocket, initialPdu, len);
-    printf("Sent count of handles to client: %u\n", handleCount);
-
-    // Send each handle name
-    uint8_t handlePdu[MAXBUF];
-    for (int i = 0; i < handleCount; i++) {
-        const char *handle = getHandleByIndex(handleHead, i);
-        if (handle) {
-            len = 0;
-            handlePdu[len++] = FLAG_LIST_HANDLE;  // Flag = 12
-            uint8_t handleLength = strlen(handle);
-            handlePdu[len++] = handleLength;
-            memcpy(handlePdu + len, handle, handleLength);
-            len += handleLength;
-            sendPDU(clientSocket, handlePdu, len);
-            printf("Sent handle [%d]: %s\n", i + 1, handle);
-        }
+    uint8_t listPdu[UINT8_MAX + 2];
+    connSendPDU(clientSocket, listPdu, pduEncodeListCount(listPdu, sizeof(listPdu), handleCount + remoteCount));
+    printf("Sent count of handles to client: %u\n", handleCount + remoteCount);
+
+    // Send each handle name, ours and then the ones held by other nodes
+    for (HandleNode *node = handleHead; node != NULL; node = node->next) {
+        sendListHandle(node->handle, &clientSocket);
     }
+    clusterForEachHandle(sendListHandle, &clientSocket);
     // Send end of list flag
-    uint8_t lastPdu[MAXBUF];
-    len = 0;
-    lastPdu[len++] = FLAG_LIST_END;  // Flag = 13
-    sendPDU(clientSocket, lastPdu, len);  // No additional data needed for this message
+    connSendPDU(clientSocket, listPdu, pduEncodeListEnd(listPdu, sizeof(listPdu)));
     printf("Sent end of handle list signal to client.\n");
 }
 
 
-void processMulticast(int clientSocket, uint8_t *pdu, int pduLen){
-	int offset = 1;
-// ----- Sender: Handle Length, Handle name -----
-    uint8_t senderHandleLength = pdu[offset++]; 
-    uint8_t senderHandle[100];
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-    senderHandle[senderHandleLength] = '\0';                
-    offset += senderHandleLength; 
-// ----- Number of handles -----
-    int numHandles = pdu[offset++];                           
-// ----- Destination:  Handle Lengths, Handle Names -----
-    char handleNames[MAX_HANDLES][100];  // Adjust MAX_HANDLES as needed
-    int validHandlesCount = 0;
+void sendListHandle(const char *handle, void *arg){
+    uint8_t handlePdu[UINT8_MAX + 2];
+    connSendPDU(*(int *)arg, handlePdu, pduEncodeListHandle(handlePdu, sizeof(handlePdu), pduViewOf(handle)));
+}
+
+void processMulticast(int clientSocket, const PduMulticast *multicast, uint8_t *pdu, int pduLen){
+    const PduHandleList *destinations = &multicast->destinations;
+    if (isThrottled(clientSocket, FLAG_MULTICAST, RATE_MULTICAST, destinations->count)) {
+        return;
+    }
+    int fromPeer = clusterIsPeer(clientSocket);
+    int destinationSockets[PDU_MAX_DESTINATIONS];
+    int destinationCount = 0;
+    int ownerSockets[PDU_MAX_DESTINATIONS];     // nodes holding some of the destinations
+    int ownerCount = 0;
 // ----- Validate each destination handle
-    for (int i = 0; i < numHandles; i++) {
-        uint8_t destinationHandleLength = pdu[offset++];
-        char destinationHandle[100];
-        memcpy(destinationHandle, pdu + offset, destinationHandleLength);
-        destinationHandle[destinationHandleLength] = '\0';
-        offset += destinationHandleLength;
-
-        if (findHandle(handleHead, destinationHandle)) {
-            // Store valid handle names if necessary
-            strcpy(handleNames[validHandlesCount++], destinationHandle);
-            printf("Valid handle added: %s\n", destinationHandle);
-
-            // Prepare and send an error PDU for the first invalid handle found
+    for (int i = 0; i < destinations->count; i++) {
+        PduView destination = destinations->items[i];
+        int destinationSocket = findSocketByView(handleHead, destination);
+        int owner = -1;
+
+        if (destinationSocket >= 0) {
+            destinationSockets[destinationCount++] = destinationSocket;
+            printf("Valid handle added: %.*s\n", destination.length, destination.data);
+
+        } else if (resumeIsSuspended(destination)) {
+            resumeHold(destination, pdu, pduLen);
+        } else if (fromPeer) {
+            // the origin reported handles it couldn't find, but with a
+            // partitioned directory only the owner (us) can tell
+            if (clusterPartitioned() && clusterFindHandle(destination) < 0) {
+                sendPeerHandleError(clientSocket, multicast->sender, destination);
+            }
+        } else if ((owner = clusterFindHandle(destination)) >= 0) {
+            // on another node - that node picks out its own handles
+            int known = 0;
+            for (int j = 0; j < ownerCount; j++) {
+                known |= ownerSockets[j] == owner;
+            }
+            if (!known) {
+                ownerSockets[ownerCount++] = owner;
+            }
         } else {
-            uint8_t errorPDU[MAXBUF];
-            int errorPDULen = 0;
-            errorPDU[errorPDULen++] = FLAG_HANDLE_ERROR;
-            errorPDU[errorPDULen++] = destinationHandleLength;
-            memcpy(errorPDU + errorPDULen, destinationHandle, destinationHandleLength);
-            errorPDULen += destinationHandleLength;
-            sendPDU(clientSocket, errorPDU, errorPDULen);
-            printf("Invalid handle found, error PDU sent for: %s\n", destinationHandle);
+            sendHandleError(clientSocket, destination);
+            printf("Invalid handle found, error PDU sent for: %.*s\n", destination.length, destination.data);
         }
     }
 // ----- Send  message to  valid handles -----
-    for (int i = 0; i < validHandlesCount; i++) {
-        // Send the constructed PDU
-        int destSocket = findSocketByHandle(handleHead, handleNames[i]);
-        printf("Sending multicast message to: %s (Socket: %d)\n", handleNames[i], destSocket);
-        sendPDU(destSocket, pdu, pduLen);
-    }
-}
-
-
-
-void processMessage(int clientSocket, uint8_t *pdu, int pduLen){
-	int offset = 1;
-// ----- Sender: Handle Length, Handle name -----
-    uint8_t senderHandleLength = pdu[offset];
-    offset++; 
-    uint8_t senderHandle[100];
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-// ----- Sender: Handle Length, Handle name -----
-    offset += senderHandleLength; 
-// ----- M and C bit -----
-    offset++; 
-// ----- Destination:  Handle Length, Handle Name -----
-    uint8_t destinationHandleLength = pdu[offset];
-    offset++; 
-    uint8_t destinationHandle[100];
-    memcpy(destinationHandle, pdu + offset, destinationHandleLength);
-    destinationHandle[destinationHandleLength] = '\0'; // Always NULL
-    offset += destinationHandleLength; 
+    for (int i = 0; i < destinationCount; i++) {
+        connSendPDU(destinationSockets[i], pdu, pduLen);
+    }
+    for (int i = 0; i < ownerCount; i++) {
+        connSendPDU(ownerSockets[i], pdu, pduLen);
+    }
+}
+
+
+
+void processMessage(int clientSocket, const PduMessage *message, uint8_t *pdu, int pduLen){
+    if (isThrottled(clientSocket, FLAG_MESSAGE, RATE_UNICAST, 1)) {
+        return;
+    }
+    PduView destination = message->destinations.items[0];
+    char offlineHandle[PDU_MAX_HANDLE + 1];
 // ----- Check Destination Handle -----
-    const char *handle = findHandle(handleHead, (char *)destinationHandle);
-    printf("handle: %s, Dest handle: %s\n", handle, destinationHandle ); 
-
-    if(handle == NULL){
-        uint8_t noHandle[MAXBUF];
-        int noH_Len = 0;
-        noHandle[0] = FLAG_HANDLE_ERROR; 
-        noH_Len++; 
-
-        noHandle[noH_Len] = destinationHandleLength; 
-        noH_Len++; 
-        memcpy(noHandle + noH_Len, destinationHandle, destinationHandleLength); 
-        noH_Len += destinationHandleLength; 
-        sendPDU(clientSocket, noHandle, noH_Len); 
-        // *destinationHandle = 0; 
-        return;      
+    int socket = findSocketByView(handleHead, destination);
+    int ownerSocket = socket < 0 ? clusterFindHandle(destination) : -1;
+
+    if(socket >= 0){
+        printf("Destination Found: %.*s, Socket: %d\n", destination.length, destination.data, socket);
+        connSendPDU(socket, pdu, pduLen);
+    } else if(resumeIsSuspended(destination)){
+        // its client dropped and may be back within the window
+        resumeHold(destination, pdu, pduLen);
+    } else if(ownerSocket >= 0 && !clusterIsPeer(clientSocket)){
+        // held by another node
+        connSendPDU(ownerSocket, pdu, pduLen);
+    } else if(journalEnabled() && pduViewString(destination, offlineHandle, sizeof(offlineHandle)) == 0
+            && journalAppend(offlineHandle, pdu, pduLen) == 0){
+        // offline: held in the journal until the handle registers
+        printf("Stored message for offline handle: %s\n", offlineHandle);
+    } else if(clusterIsPeer(clientSocket)){
+        // the sender is on the node that forwarded this
+        sendPeerHandleError(clientSocket, message->sender, destination);
     } else{
-        int socket = findSocketByHandle(handleHead, (char *)destinationHandle);
-        printf("Destination Found: %s, Socket: %d\n",destinationHandle, socket); 
-        sendPDU(socket, pdu, pduLen);                
+        sendHandleError(clientSocket, destination);
+    }
+}
+
+// Splice relay: a %M to a local handle with nothing queued for it, from a
+// client with nothing buffered, moves without its text being read.
+// Anything else is left for the normal path.  Returns 1 if a message was
+// taken, 0 if not, RELAY_INCOMPLETE if one is still arriving, -1 if the
+// sender's socket broke.
+int relayMessage(int clientSocket){
+    Connection *conn = connGet(clientSocket);
+    if (conn == NULL || !conn->registered || conn->inLen > conn->inStart) {
+        return 0;
     }
+    uint8_t header[RELAY_MAX_HEADER];
+    PduMessage message;
+    int headerLen = 0;
+    int pduLen = relayPeekMessage(clientSocket, MAXBUF, header, &message, &headerLen);
+    if (pduLen <= 0) {
+        return pduLen;
+    }
+
+    PduView destination = message.destinations.items[0];
+    int socket = findSocketByView(handleHead, destination);
+    Connection *out = connGet(socket);
+    if (out == NULL || out->outHead != NULL || out->closing) {
+        return 0;
+    }
+    if (isThrottled(clientSocket, FLAG_MESSAGE, RATE_UNICAST, 1)) {
+        return relayDiscard(clientSocket, pduLen) < 0 ? -1 : 1;
+    }
+    printf("Destination Found: %.*s, Socket: %d\n", destination.length, destination.data, socket);
+    return relayForward(clientSocket, socket, header, headerLen, pduLen) < 0 ? -1 : 1;
 }
 
+// A PDU that came in over UDP, from the client registered on clientSocket
+void processDatagram(int clientSocket, uint8_t *pdu, int pduLen){
+    Connection *conn = connGet(clientSocket);
+    PduHandler handler = datagramHandlers[pdu[0]];
+    if (conn == NULL || handler == NULL) {
+        return;
+    }
+    conn->lastActivity = timerNowMs();
+    capturePDU(clientSocket, pdu, pduLen);
+    handler(clientSocket, pdu, pduLen);
+}
 
-void initialPacket(int clientSocket, uint8_t *pdu, int pduLen){
-    int offset = 1;
-    uint8_t senderHandleLength = pdu[offset++]; 
-    uint8_t senderHandle[100];
-    memcpy(senderHandle, pdu + offset, senderHandleLength);
-    senderHandle[senderHandleLength] = '\0'; // Always NULL
+// UDP_REGISTER: answered with the id the client's datagrams start with;
+// without -U it's ignored and the client stays on TCP.
+void processUdpRegister(int clientSocket, const PduUdpRegister *udp, uint8_t *pdu, int pduLen){
+    Connection *conn = connGet(clientSocket);
+    if (!udpTransport || conn == NULL || !conn->registered) {
+        return;
+    }
+    if (datagramRegister(clientSocket, udp->port) < 0) {
+        return;
+    }
+    printf("Socket %d takes broadcasts on UDP port %d\n", clientSocket, udp->port);
+    uint8_t confirmPdu[5];
+    connSendPDU(clientSocket, confirmPdu, pduEncodeUdpConfirm(confirmPdu, sizeof(confirmPdu), clientSocket));
+}
+
+// Over its budget: the PDU (flag) is dropped and the sender told when to
+// retry.  Forwarded traffic was already limited on the node it came from.
+int isThrottled(int clientSocket, uint8_t flag, RateClass rateClass, int deliveries){
+    if (clusterIsPeer(clientSocket)) {
+        return 0;
+    }
+    uint32_t retryMs = rateLimitTake(clientSocket, rateClass, deliveries);
+    if (retryMs == 0) {
+        return 0;
+    }
+    uint8_t throttledPdu[6];
+    connSendPDU(clientSocket, throttledPdu, pduEncodeThrottled(throttledPdu, sizeof(throttledPdu), flag, retryMs));
+    return 1;
+}
+
+void sendHandleError(int clientSocket, PduView handle){
+    uint8_t errorPdu[UINT8_MAX + 2];
+    connSendPDU(clientSocket, errorPdu, pduEncodeHandleError(errorPdu, sizeof(errorPdu), handle));
+}
+
+void initialPacket(int clientSocket, const PduInitial *initial, uint8_t *pdu, int pduLen){
+    char senderHandle[PDU_MAX_HANDLE + 1];     // kept by the table, so it needs a NUL
+    // a connection registers once, a second handle would share its socket
+    if (connGet(clientSocket)->registered) {
+        printf("Socket %d is already registered, INITIAL ignored\n", clientSocket);
+        return;
+    }
+    pduViewString(initial->handle, senderHandle, sizeof(senderHandle));
     
-    if (isHandleTaken(handleHead, senderHandle)) {
+    const char *ownerAddress = clusterOwnerAddress(senderHandle);
+    if (ownerAddress != NULL) {
+        printf("Handle '%s' belongs on %s, redirecting\n", senderHandle, ownerAddress);
+        sendRedirect(clientSocket, ownerAddress);
+    } else if (findSocketByView(handleHead, initial->handle) >= 0 || clusterFindHandle(initial->handle) >= 0
+            || resumeIsSuspended(initial->handle)) {
         printf("Handle '%s' is already taken\n", senderHandle);
-        uint8_t rejectPdu[MAXBUF];
-        int rejectPduLen = 0;
-        rejectPdu[rejectPduLen++] = FLAG_HANDLE_REJECT;
-        rejectPdu[rejectPduLen++] = senderHandleLength;
-        memcpy(rejectPdu + rejectPduLen, senderHandle, senderHandleLength);
-        rejectPduLen += senderHandleLength;
-        sendPDU(clientSocket, rejectPdu, rejectPduLen);
+        uint8_t rejectPdu[UINT8_MAX + 2];
+        connSendPDU(clientSocket, rejectPdu, pduEncodeReject(rejectPdu, sizeof(rejectPdu), initial->handle));
+    } else if (!addHandle(&handleHead, senderHandle, clientSocket)) {
+        printf("Handle '%s' could not be added\n", senderHandle);
+        uint8_t rejectPdu[UINT8_MAX + 2];
+        connSendPDU(clientSocket, rejectPdu, pduEncodeReject(rejectPdu, sizeof(rejectPdu), initial->handle));
+    } else {
+        // the handle was free and is in the table now
+        clusterAnnounce(senderHandle, 1);
+        Connection *conn = connGet(clientSocket);
+        conn->registered = 1;
+        if (idleTimeoutMs > 0) {
+            timerSchedule(&conn->idleTimer, timerNowMs() + idleTimeoutMs);
+        } else {
+            timerCancel(&conn->idleTimer);
+        }
+        uint8_t confirmPdu[2];
+        connSendPDU(clientSocket, confirmPdu, pduEncodeConfirm(confirmPdu, sizeof(confirmPdu), 0));
+        sendResumeToken(clientSocket);
+
+        // optional count after the handle: recent broadcasts to catch up on
+        PduInitialHistory history;
+        if (pduDecodeInitialHistory(pdu, pduLen, &history) == 0) {
+            int replayed = historyReplay(broadcastHistory, history.historyCount, clientSocket);
+            printf("Replayed %d broadcasts to %s\n", replayed, senderHandle);
+        }
+        journalReplay(senderHandle, clientSocket);
+
+        printf("Initial packet -- socket %d, handle: %s\n", clientSocket, senderHandle);
+    }
+}
+
+// RESUME: a client back from a dropped connection.  With the token of the
+// session held for its handle it gets the handle straight back (CONFIRM
+// status 1) and what was held for it, otherwise it's an INITIAL.
+void resumePacket(int clientSocket, const PduResume *resume, uint8_t *pdu, int pduLen){
+    char handle[PDU_MAX_HANDLE + 1];
+    Connection *conn = connGet(clientSocket);
+    if (conn->registered) {
+        printf("Socket %d is already registered, RESUME ignored\n", clientSocket);
+        return;
+    }
+    // the client saw its connection die before we did: retire the old one
+    int oldSocket = findSocketByView(handleHead, resume->handle);
+    if (oldSocket >= 0 && oldSocket != clientSocket && resumeIsTokenOf(oldSocket, resume->token)) {
+        disconnectClient(oldSocket);
+    }
+    if (!resumeCheck(resume->handle, resume->token)) {
+        PduInitial initial = { FLAG_CLIENT_TO_SEVER_INITIAL, resume->handle };
+        initialPacket(clientSocket, &initial, NULL, 0);
+        return;
+    }
+
+    pduViewString(resume->handle, handle, sizeof(handle));
+    if (!addHandle(&handleHead, handle, clientSocket)) {
+        printf("Handle '%s' could not be added back\n", handle);
+        uint8_t rejectPdu[UINT8_MAX + 2];
+        connSendPDU(clientSocket, rejectPdu, pduEncodeReject(rejectPdu, sizeof(rejectPdu), resume->handle));
+        return;
+    }
+    conn->registered = 1;
+    if (idleTimeoutMs > 0) {
+        timerSchedule(&conn->idleTimer, timerNowMs() + idleTimeoutMs);
     } else {
-        // If handle is not taken, add it to the table
-    addHandle(&handleHead, (char *)senderHandle, clientSocket);
-    uint8_t confirmPdu[MAXBUF];
-    confirmPdu[0] = FLAG_HANDLE_CONFIRM;  // Using same flag for consistency
-    confirmPdu[1] = 0;  // Length of 0 can indicate error
-    sendPDU(clientSocket, confirmPdu, 2);
+        timerCancel(&conn->idleTimer);
+    }
+    uint8_t confirmPdu[2];
+    connSendPDU(clientSocket, confirmPdu, pduEncodeConfirm(confirmPdu, sizeof(confirmPdu), 1));
+    sendResumeToken(clientSocket);
+    int heldBytes = resumeClaim(resume->handle, clientSocket);
+    printf("Resumed %s on socket %d, %d bytes held for it\n", handle, clientSocket, heldBytes);
+}
+
+// RESUME_TOKEN: flag, grace ms, token length, token.  Only with -G.
+void sendResumeToken(int clientSocket){
+    uint8_t token[RESUME_TOKEN_LEN];
+    if (resumeIssue(clientSocket, token) < 0) {
+        return;
+    }
+    uint8_t tokenPdu[RESUME_TOKEN_LEN + 6];
+    PduView tokenView = { token, RESUME_TOKEN_LEN };
+    connSendPDU(clientSocket, tokenPdu, pduEncodeResumeToken(tokenPdu, sizeof(tokenPdu), resumeGraceMs(), tokenView));
+}
+
+void resumeExpired(const char *handle){
+    printf("Resume window closed, removing handle: %s\n", handle);
+    clusterAnnounce(handle, 0);
+}
 
-    printf("Initial packet -- socket %d, handle: %s\n", clientSocket, senderHandle);
+// What was sent to the handle itself goes where it would have gone had the
+// handle been offline all along
+void resumeUnclaimed(const char *handle, uint8_t *pdu, int pduLen){
+    if (journalEnabled() && (pdu[0] == FLAG_MESSAGE || pdu[0] == FLAG_MULTICAST)
+            && journalAppend(handle, pdu, pduLen) == 0) {
+        printf("Stored held message for offline handle: %s\n", handle);
     }
 }
 
+// ----- Handoff -----
+
+// A successor connected on the handoff socket: it gets every socket and the
+// state that goes with them.  1 once it has them and this server is done,
+// 0 if it failed and this server carries on.
+int handOff(int mainServerSocket){
+    int successor = handoffAccept(handoffSocket);
+    if (successor < 0) {
+        return 0;
+    }
+    printf("Handing over to a new server\n");
+    connFlushDeferred();
+    if (udpTransport) {
+        datagramFlush();
+    }
+
+    Snapshot snapshot;
+    snapshotInit(&snapshot);
+    saveState(&snapshot, mainServerSocket);
+    int sent = handoffSend(successor, &snapshot);
+    snapshotFree(&snapshot);
+    if (sent < 0) {
+        printf("Handoff failed, carrying on\n");
+        close(successor);
+        return 0;
+    }
+
+    // the successor opens these files only once we close our end, and
+    // listens on the handoff path once nothing here does
+    captureStop();
+    journalShutdown(1);
+    historyClose(broadcastHistory);
+    broadcastHistory = NULL;
+    close(handoffSocket);
+    handoffSocket = -1;
+    close(successor);
+    handedOff = 1;
+    printf("Handed over\n");
+    return 1;
+}
+
+// Listeners, then every client with its handle and buffered bytes, then
+// what the modules keep per socket.  restoreState() reads it in this order.
+void saveState(Snapshot *snapshot, int mainServerSocket){
+    snapshotPassSocket(snapshot, mainServerSocket);
+    snapshotPassSocket(snapshot, localServerSocket);
+
+    // a slow consumer that was cut off stays behind
+    int clients = 0;
+    for (int s = connNext(0); s >= 0; s = connNext(s + 1)) {
+        clients += !connGet(s)->closing;
+    }
+    snapshotPutU32(snapshot, clients);
+    for (int s = connNext(0); s >= 0; s = connNext(s + 1)) {
+        Connection *conn = connGet(s);
+        if (conn->closing) continue;
+        const char *handle = findHandleBySocket(handleHead, s);
+        snapshotPassSocket(snapshot, s);
+        snapshotPutU8(snapshot, conn->registered);
+        snapshotPutString(snapshot, handle != NULL ? handle : "");
+        connSave(s, snapshot);
+    }
+    datagramSave(snapshot);
+    roomSave(snapshot);
+    resumeSave(snapshot);
+}
+
+void restoreState(Snapshot *snapshot, int mainServerSocket){
+    uint32_t clients = snapshotGetU32(snapshot);
+    for (uint32_t i = 0; i < clients && !snapshot->failed; i++) {
+        char handle[PDU_MAX_HANDLE + 1];
+        int clientSocket = snapshotGetSocket(snapshot);
+        int registered = snapshotGetU8(snapshot);
+        snapshotGetString(snapshot, handle, sizeof(handle));
+        if (clientSocket < 0) {
+            connRestore(clientSocket, snapshot);    // skips its bytes
+            continue;
+        }
 
-// Implement the handle check function
-int isHandleTaken(HandleNode *head, const uint8_t *handle) {
-    HandleNode *current = head;
-    while (current != NULL) {
-        if (strcmp((char *)handle, current->handle) == 0) {
-            return 1;  // Handle is taken
+        // a relay that was waiting for a whole %M raised this
+        int lowWater = 1;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVLOWAT, &lowWater, sizeof(lowWater));
+        Connection *conn = openClient(clientSocket);
+        if (connRestore(clientSocket, snapshot) < 0) {
+            disconnectClient(clientSocket);
+            continue;
         }
-        current = current->next;
+        if (registered) {
+            conn->registered = 1;
+            if (handle[0] != '\0' && !addHandle(&handleHead, handle, clientSocket)) {
+                disconnectClient(clientSocket);
+                continue;
+            }
+            if (idleTimeoutMs > 0) {
+                timerSchedule(&conn->idleTimer, timerNowMs() + idleTimeoutMs);
+            } else {
+                timerCancel(&conn->idleTimer);
+            }
+            // a replay the old server had running goes on from what it had
+            // queued, ahead of anything stored since
+            if (handle[0] != '\0') {
+                journalReplay(handle, clientSocket);
+            }
+        }
+    }
+    datagramLoad(snapshot, udpTransport ? listenerPort(mainServerSocket) : 0);
+    roomLoad(snapshot);
+    resumeLoad(snapshot);
+    if (snapshot->failed) {
+        printf("Handoff snapshot was cut short, some state is lost\n");
     }
-    return 0;  // Handle is not taken
+    printf("Restored %d clients, %d handles, %d rooms\n", (int)clients, getNumHandles(handleHead), roomCount());
 }
 
 
@@ -348,17 +1216,135 @@ int checkArgs(int argc, char *argv[])
 {
 	// Checks args and returns port number
 	int portNumber = 0;
+	int option = 0;
+
+	while ((option = getopt(argc, argv, "b:q:w:P:r:i:j:J:R:H:n:p:a:ck:C:l:g:A:uz:SUL:G:K:")) != -1)
+	{
+		switch (option)
+		{
+			case 'b':
+				listenBacklog = atoi(optarg);
+				break;
+			case 'q':
+				maxOutBytes = atoi(optarg);
+				break;
+			case 'w':
+				maxOutMs = atoi(optarg);
+				break;
+			case 'P':
+				slowPolicy = parsePolicy(optarg);
+				break;
+			case 'r':
+				registrationTimeoutMs = atoi(optarg);
+				break;
+			case 'i':
+				idleTimeoutMs = atoi(optarg);
+				break;
+			case 'j':
+				journalDirectory = optarg;
+				break;
+			case 'J':
+				journalSyncMs = atoi(optarg);
+				break;
+			case 'R':
+				historyBytes = atoi(optarg);
+				break;
+			case 'H':
+				historyFile = optarg;
+				break;
+			case 'n':
+				clusterNodeName = optarg;
+				break;
+			case 'p':
+				if (clusterAddPeer(optarg) < 0) {
+					exit(-1);
+				}
+				clusterPeers++;
+				break;
+			case 'a':
+				clusterAddress = optarg;
+				break;
+			case 'c':
+				clusterPartition = 1;
+				break;
+			case 'k':
+				clusterKey = optarg;
+				break;
+			case 'C':
+				capturePath = optarg;
+				break;
+			case 'l':
+				parseRates(optarg);
+				break;
+			case 'g':
+				rateLimitSetGlobal(atoi(optarg));
+				break;
+			case 'A':
+				loopCpu = atoi(optarg);
+				break;
+			case 'u':
+				sharePort = 1;
+				break;
+			case 'z':
+				connSetZeroCopy(atoi(optarg));
+				break;
+			case 'S':
+				spliceRelay = 1;
+				break;
+			case 'U':
+				udpTransport = 1;
+				break;
+			case 'L':
+				localPath = optarg;
+				break;
+			case 'G':
+				resumeGrace = atoi(optarg);
+				break;
+			case 'K':
+				handoffPath = optarg;
+				break;
+			default:
+				fprintf(stderr, SERVER_USAGE, argv[0]);
+				exit(-1);
+		}
+	}
 
-	if (argc > 2)
+	if (argc - optind > 1)
 	{
-		fprintf(stderr, "Usage %s [optional port number]\n", argv[0]);
+		fprintf(stderr, SERVER_USAGE, argv[0]);
 		exit(-1);
 	}
 	
-	if (argc == 2)
+	if (argc - optind == 1)
 	{
-		portNumber = atoi(argv[1]);
+		portNumber = atoi(argv[optind]);
 	}
 	
 	return portNumber;
-}
\ No newline at end of file
+}
+
+SlowPolicy parsePolicy(const char *name)
+{
+	// slow consumer policy from its -P name
+	if (strcmp(name, "oldest") == 0) return SLOW_DROP_OLDEST;
+	if (strcmp(name, "newest") == 0) return SLOW_DROP_NEWEST;
+	if (strcmp(name, "disconnect") == 0) return SLOW_DISCONNECT;
+
+	fprintf(stderr, "Unknown slow consumer policy: %s (oldest, newest, disconnect)\n", name);
+	exit(-1);
+}
+
+void parseRates(const char *rates)
+{
+	// -l unicast,multicast,broadcast PDUs per second per client, 0 for no limit
+	int unicast = 0;
+	int multicast = 0;
+	int broadcast = 0;
+	if (sscanf(rates, "%d,%d,%d", &unicast, &multicast, &broadcast) != 3) {
+		fprintf(stderr, "Rates must be unicast,multicast,broadcast: %s\n", rates);
+		exit(-1);
+	}
+	rateLimitSet(RATE_UNICAST, unicast);
+	rateLimitSet(RATE_MULTICAST, multicast);
+	rateLimitSet(RATE_BROADCAST, broadcast);
+}
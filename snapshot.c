@@ -0,0 +1,190 @@
+// snapshot.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_INITIAL_SIZE 4096
+#define SOCKET_TABLE_GROW 64
+
+static uint8_t *reserve(Snapshot *snapshot, int len);
+static const uint8_t *consume(Snapshot *snapshot, int len);
+
+void snapshotInit(Snapshot *snapshot) {
+    memset(snapshot, 0, sizeof(Snapshot));
+}
+
+void snapshotFree(Snapshot *snapshot) {
+    free(snapshot->bytes);
+    free(snapshot->sockets);
+    free(snapshot->socketMap);
+    snapshotInit(snapshot);
+}
+
+// ----- Writing -----
+
+void snapshotPutU8(Snapshot *snapshot, uint8_t value) {
+    uint8_t *at = reserve(snapshot, sizeof(value));
+    if (at != NULL) *at = value;
+}
+
+void snapshotPutU16(Snapshot *snapshot, uint16_t value) {
+    uint8_t *at = reserve(snapshot, sizeof(value));
+    value = htons(value);
+    if (at != NULL) memcpy(at, &value, sizeof(value));
+}
+
+void snapshotPutU32(Snapshot *snapshot, uint32_t value) {
+    uint8_t *at = reserve(snapshot, sizeof(value));
+    value = htonl(value);
+    if (at != NULL) memcpy(at, &value, sizeof(value));
+}
+
+void snapshotPutU64(Snapshot *snapshot, uint64_t value) {
+    snapshotPutU32(snapshot, value >> 32);
+    snapshotPutU32(snapshot, value & UINT32_MAX);
+}
+
+void snapshotPutBytes(Snapshot *snapshot, const void *bytes, int len) {
+    snapshotPutU32(snapshot, len);
+    uint8_t *at = reserve(snapshot, len);
+    if (at != NULL && len > 0) memcpy(at, bytes, len);
+}
+
+void snapshotPutString(Snapshot *snapshot, const char *string) {
+    int len = strlen(string);
+    if (len > UINT16_MAX) {
+        snapshot->failed = 1;
+        return;
+    }
+    snapshotPutU16(snapshot, len);
+    uint8_t *at = reserve(snapshot, len);
+    if (at != NULL) memcpy(at, string, len);
+}
+
+void snapshotPassSocket(Snapshot *snapshot, int socket) {
+    if (socket >= 0 && !snapshot->failed) {
+        if (snapshot->socketCount == snapshot->socketSize) {
+            int newSize = snapshot->socketSize + SOCKET_TABLE_GROW;
+            int *sockets = realloc(snapshot->sockets, newSize * sizeof(int));
+            if (sockets == NULL) {
+                snapshot->failed = 1;
+                return;
+            }
+            snapshot->sockets = sockets;
+            snapshot->socketSize = newSize;
+        }
+        snapshot->sockets[snapshot->socketCount++] = socket;
+    }
+    snapshotPutSocket(snapshot, socket);
+}
+
+void snapshotPutSocket(Snapshot *snapshot, int socket) {
+    snapshotPutU32(snapshot, (uint32_t)socket);
+}
+
+// ----- Reading -----
+
+uint8_t snapshotGetU8(Snapshot *snapshot) {
+    const uint8_t *at = consume(snapshot, 1);
+    return at != NULL ? *at : 0;
+}
+
+uint16_t snapshotGetU16(Snapshot *snapshot) {
+    uint16_t value = 0;
+    const uint8_t *at = consume(snapshot, sizeof(value));
+    if (at != NULL) memcpy(&value, at, sizeof(value));
+    return ntohs(value);
+}
+
+uint32_t snapshotGetU32(Snapshot *snapshot) {
+    uint32_t value = 0;
+    const uint8_t *at = consume(snapshot, sizeof(value));
+    if (at != NULL) memcpy(&value, at, sizeof(value));
+    return ntohl(value);
+}
+
+uint64_t snapshotGetU64(Snapshot *snapshot) {
+    uint64_t high = snapshotGetU32(snapshot);
+    return high << 32 | snapshotGetU32(snapshot);
+}
+
+int snapshotGetBytes(Snapshot *snapshot, const uint8_t **bytes) {
+    uint32_t len = snapshotGetU32(snapshot);
+    if (len > INT32_MAX || (*bytes = consume(snapshot, len)) == NULL) {
+        snapshot->failed = 1;
+        return -1;
+    }
+    return len;
+}
+
+int snapshotGetString(Snapshot *snapshot, char *string, int size) {
+    int len = snapshotGetU16(snapshot);
+    const uint8_t *at = consume(snapshot, len);
+    if (at == NULL || len >= size) {
+        snapshot->failed = 1;
+        return -1;
+    }
+    memcpy(string, at, len);
+    string[len] = '\0';
+    return len;
+}
+
+int snapshotGetSocket(Snapshot *snapshot) {
+    int oldSocket = (int)snapshotGetU32(snapshot);
+    if (snapshot->failed || oldSocket < 0 || oldSocket >= snapshot->socketMapSize) {
+        return -1;
+    }
+    return snapshot->socketMap[oldSocket];
+}
+
+int snapshotMapSocket(Snapshot *snapshot, int oldSocket, int newSocket) {
+    if (oldSocket < 0) return -1;
+    if (oldSocket >= snapshot->socketMapSize) {
+        int newSize = oldSocket + SOCKET_TABLE_GROW;
+        int *map = realloc(snapshot->socketMap, newSize * sizeof(int));
+        if (map == NULL) return -1;
+        for (int i = snapshot->socketMapSize; i < newSize; i++) {
+            map[i] = -1;
+        }
+        snapshot->socketMap = map;
+        snapshot->socketMapSize = newSize;
+    }
+    snapshot->socketMap[oldSocket] = newSocket;
+    return 0;
+}
+
+static uint8_t *reserve(Snapshot *snapshot, int len) {
+    if (snapshot->failed || len < 0) {
+        snapshot->failed = 1;
+        return NULL;
+    }
+    if (snapshot->len + len > snapshot->size) {
+        int newSize = snapshot->size > 0 ? snapshot->size : SNAPSHOT_INITIAL_SIZE;
+        while (newSize < snapshot->len + len) {
+            newSize *= 2;
+        }
+        uint8_t *bytes = realloc(snapshot->bytes, newSize);
+        if (bytes == NULL) {
+            snapshot->failed = 1;
+            return NULL;
+        }
+        snapshot->bytes = bytes;
+        snapshot->size = newSize;
+    }
+    uint8_t *at = snapshot->bytes + snapshot->len;
+    snapshot->len += len;
+    return at;
+}
+
+static const uint8_t *consume(Snapshot *snapshot, int len) {
+    if (snapshot->failed || len < 0 || len > snapshot->len - snapshot->readAt) {
+        snapshot->failed = 1;
+        return NULL;
+    }
+    const uint8_t *at = snapshot->bytes + snapshot->readAt;
+    snapshot->readAt += len;
+    return at;
+}
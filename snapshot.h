@@ -0,0 +1,54 @@
+// snapshot.h
+// A byte buffer of server state in network byte order, for handing a
+// running server over to a new process (handoff.h).  Modules write their
+// own sections and read them back in the same order.  Sockets go with the
+// snapshot: a record names one by its number in the old process, and the
+// reader maps that to the descriptor it received.
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+typedef struct Snapshot {
+    uint8_t *bytes;
+    int len;
+    int size;
+    int readAt;
+    int failed;                     // out of memory, or read past the end
+    int *sockets;                   // writer: the sockets to pass
+    int socketCount;
+    int socketSize;
+    int *socketMap;                 // reader: by old number, the descriptor here
+    int socketMapSize;
+} Snapshot;
+
+void snapshotInit(Snapshot *snapshot);
+void snapshotFree(Snapshot *snapshot);
+
+// Writing.  A failure sets snapshot->failed and later writes do nothing.
+void snapshotPutU8(Snapshot *snapshot, uint8_t value);
+void snapshotPutU16(Snapshot *snapshot, uint16_t value);
+void snapshotPutU32(Snapshot *snapshot, uint32_t value);
+void snapshotPutU64(Snapshot *snapshot, uint64_t value);
+void snapshotPutBytes(Snapshot *snapshot, const void *bytes, int len);   // 32 bit length first
+void snapshotPutString(Snapshot *snapshot, const char *string);         // 16 bit length first
+
+// A socket that goes with the snapshot (-1 for none), and a reference to
+// one that was passed already
+void snapshotPassSocket(Snapshot *snapshot, int socket);
+void snapshotPutSocket(Snapshot *snapshot, int socket);
+
+// Reading.  Past the end sets snapshot->failed and returns 0 (-1 for the
+// lengths and sockets).  snapshotGetBytes() points into the snapshot.
+uint8_t snapshotGetU8(Snapshot *snapshot);
+uint16_t snapshotGetU16(Snapshot *snapshot);
+uint32_t snapshotGetU32(Snapshot *snapshot);
+uint64_t snapshotGetU64(Snapshot *snapshot);
+int snapshotGetBytes(Snapshot *snapshot, const uint8_t **bytes);
+int snapshotGetString(Snapshot *snapshot, char *string, int size);
+int snapshotGetSocket(Snapshot *snapshot);     // this process's descriptor, -1 if none
+
+// Receiving side: oldSocket arrived as newSocket
+int snapshotMapSocket(Snapshot *snapshot, int oldSocket, int newSocket);
+
+#endif
@@ -0,0 +1,283 @@
+// timerWheel.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timerWheel.h"
+
+#define ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define MAX_TICKS ((1ULL << (TIMER_ROOT_BITS + (TIMER_LEVELS - 1) * TIMER_LEVEL_BITS)) - 1)
+#define FIRING_LEVEL -2         // timer sits on the local list in timerRun()
+
+// Each slot is a circular list with a sentinel head.  The occupancy
+// bitmaps let timerNextTimeout() and timerRun() skip empty slots.
+static Timer root[ROOT_SIZE];
+static Timer levels[TIMER_LEVELS - 1][LEVEL_SIZE];
+static uint64_t rootBits[ROOT_SIZE / 64];
+static uint64_t levelBits[TIMER_LEVELS - 1];
+
+static uint64_t currentTick = 0;
+static uint64_t startMs = 0;
+static int pendingTimers = 0;
+
+static void listInit(Timer *head);
+static void listAppend(Timer *head, Timer *timer);
+static void listUnlink(Timer *timer);
+static int listEmpty(Timer *head);
+static void placeTimer(Timer *timer);
+static void cascade(int level);
+static int nextRootSlot(int fromSlot);
+static uint64_t msToTick(uint64_t ms);
+
+void timerWheelInit(void) {
+    for (int i = 0; i < ROOT_SIZE; i++) {
+        listInit(&root[i]);
+    }
+    for (int level = 0; level < TIMER_LEVELS - 1; level++) {
+        for (int i = 0; i < LEVEL_SIZE; i++) {
+            listInit(&levels[level][i]);
+        }
+    }
+    memset(rootBits, 0, sizeof(rootBits));
+    memset(levelBits, 0, sizeof(levelBits));
+
+    startMs = timerNowMs();
+    currentTick = 0;
+    pendingTimers = 0;
+}
+
+// Monotonic milliseconds, the clock every deadline is measured against
+uint64_t timerNowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timerInit(Timer *timer, TimerCallback callback, void *arg) {
+    memset(timer, 0, sizeof(Timer));
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->level = -1;
+}
+
+int timerPending(Timer *timer) {
+    return timer->level != -1;
+}
+
+// (Re)arm a timer for an absolute timerNowMs() deadline
+void timerSchedule(Timer *timer, uint64_t expiresMs) {
+    if (timerPending(timer)) {
+        timerCancel(timer);
+    }
+    timer->expires = msToTick(expiresMs);
+    placeTimer(timer);
+    pendingTimers++;
+}
+
+void timerCancel(Timer *timer) {
+    if (!timerPending(timer)) return;
+
+    listUnlink(timer);
+
+    // the slot may be empty now - keep its occupancy bit honest
+    if (timer->level == 0 && listEmpty(&root[timer->slot])) {
+        rootBits[timer->slot / 64] &= ~(1ULL << (timer->slot % 64));
+    } else if (timer->level > 0 && listEmpty(&levels[timer->level - 1][timer->slot])) {
+        levelBits[timer->level - 1] &= ~(1ULL << timer->slot);
+    }
+
+    timer->level = -1;
+    pendingTimers--;
+}
+
+int timerCount(void) {
+    return pendingTimers;
+}
+
+// Milliseconds until the next slot that needs attention, for poll().
+// -1 when nothing is pending.  For timers on the upper levels this is when
+// their slot cascades, which is never later than the timer itself.
+int timerNextTimeout(uint64_t nowMs) {
+    if (pendingTimers == 0) {
+        return -1;
+    }
+
+    uint64_t nextTick = 0;
+    int slot = nextRootSlot(currentTick & ROOT_MASK);
+    if ((currentTick & ROOT_MASK) == 0) {
+        nextTick = currentTick;     // a cascade is due before anything else
+    } else if (slot >= 0) {
+        nextTick = (currentTick & ~(uint64_t)ROOT_MASK) + slot;
+    } else {
+        // nothing left in this lap of the root wheel, wake up to cascade
+        nextTick = (currentTick | ROOT_MASK) + 1;
+    }
+
+    uint64_t deadlineMs = startMs + nextTick * TIMER_TICK_MS;
+    if (deadlineMs <= nowMs) {
+        return 0;
+    }
+    uint64_t wait = deadlineMs - nowMs;
+    return wait > 0x7fffffff ? 0x7fffffff : (int)wait;
+}
+
+// Advance the wheel to nowMs, firing every timer that has expired.
+// Callbacks may schedule or cancel any timer, including their own.
+void timerRun(uint64_t nowMs) {
+    uint64_t targetTick = nowMs >= startMs ? (nowMs - startMs) / TIMER_TICK_MS : 0;
+
+    while (currentTick <= targetTick) {
+        int index = currentTick & ROOT_MASK;
+
+        // at the start of each root lap pull the next slot of each level down
+        if (index == 0) {
+            for (int level = 1; level < TIMER_LEVELS; level++) {
+                cascade(level);
+                int shift = TIMER_ROOT_BITS + (level - 1) * TIMER_LEVEL_BITS;
+                if (((currentTick >> shift) & LEVEL_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+
+        if (!listEmpty(&root[index])) {
+            Timer firing;
+            listInit(&firing);
+
+            // move the slot to a local list so callbacks can re-arm freely
+            firing.next = root[index].next;
+            firing.prev = root[index].prev;
+            firing.next->prev = &firing;
+            firing.prev->next = &firing;
+            listInit(&root[index]);
+            rootBits[index / 64] &= ~(1ULL << (index % 64));
+
+            for (Timer *t = firing.next; t != &firing; t = t->next) {
+                t->level = FIRING_LEVEL;
+            }
+
+            // step first, anything re-armed for "now" lands in the next tick
+            currentTick++;
+            while (!listEmpty(&firing)) {
+                Timer *timer = firing.next;
+                listUnlink(timer);
+                timer->level = -1;
+                pendingTimers--;
+                timer->callback(timer, timer->arg);
+            }
+        } else {
+            currentTick++;
+        }
+
+        // jump over empty slots, stopping at the next lap boundary
+        if (currentTick <= targetTick && (currentTick & ROOT_MASK) != 0) {
+            int slot = nextRootSlot(currentTick & ROOT_MASK);
+            uint64_t lapEnd = (currentTick | ROOT_MASK) + 1;
+            uint64_t next = slot >= 0 ? (currentTick & ~(uint64_t)ROOT_MASK) + slot : lapEnd;
+            currentTick = next < targetTick + 1 ? next : targetTick + 1;
+        }
+    }
+}
+
+static void placeTimer(Timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < currentTick) {
+        expires = currentTick;      // already due, fire on the next run
+    }
+    if (expires - currentTick > MAX_TICKS) {
+        expires = currentTick + MAX_TICKS;
+    }
+    timer->expires = expires;
+
+    uint64_t delta = expires - currentTick;
+    if (delta < ROOT_SIZE) {
+        int slot = expires & ROOT_MASK;
+        listAppend(&root[slot], timer);
+        rootBits[slot / 64] |= 1ULL << (slot % 64);
+        timer->level = 0;
+        timer->slot = slot;
+        return;
+    }
+
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_ROOT_BITS + (level - 1) * TIMER_LEVEL_BITS;
+        if (delta < (1ULL << (shift + TIMER_LEVEL_BITS)) || level == TIMER_LEVELS - 1) {
+            int slot = (expires >> shift) & LEVEL_MASK;
+            listAppend(&levels[level - 1][slot], timer);
+            levelBits[level - 1] |= 1ULL << slot;
+            timer->level = level;
+            timer->slot = slot;
+            return;
+        }
+    }
+}
+
+// Re-file the timers of the current slot of a level into the lower levels
+static void cascade(int level) {
+    int shift = TIMER_ROOT_BITS + (level - 1) * TIMER_LEVEL_BITS;
+    int slot = (currentTick >> shift) & LEVEL_MASK;
+    Timer *head = &levels[level - 1][slot];
+
+    if (listEmpty(head)) return;
+
+    Timer moving;
+    moving.next = head->next;
+    moving.prev = head->prev;
+    moving.next->prev = &moving;
+    moving.prev->next = &moving;
+    listInit(head);
+    levelBits[level - 1] &= ~(1ULL << slot);
+
+    while (!listEmpty(&moving)) {
+        Timer *timer = moving.next;
+        listUnlink(timer);
+        placeTimer(timer);
+    }
+}
+
+// First occupied root slot at or after fromSlot in this lap, or -1
+static int nextRootSlot(int fromSlot) {
+    for (int word = fromSlot / 64; word < ROOT_SIZE / 64; word++) {
+        uint64_t bits = rootBits[word];
+        if (word == fromSlot / 64) {
+            bits &= ~0ULL << (fromSlot % 64);
+        }
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+static uint64_t msToTick(uint64_t ms) {
+    if (ms <= startMs) return 0;
+    // round up so a timer never fires early
+    return (ms - startMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+static void listInit(Timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void listAppend(Timer *head, Timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void listUnlink(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer;
+    timer->prev = timer;
+}
+
+static int listEmpty(Timer *head) {
+    return head->next == head;
+}
@@ -0,0 +1,42 @@
+// timerWheel.h
+// Hierarchical timing wheel (Varghese & Lauck, as in the classic Linux
+// kernel timers).  Timers are embedded in the structures that own them, so
+// scheduling and cancelling are O(1) with no allocation and millions of
+// pending timers cost only their own memory.
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10        // wheel resolution
+#define TIMER_ROOT_BITS 8       // level 0: 256 ticks (2.56 s)
+#define TIMER_LEVEL_BITS 6      // levels 1-3: 64 slots each (~7.7 days total)
+#define TIMER_LEVELS 4
+
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer *timer, void *arg);
+
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires;           // in ticks
+    TimerCallback callback;
+    void *arg;
+    int8_t level;               // -1 when not pending
+    uint8_t slot;
+};
+
+// Wheel setup and the event loop hooks
+void timerWheelInit(void);
+uint64_t timerNowMs(void);
+int timerNextTimeout(uint64_t nowMs);
+void timerRun(uint64_t nowMs);
+int timerCount(void);
+
+// Individual timers
+void timerInit(Timer *timer, TimerCallback callback, void *arg);
+void timerSchedule(Timer *timer, uint64_t expiresMs);
+void timerCancel(Timer *timer);
+int timerPending(Timer *timer);
+
+#endif